@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+
+# Writes include/case_table.h, the Unicode tables behind the UTF-8 case conversions, from the
+# Unicode database this Python ships with. Run it again after a Python upgrade to pick up a newer Unicode.
+
+import sys
+import unicodedata
+
+output_file = "include/case_table.h"
+case_per_line = 4
+word_per_line = 8
+delta_per_line = 16
+
+# Two-byte characters (Latin, Greek, Cyrillic, Armenian, Hebrew, Arabic) are looked up directly, the rest by range
+two_byte_first = 0x80
+two_byte_end = 0x800
+
+
+def utf8_len(cp):
+    return len(chr(cp).encode("utf-8"))
+
+
+# Simple case mapping: where the full mapping is several characters (ß -> SS) the character maps to itself
+def simple_mapping(cp, mapping):
+    mapped = mapping(chr(cp))
+
+    return ord(mapped) if len(mapped) == 1 else cp
+
+
+def scalar_values(first=two_byte_end):
+    return (cp for cp in range(first, 0x110000) if not 0xD800 <= cp < 0xE000)
+
+
+def two_byte_deltas(mapping):
+    return [simple_mapping(cp, mapping) - cp if utf8_len(simple_mapping(cp, mapping)) == 2 else 0 for cp in range(two_byte_first, two_byte_end)]
+
+
+def is_word(cp):
+    return unicodedata.category(chr(cp))[0] in "LMN"
+
+
+# Runs of code points with the same delta, either consecutive or every other one (Ā ā Ă ă ...)
+def case_ranges(mapping):
+    ranges = []
+    dropped = 0
+
+    for cp in scalar_values():
+        mapped = simple_mapping(cp, mapping)
+
+        if mapped == cp:
+            continue
+
+        # Conversions happen in place, so mappings that change the encoded length are left out
+        if utf8_len(mapped) != utf8_len(cp):
+            dropped += 1
+            continue
+
+        delta = mapped - cp
+
+        if ranges:
+            first, last, last_delta, stride = ranges[-1]
+
+            if last_delta == delta and (cp - last == stride or (first == last and cp - last in (1, 2))):
+                ranges[-1] = (first, cp, delta, cp - last)
+                continue
+
+        ranges.append((cp, cp, delta, 1))
+
+    return ranges, dropped
+
+
+# Letters, marks and numbers: the characters that keep a word going in title case
+def word_ranges():
+    ranges = []
+
+    for cp in scalar_values():
+        if is_word(cp):
+            if ranges and ranges[-1][1] == cp - 1:
+                ranges[-1][1] = cp
+            else:
+                ranges.append([cp, cp])
+
+    return ranges
+
+
+def write_rows(out, entries, per_line):
+    for i in range(0, len(entries), per_line):
+        out.write("    " + " ".join(entries[i:i + per_line]) + "\n")
+
+
+def main():
+    upper, upper_dropped = case_ranges(str.upper)
+    lower, lower_dropped = case_ranges(str.lower)
+    words = word_ranges()
+    word_bits = [0] * ((two_byte_end - two_byte_first) // 8)
+
+    for cp in range(two_byte_first, two_byte_end):
+        if is_word(cp):
+            word_bits[(cp - two_byte_first) // 8] |= 1 << (cp % 8)
+
+    # Two-byte characters whose mapping is longer or shorter are left out here as well
+    upper_dropped += sum(1 for cp in range(two_byte_first, two_byte_end) if simple_mapping(cp, str.upper) != cp and utf8_len(simple_mapping(cp, str.upper)) != 2)
+    lower_dropped += sum(1 for cp in range(two_byte_first, two_byte_end) if simple_mapping(cp, str.lower) != cp and utf8_len(simple_mapping(cp, str.lower)) != 2)
+
+    with open(output_file, "w", encoding="utf-8") as out:
+        out.write("// Generated by generate-case-tables.py from Unicode %s, do not edit\n" % unicodedata.unidata_version)
+        out.write("// %d upper and %d lower mappings that change the UTF-8 length are left out\n" % (upper_dropped, lower_dropped))
+        out.write("#ifndef CASE_TABLE_H\n#define CASE_TABLE_H\n\n#include <stdint.h>\n\n")
+        out.write("// Code points first to last, every stride-th one, map to themselves plus delta\n")
+        out.write("struct case_range\n{\n    uint32_t first;\n    uint32_t last;\n    int32_t  delta;\n    uint32_t stride;\n};\n\n")
+        out.write("// Code points first to last are all letters, marks or numbers\n")
+        out.write("struct word_range\n{\n    uint32_t first;\n    uint32_t last;\n};\n\n")
+        out.write("// Two-byte characters, U+%04X to U+%04X, are indexed directly\n" % (two_byte_first, two_byte_end - 1))
+        out.write("#define CASE_TWO_BYTE_FIRST 0x%X\n#define CASE_TWO_BYTE_END 0x%X\n\n" % (two_byte_first, two_byte_end))
+
+        for name, mapping in (("upper_two_byte", str.upper), ("lower_two_byte", str.lower)):
+            out.write("static const int16_t %s[] = {\n" % name)
+            write_rows(out, ["%d," % d for d in two_byte_deltas(mapping)], delta_per_line)
+            out.write("};\n\n")
+
+        out.write("// One bit per two-byte character, set for letters, marks and numbers\n")
+        out.write("static const uint8_t word_two_byte[] = {\n")
+        write_rows(out, ["0x%02X," % b for b in word_bits], delta_per_line)
+        out.write("};\n\n")
+
+        for name, ranges in (("upper_ranges", upper), ("lower_ranges", lower)):
+            out.write("static const struct case_range %s[] = {\n" % name)
+            write_rows(out, ["{0x%05X, 0x%05X, %d, %d}," % r for r in ranges], case_per_line)
+            out.write("};\n\n")
+
+        out.write("static const struct word_range word_ranges[] = {\n")
+        write_rows(out, ["{0x%05X, 0x%05X}," % tuple(r) for r in words], word_per_line)
+        out.write("};\n\n#endif    // CASE_TABLE_H\n")
+
+    print("%s: %d upper, %d lower and %d word ranges past U+%04X from Unicode %s" % (output_file, len(upper), len(lower), len(words), two_byte_end - 1, unicodedata.unidata_version), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -52,7 +52,14 @@ generate_cmake_content()
 #  echo "set(${entity}_HEADERS" >> "$output_file"
 #  echo -e "$headers)" >> "$output_file"
 #  echo "" >> "$output_file"
-  echo "add_executable($entity \${${entity}_SOURCES})" >> "$output_file"
+  # Targets named lib* are shared libraries for other programs to link, the rest are executables
+  if [[ $entity == lib* ]]; then
+    echo "add_library($entity SHARED \${${entity}_SOURCES})" >> "$output_file"
+    # Only what the public header marks for export is visible, the sources shared with the programs stay internal
+    echo "set_target_properties($entity PROPERTIES PREFIX \"\" C_VISIBILITY_PRESET hidden)" >> "$output_file"
+  else
+    echo "add_executable($entity \${${entity}_SOURCES})" >> "$output_file"
+  fi
   echo "target_include_directories($entity PUBLIC \${CMAKE_SOURCE_DIR}/include)" >> "$output_file"
   echo "target_include_directories($entity PRIVATE /usr/local/include)" >> "$output_file"
   echo "" >> "$output_file"
@@ -0,0 +1,40 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include "metrics.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// What a connection turned away at the door reads before the server hangs up, whatever protocol it meant to speak
+#define BUSY_REPLY "BUSY\n"
+#define BUSY_REPLY_LEN (sizeof(BUSY_REPLY) - 1)
+
+// Request bytes read off a turned-away connection before closing it, so the close does not reset the busy reply
+#define ADMISSION_DRAIN 512
+
+// Connections open across every worker of a server, and those of them in the middle of a request, against the most it
+// admits at once. A server that drains admits nobody any more: its workers stop accepting, finish the connections
+// they have and return
+struct admission
+{
+    _Atomic unsigned int open;
+    _Atomic unsigned int requests;
+    unsigned int         max;             // 0 for no limit
+    unsigned int         max_requests;    // 0 for no limit, and then nobody counts them
+    int                  drain_fd;        // eventfd that turns readable once the server drains, -1 if it never will
+    _Atomic bool         draining;
+};
+
+void admission_init(struct admission *admission, unsigned int max, unsigned int max_requests);
+int  admission_watch_drain(struct admission *admission, int *err);
+void admission_drain(struct admission *admission);
+bool admission_draining(const struct admission *admission);
+bool admission_enter(struct admission *admission);
+void admission_leave(struct admission *admission);
+bool admission_request_enter(struct admission *admission);
+void admission_request_leave(struct admission *admission);
+void admission_refuse(int client_fd, struct worker_metrics *metrics);
+void admission_shed(int client_fd, struct worker_metrics *metrics);
+void admission_sample_queue(int server_fd, struct worker_metrics *metrics);
+
+#endif    // ADMISSION_H
@@ -0,0 +1,16 @@
+#ifndef ASCII_H
+#define ASCII_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// The case conversions change ASCII letters only and return whether data also held non-ASCII bytes
+void        ascii_init(void);
+const char *ascii_kernel_name(void);
+bool        ascii_upper(uint8_t *data, size_t len);
+bool        ascii_lower(uint8_t *data, size_t len);
+bool        ascii_swap(uint8_t *data, size_t len);
+size_t      ascii_span(const uint8_t *data, size_t len);
+
+#endif    // ASCII_H
@@ -0,0 +1,37 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#define ZLIB_CONST
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+// What a stream hello names after its conversion to have both directions deflated: STREAM|<conversion>|deflate
+#define CODEC_DEFLATE "deflate"
+
+// zlib's fastest level; the point is to spend less time on the wire than on compressing, not the best ratio
+#define CODEC_LEVEL 1
+
+// Both directions of one compressed stream: what the peer sends is inflated, what goes back is deflated
+struct codec
+{
+    z_stream inflater;
+    z_stream deflater;
+    bool     inflating;    // Each stream is only set up once the other succeeded
+    bool     deflating;
+    bool     ended;       // The inflated stream has ended, anything after it is ignored
+    bool     finished;    // The deflated stream has ended
+};
+
+bool    codec_find(const char *name, size_t len);
+int     codec_init(struct codec *codec, int *err);
+void    codec_destroy(struct codec *codec);
+ssize_t codec_inflate(struct codec *codec, const uint8_t *src, size_t *src_len, uint8_t *dst, size_t room);
+void    codec_feed(struct codec *codec, const uint8_t *src, size_t len);
+bool    codec_pending(const struct codec *codec);
+size_t  codec_deflate(struct codec *codec, uint8_t *dst, size_t room, bool finish);
+
+#endif    // CODEC_H
@@ -0,0 +1,22 @@
+#ifndef CONVCLIENT_H
+#define CONVCLIENT_H
+
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Connections a client keeps open when the caller passes 0
+#define CONV_CLIENT_CONNECTIONS 8
+
+// The library is built with hidden visibility, these four functions are all it exports
+#define CONV_CLIENT_API __attribute__((visibility("default")))
+
+// A pool of persistent binary frame connections to one server, safe to share between threads
+struct conv_client;
+
+CONV_CLIENT_API struct conv_client *conv_client_open(const char *address, in_port_t port, unsigned int connections, int *err);
+CONV_CLIENT_API ssize_t             conv_request(struct conv_client *client, const char *conversion, const void *src, size_t len, void *dst, size_t cap, int *err);
+CONV_CLIENT_API size_t              conv_reply_max(const char *conversion, size_t len);
+CONV_CLIENT_API void                conv_close(struct conv_client *client);
+
+#endif    // CONVCLIENT_H
@@ -1,12 +1,113 @@
 #ifndef COPY_H
 #define COPY_H
 
+#include "metrics.h"
+#include "pool.h"
+#include "transform.h"
+#include "wire.h"
 #include <ctype.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-ssize_t convert_copy(int fd, size_t size, int *err);
-ssize_t nwrite(const char *buffer, int fd, size_t size, int *err);
+// A connection that opens with this line carries newline-delimited requests until it is closed
+#define SESSION_HELLO "CONV/1\n"
+#define SESSION_HELLO_LEN (sizeof(SESSION_HELLO) - 1)
+
+// A connection that opens with "STREAM|<conversion>\n" converts everything after it until EOF; one that opens with
+// "STREAM|<conversion>|deflate\n" sends and gets back a zlib stream, which ends the request where it ends
+#define STREAM_HELLO "STREAM|"
+#define STREAM_HELLO_LEN (sizeof(STREAM_HELLO) - 1)
+
+// Buffer size of connections that stream, bounding their memory whatever the payload size
+#define STREAM_CHUNK 65536
+
+// Pieces one reply can gather: a batch frame's header, then a record header and a payload built aside per record
+#define COPY_IOV_MAX (1 + (2 * WIRE_BATCH_MAX))
+
+// Where a connection is in its request/reply exchange
+enum copy_phase
+{
+    COPY_PHASE_READ,
+    COPY_PHASE_WRITE,
+    COPY_PHASE_DONE
+};
+
+// What a connection is waiting for, which decides how long it may take
+enum copy_wait
+{
+    COPY_WAIT_IDLE,       // The next request, nothing of it has arrived
+    COPY_WAIT_REQUEST,    // The rest of a request that has started to arrive
+    COPY_WAIT_REPLY       // The peer to take more of a reply
+};
+
+// How long each wait may last in nanoseconds, 0 for as long as it takes
+struct copy_timeouts
+{
+    uint64_t idle;
+    uint64_t request;
+    uint64_t reply;
+};
+
+// How the bytes on a connection are framed, decided by its first bytes
+enum copy_mode
+{
+    COPY_MODE_UNKNOWN,
+    COPY_MODE_LEGACY,
+    COPY_MODE_SESSION,
+    COPY_MODE_BINARY,
+    COPY_MODE_STREAM
+};
+
+// Inflated and converted bytes of a compressed stream, kept aside while the stages after them catch up
+struct copy_codec;
+
+// Resumable state of one connection, so a non-blocking fd can be driven across many readiness events
+struct copy_state
+{
+    int                     fd;
+    uint8_t                *buf;
+    size_t                  size;
+    size_t                  nread;
+    uint8_t                *out;
+    struct iovec            reply[COPY_IOV_MAX];    // Reply being sent, pieces of the request converted in place and of the output buffer
+    size_t                  pieces;
+    size_t                  pieces_sent;
+    size_t                  reply_len;
+    size_t                  consumed;    // Request bytes answered by the reply being sent
+    size_t                  nwrote;
+    size_t                  stream_remaining;
+    uint8_t                 stream_prev;
+    int                     pipe_fds[2];    // Kernel-side buffer of a passthrough stream, -1 until first needed
+    size_t                  piped;
+    struct copy_codec      *codec;        // Set on a compressed stream
+    const struct transform *transform;    // Last transform used, so repeated names resolve once
+    struct buffer_pool     *pool;         // Where buf comes from, NULL for the heap
+    struct worker_metrics  *metrics;      // Counters of the serving worker, NULL when nobody is watching
+    uint64_t                started;      // When the bytes of the request being answered arrived, 0 if none are pending
+    bool                    eof;
+    bool                    answered;    // At least one reply went out whole
+    enum copy_mode          mode;
+    enum copy_phase         phase;
+};
+
+ssize_t        convert_copy(int fd, size_t size, struct buffer_pool *pool, const struct copy_timeouts *timeouts, int drain_fd, struct worker_metrics *metrics, int *err);
+int            copy_state_init(struct copy_state *state, int fd, size_t size, struct buffer_pool *pool, int *err);
+void           copy_state_destroy(struct copy_state *state);
+ssize_t        convert_copy_step(struct copy_state *state, int *err);
+enum copy_wait copy_waiting(const struct copy_state *state);
+bool           copy_between_requests(const struct copy_state *state);
+uint64_t       copy_deadline(const struct copy_state *state, const struct copy_timeouts *timeouts, uint64_t now);
+void           copy_report_timeout(const struct copy_state *state);
+size_t         copy_input(struct copy_state *state, uint8_t **ptr);
+ssize_t        copy_received(struct copy_state *state, size_t n);
+size_t         copy_output(const struct copy_state *state, const struct iovec **iov);
+ssize_t        copy_sent(struct copy_state *state, size_t n);
+size_t         copy_splice(struct copy_state *state, int *fd_in, int *fd_out);
+ssize_t        copy_spliced(struct copy_state *state, size_t n);
+void           copy_report_error(struct worker_metrics *metrics, ssize_t result, int err);
+ssize_t        nwrite(const char *buffer, int fd, size_t size, int *err);
 
 #endif    // COPY_H
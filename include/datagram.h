@@ -0,0 +1,17 @@
+#ifndef DATAGRAM_H
+#define DATAGRAM_H
+
+#include "metrics.h"
+
+// Datagrams received, and replies sent, per system call
+#define DATAGRAM_BATCH 64
+
+// Largest request a datagram may carry; longer ones are dropped
+#define DATAGRAM_MAX 2048
+
+// Room for the reply to one request, enough for the encoders to double it
+#define DATAGRAM_REPLY_MAX (2 * DATAGRAM_MAX)
+
+int run_datagram_loop(int fd, struct worker_metrics *metrics, int *err);
+
+#endif    // DATAGRAM_H
@@ -0,0 +1,15 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "admission.h"
+#include "copy.h"
+#include "metrics.h"
+#include "pool.h"
+#include <stddef.h>
+
+// Maximum number of readiness events handled per epoll_wait call
+#define MAX_EVENTS 64
+
+int run_event_loop(int *server_fds, unsigned int nservers, size_t bufsize, struct buffer_pool *pool, struct admission *admission, const struct copy_timeouts *timeouts, struct worker_metrics *metrics, int *err);
+
+#endif    // EVENT_H
@@ -0,0 +1,57 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "admission.h"
+#include "server.h"
+#include <pthread.h>
+#include <stdbool.h>
+
+// Descriptors passed in one SCM_RIGHTS message, well under the kernel's limit of 253
+#define HANDOFF_BATCH 64
+
+// A listener per endpoint and a datagram socket per worker, plus the admin endpoint
+#define HANDOFF_MAX_SOCKETS (((MAX_LISTENERS + 1) * MAX_WORKERS) + 1)
+
+// Seconds either server waits on the other before giving the handoff up
+#define HANDOFF_TIMEOUT 10
+
+// The message that ends the sockets, and the one the new server answers with once it serves them
+#define HANDOFF_END 'E'
+#define HANDOFF_READY 'R'
+
+// What a handed over socket is for, sent as one byte next to each descriptor
+enum handoff_kind
+{
+    HANDOFF_LISTENER,
+    HANDOFF_DATAGRAM,
+    HANDOFF_METRICS,
+    HANDOFF_KINDS
+};
+
+struct handoff_socket
+{
+    int               fd;
+    enum handoff_kind kind;
+    bool              serving;    // Taken over or opened by this server; inherited sockets nobody took are closed
+};
+
+// The sockets a server serves, as it passes them on to the binary that replaces it. The new server connects to the
+// path, inherits every socket, then answers ready; the old one stops accepting and drains, nobody binds in between
+struct handoff
+{
+    const char           *path;         // NULL when the server is never replaced
+    int                   peer_fd;      // The server being replaced, until it is told to drain
+    int                   listen_fd;    // Where the next server asks, once this one is ready
+    struct admission     *admission;
+    unsigned int          count;
+    struct handoff_socket sockets[HANDOFF_MAX_SOCKETS];
+};
+
+void handoff_init(struct handoff *handoff, const char *path);
+int  handoff_receive(struct handoff *handoff, int *err);
+int  handoff_take(struct handoff *handoff, enum handoff_kind kind);
+int  handoff_take_bound(struct handoff *handoff, enum handoff_kind kind, const char *address, in_port_t port);
+void handoff_keep(struct handoff *handoff, int fd, enum handoff_kind kind);
+int  handoff_ready(struct handoff *handoff, struct admission *admission, int *err);
+
+#endif    // HANDOFF_H
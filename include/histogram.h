@@ -0,0 +1,27 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+// Each power of two is split into this many linear sub-buckets, bounding the relative error at 1/128
+#define HISTOGRAM_SUB_BITS 7
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+// Log-linear histogram in the style of HdrHistogram: constant memory, any 64-bit value, fixed precision
+struct histogram
+{
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double   sum;
+};
+
+void     histogram_init(struct histogram *histogram);
+void     histogram_record(struct histogram *histogram, uint64_t value);
+void     histogram_merge(struct histogram *into, const struct histogram *from);
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile);
+double   histogram_mean(const struct histogram *histogram);
+
+#endif    // HISTOGRAM_H
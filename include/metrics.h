@@ -0,0 +1,89 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "pool.h"
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Requests are counted per opcode, with room for the registry to grow
+#define METRICS_TRANSFORMS 32
+
+// Latency buckets double from 2^10 ns (about 1 us) to 2^33 ns (about 8.6 s), then +Inf
+#define METRICS_LATENCY_FIRST_SHIFT 10
+#define METRICS_LATENCY_BUCKETS 24
+
+// What the admin endpoint first renders a scrape into; a larger one is rendered again into a buffer that fits
+#define METRICS_RESPONSE_INITIAL 16384
+
+// The failures convert_copy() and its engines report, by their return value
+enum metrics_error
+{
+    METRICS_ERROR_ALLOC,
+    METRICS_ERROR_READ,
+    METRICS_ERROR_PARSE,
+    METRICS_ERROR_WRITE,
+    METRICS_ERRORS
+};
+
+// The deadlines a connection can be closed for missing
+enum metrics_timeout
+{
+    METRICS_TIMEOUT_IDLE,
+    METRICS_TIMEOUT_REQUEST,
+    METRICS_TIMEOUT_REPLY,
+    METRICS_TIMEOUTS
+};
+
+// Counters of one worker. Each worker has its own cache lines, so updates never contend; they are
+// relaxed atomics because forked children share a slot and the admin thread reads them all live
+struct worker_metrics
+{
+    _Alignas(64) _Atomic uint64_t accepts;
+    _Atomic int64_t  active;
+    _Atomic uint64_t shed;
+    _Atomic int64_t  accept_queue;
+    _Atomic uint64_t requests[METRICS_TRANSFORMS];
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t errors[METRICS_ERRORS];
+    _Atomic uint64_t timeouts[METRICS_TIMEOUTS];
+    _Atomic uint64_t latency[METRICS_LATENCY_BUCKETS + 1];
+    _Atomic uint64_t latency_sum_ns;
+    _Atomic uint64_t latency_count;
+    _Atomic uint64_t pool_bytes_in_use;
+    _Atomic uint64_t pool_bytes_high_water;
+};
+
+// Every worker's counters in memory shared with forked children, plus the thread serving them
+struct metrics
+{
+    struct worker_metrics *workers;
+    unsigned int           count;
+    size_t                 len;
+    int                    admin_fd;
+    pthread_t              admin_thread;
+};
+
+int                    metrics_init(struct metrics *metrics, unsigned int workers, int *err);
+void                   metrics_destroy(struct metrics *metrics);
+struct worker_metrics *metrics_worker(const struct metrics *metrics, unsigned int worker);
+int                    metrics_serve(struct metrics *metrics, const char *address, const char *endpoint, int *err);
+int                    start_background_thread(pthread_t *thread, void *(*start)(void *), void *arg);
+size_t                 metrics_render(const struct metrics *metrics, char *buf, size_t len);
+uint64_t               metrics_now(void);
+void                   metrics_accept(struct worker_metrics *worker);
+void                   metrics_close(struct worker_metrics *worker);
+void                   metrics_shed(struct worker_metrics *worker);
+void                   metrics_accept_queue(struct worker_metrics *worker, uint32_t depth);
+void                   metrics_request(struct worker_metrics *worker, unsigned int opcode);
+void                   metrics_bytes(struct worker_metrics *worker, size_t in, size_t out);
+void                   metrics_error(struct worker_metrics *worker, ssize_t result);
+void                   metrics_timeout(struct worker_metrics *worker, enum metrics_timeout kind);
+void                   metrics_latency(struct worker_metrics *worker, uint64_t ns);
+void                   metrics_pool(struct worker_metrics *worker, const struct buffer_pool *pool);
+
+#endif    // METRICS_H
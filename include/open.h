@@ -2,11 +2,24 @@
 #define OPEN_H
 
 #include <arpa/inet.h>
+#include <stdbool.h>
 
-int open_keyboard(void);
-int open_stdout(void);
-int open_network_socket_client(const char *address, in_port_t port, int *err);
-int listen_network_socket_client(const char *address, in_port_t port, int backlog, int *err);
-int open_network_socket_server(const char *address, in_port_t port, int backlog, int *err);
+// Addresses with this prefix name a Unix domain socket: unix:/path, or unix:@name in the abstract namespace
+#define UNIX_ADDRESS_PREFIX "unix:"
+
+bool is_unix_address(const char *address);
+int  open_keyboard(void);
+int  open_stdout(void);
+int  open_network_socket_client(const char *address, in_port_t port, int *err);
+int  listen_network_socket_client(const char *address, in_port_t port, int backlog, bool reuse_port, bool v6_only, int *err);
+int  listen_unix_socket(const char *path, int backlog, int *err);
+int  listen_unix_seqpacket(const char *path, int backlog, int *err);
+int  open_unix_seqpacket_client(const char *path, int *err);
+int  open_datagram_socket_client(const char *address, in_port_t port, int *err);
+int  listen_datagram_socket(const char *address, in_port_t port, bool reuse_port, int *err);
+int  open_network_socket_server(const char *address, in_port_t port, int backlog, int *err);
+int  set_nonblocking(int fd, int *err);
+bool reuses_port(int fd);
+bool bound_to(int fd, const char *address, in_port_t port);
 
 #endif    // OPEN_H
@@ -0,0 +1,49 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Slabs come in power-of-two classes from the smallest request buffer up to a doubled stream chunk
+#define POOL_MIN_SHIFT 8
+#define POOL_MAX_SHIFT 17
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_MIN_SLAB ((size_t)1 << POOL_MIN_SHIFT)
+#define POOL_MAX_SLAB ((size_t)1 << POOL_MAX_SHIFT)
+
+// Slabs are carved from regions this large: one huge page, and what each worker reserves up front
+#define POOL_REGION ((size_t)2 * 1024 * 1024)
+
+// Free slabs of one size, linked through their own first bytes
+struct pool_class
+{
+    void  *free_list;
+    size_t in_use;
+    size_t high_water;
+    size_t carved;
+};
+
+// Memory of one worker; never shared between threads, so it takes no locks
+struct buffer_pool
+{
+    struct pool_class classes[POOL_CLASSES];
+    void             *regions;
+    uint8_t          *bump;
+    size_t            bump_left;
+    size_t            regions_mapped;
+    size_t            oversize_allocs;
+    size_t            oversize_in_use;
+    size_t            bytes_in_use;
+    size_t            bytes_high_water;
+    bool              huge_pages;
+    bool              huge_backed;
+};
+
+int   pool_init(struct buffer_pool *pool, bool huge_pages, int *err);
+void  pool_destroy(struct buffer_pool *pool);
+void *pool_alloc(struct buffer_pool *pool, size_t len);
+void  pool_free(struct buffer_pool *pool, void *ptr, size_t len);
+void  pool_report(const struct buffer_pool *pool, const char *name);
+
+#endif    // POOL_H
@@ -9,6 +9,16 @@
 #define BUFSIZE 128
 #define PORT 9999
 #define BACKLOG 5
+#define MAX_WORKERS 1024
+#define MAX_LISTENERS 8
+#define MAX_BACKLOG 65535
+#define MAX_CONNECTION_LIMIT 1048576
+#define IDLE_TIMEOUT 60
+#define READ_TIMEOUT 10
+#define WRITE_TIMEOUT 30
+#define MAX_TIMEOUT 86400
+#define BATCH_WINDOW 64
+#define MAX_WINDOW 65536
 #define TEST 10
 #define MISSING_OPTION_MESSAGE_LEN 35
 #define UNKNOWN_OPTION_MESSAGE_LEN 24
@@ -17,15 +27,53 @@
 #define ERR_OUT_OF_RANGE 2
 #define ERR_INVALID_CHARS 3
 
+// How the server dispatches accepted connections
+enum server_engine
+{
+    ENGINE_FORK,
+    ENGINE_EPOLL,
+    ENGINE_PREFORK,
+    ENGINE_URING
+};
+
+// One address the server listens on; without a port of its own it takes the -p one
+struct endpoint
+{
+    char     *address;
+    in_port_t port;
+    bool      has_port;
+};
+
 // Struct to store socket address
 struct options
 {
-    char     *message;
-    char     *inaddress;
-    char     *outaddress;
-    in_port_t inport;
-    in_port_t outport;
-    char     *conversion_type;
+    char              *message;
+    char              *inaddress;
+    char              *outaddress;
+    in_port_t          inport;
+    in_port_t          outport;
+    struct endpoint    endpoints[MAX_LISTENERS];    // -a first, then every -l; all served by the same workers
+    unsigned int       nendpoints;
+    char              *conversion_type;
+    enum server_engine engine;
+    unsigned int       workers;
+    unsigned int       backlog;
+    unsigned int       max_connections;
+    unsigned int       max_requests;
+    unsigned int       idle_timeout;
+    unsigned int       read_timeout;
+    unsigned int       write_timeout;
+    char              *batch;
+    unsigned int       window;
+    bool               gather;
+    bool               session;
+    bool               binary;
+    bool               stream;
+    bool               compress;
+    bool               huge_pages;
+    bool               udp;
+    char              *metrics;
+    char              *handoff;
 };
 
 #endif    // SERVER_H
@@ -0,0 +1,41 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A tick is 2^23 ns (about 8.4 ms); deadlines are rounded up to one, so a timer never fires early
+#define TIMER_TICK_SHIFT 23
+
+// Each level has 64 slots, each slot as long as the whole level below it; four levels reach about 39 hours out
+#define TIMER_LEVEL_SHIFT 6
+#define TIMER_SLOTS (1U << TIMER_LEVEL_SHIFT)
+#define TIMER_LEVELS 4
+
+// One deadline, embedded in whatever it times out; linked into the slot its tick falls in while pending
+struct timer
+{
+    struct timer *next;
+    struct timer *prev;
+    uint64_t      expires;    // Tick it fires on
+};
+
+// Deadlines of one event loop; never shared between threads, so it takes no locks. Scheduling, cancelling and
+// firing a timer are O(1), a timer is only looked at again when its slot cascades down a level or expires
+struct timer_wheel
+{
+    struct timer slots[TIMER_LEVELS][TIMER_SLOTS];    // Circular lists, each slot's head is its own sentinel
+    uint64_t     next;                                // First tick not processed yet
+    size_t       pending;
+};
+
+void          timer_wheel_init(struct timer_wheel *wheel, uint64_t now);
+void          timer_init(struct timer *timer);
+bool          timer_pending(const struct timer *timer);
+void          timer_schedule(struct timer_wheel *wheel, struct timer *timer, uint64_t deadline);
+void          timer_cancel(struct timer_wheel *wheel, struct timer *timer);
+struct timer *timer_expire(struct timer_wheel *wheel, uint64_t now);
+int64_t       timer_wait(const struct timer_wheel *wheel, uint64_t now);
+
+#endif    // TIMER_H
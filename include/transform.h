@@ -0,0 +1,36 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Opcode of the passthrough transform, which leaves every byte as it is
+#define TRANSFORM_NONE 0
+
+// Returned by a transform whose input is malformed, only the decoders can fail
+#define TRANSFORM_INVALID SIZE_MAX
+
+// Converts len bytes of src into dst and returns the output length.
+// dst is either src itself or a separate buffer of at least transform_max_output() bytes.
+// prev is the input byte just before src, 0 at the start of a message.
+typedef size_t (*transform_fn)(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev);
+
+// A named conversion, its position in the registry is the opcode used on the wire
+struct transform
+{
+    const char  *name;
+    transform_fn apply;
+    size_t       in_block;     // Input bytes that convert independently of the rest, 0 if the whole message is needed
+    size_t       out_block;    // Output bytes each input block turns into
+    bool         utf8;         // Maps multibyte UTF-8 characters, so chunks must not split one
+};
+
+const struct transform *transform_find(const char *name, size_t len);
+const struct transform *transform_get(unsigned int opcode);
+unsigned int            transform_count(void);
+uint8_t                 transform_opcode(const struct transform *transform);
+size_t                  transform_max_output(const struct transform *transform, size_t len);
+bool                    transform_resizes(const struct transform *transform);
+
+#endif    // TRANSFORM_H
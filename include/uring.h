@@ -0,0 +1,27 @@
+#ifndef URING_H
+#define URING_H
+
+#include "admission.h"
+#include "copy.h"
+#include "metrics.h"
+#include "pool.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// The io_uring backend is compiled in whenever the kernel headers describe it; no liburing is needed
+#if defined(__linux__) && defined(__has_include)
+    #if __has_include(<linux/io_uring.h>)
+        #define HAVE_IO_URING
+    #endif
+#endif
+
+// Submission queue depth of each ring
+#define URING_ENTRIES 256
+
+// Number of provided receive buffers per ring (must be a power of two)
+#define URING_BUFFERS 1024
+
+bool uring_supported(size_t bufsize);
+int  run_uring_loop(int *server_fds, unsigned int nservers, size_t bufsize, struct buffer_pool *pool, struct admission *admission, const struct copy_timeouts *timeouts, struct worker_metrics *metrics, int *err);
+
+#endif    // URING_H
@@ -0,0 +1,18 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest UTF-8 encoding of one character
+#define UTF8_MAX_LEN 4
+
+size_t   utf8_decode(const uint8_t *data, size_t len, uint32_t *cp);
+void     utf8_encode(uint8_t *data, size_t n, uint32_t cp);
+size_t   utf8_complete(const uint8_t *data, size_t len);
+uint32_t utf8_upper(uint32_t cp);
+uint32_t utf8_lower(uint32_t cp);
+bool     utf8_is_word(uint32_t cp);
+
+#endif    // UTF8_H
@@ -0,0 +1,50 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// First byte of every binary frame; never printable, so it cannot be mistaken for a text request
+#define WIRE_MAGIC 0xA5
+#define WIRE_VERSION 1
+
+// magic, version, opcode, flags, then the payload length and request id in network byte order
+#define WIRE_HEADER_LEN 12
+
+// Set on frames sent by the server
+#define WIRE_FLAG_REPLY 0x01
+
+// Set on frames whose payload is a run of records, each converted on its own; the header's opcode is unused
+#define WIRE_FLAG_BATCH 0x02
+
+// Set on a reply whose request could not be converted, an unknown opcode or invalid input; it carries no payload
+#define WIRE_FLAG_ERROR 0x04
+
+// A record's opcode, then its length in network byte order
+#define WIRE_RECORD_LEN 5
+
+// Most records one batch frame may carry
+#define WIRE_BATCH_MAX 64
+
+struct wire_header
+{
+    uint8_t  magic;
+    uint8_t  version;
+    uint8_t  opcode;
+    uint8_t  flags;
+    uint32_t length;
+    uint32_t request_id;
+};
+
+struct wire_record
+{
+    uint8_t  opcode;
+    uint32_t length;
+};
+
+void wire_encode_header(uint8_t *dst, const struct wire_header *header);
+void wire_decode_header(const uint8_t *src, struct wire_header *header);
+void wire_encode_record(uint8_t *dst, const struct wire_record *record);
+void wire_decode_record(const uint8_t *src, struct wire_record *record);
+
+#endif    // WIRE_H
@@ -0,0 +1,131 @@
+#include "../include/admission.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static bool take_slot(_Atomic unsigned int *count, unsigned int max);
+
+void admission_init(struct admission *admission, unsigned int max, unsigned int max_requests)
+{
+    atomic_init(&admission->open, 0);
+    atomic_init(&admission->requests, 0);
+    atomic_init(&admission->draining, false);
+    admission->max          = max;
+    admission->max_requests = max_requests;
+    admission->drain_fd     = -1;
+}
+
+// Only a server that may be replaced needs the eventfd, the others never pay for watching it
+int admission_watch_drain(struct admission *admission, int *err)
+{
+    admission->drain_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if(admission->drain_fd == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+// The eventfd is never read back, so it stays readable and every worker watching it wakes, however many there are
+void admission_drain(struct admission *admission)
+{
+    uint64_t one;
+
+    one = 1;
+    atomic_store_explicit(&admission->draining, true, memory_order_relaxed);
+
+    if(admission->drain_fd != -1 && write(admission->drain_fd, &one, sizeof(one)) == -1)
+    {
+        perror("Failed to signal drain");
+    }
+}
+
+bool admission_draining(const struct admission *admission)
+{
+    return atomic_load_explicit(&admission->draining, memory_order_relaxed);
+}
+
+bool admission_enter(struct admission *admission)
+{
+    return take_slot(&admission->open, admission->max);
+}
+
+void admission_leave(struct admission *admission)
+{
+    atomic_fetch_sub_explicit(&admission->open, 1, memory_order_relaxed);
+}
+
+// Without a limit every worker would bounce the same cache line on each request for nothing, so nobody counts
+bool admission_request_enter(struct admission *admission)
+{
+    return admission->max_requests == 0 || take_slot(&admission->requests, admission->max_requests);
+}
+
+void admission_request_leave(struct admission *admission)
+{
+    if(admission->max_requests != 0)
+    {
+        atomic_fetch_sub_explicit(&admission->requests, 1, memory_order_relaxed);
+    }
+}
+
+// Costs one send and one receive, far less than serving the connection would while the server is overloaded; the
+// caller still closes it
+void admission_refuse(int client_fd, struct worker_metrics *metrics)
+{
+    char scratch[ADMISSION_DRAIN];
+
+    send(client_fd, BUSY_REPLY, BUSY_REPLY_LEN, MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(client_fd, SHUT_WR);
+    recv(client_fd, scratch, sizeof(scratch), MSG_DONTWAIT);
+    metrics_shed(metrics);
+}
+
+void admission_shed(int client_fd, struct worker_metrics *metrics)
+{
+    admission_refuse(client_fd, metrics);
+    close(client_fd);
+}
+
+void admission_sample_queue(int server_fd, struct worker_metrics *metrics)
+{
+    struct tcp_info info;
+    socklen_t       len;
+
+    if(metrics == NULL)
+    {
+        return;
+    }
+
+    // On a listening socket tcpi_unacked counts the connections waiting to be accepted; Unix sockets have no such count
+    len = sizeof(info);
+
+    if(getsockopt(server_fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+    {
+        metrics_accept_queue(metrics, info.tcpi_unacked);
+    }
+}
+
+// Take the slot first and give it back if it was over the limit, so workers racing for the last one cannot both get it
+static bool take_slot(_Atomic unsigned int *count, unsigned int max)
+{
+    unsigned int taken;
+
+    taken = atomic_fetch_add_explicit(count, 1, memory_order_relaxed);
+
+    if(max != 0 && taken >= max)
+    {
+        atomic_fetch_sub_explicit(count, 1, memory_order_relaxed);
+        return false;
+    }
+
+    return true;
+}
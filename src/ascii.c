@@ -0,0 +1,292 @@
+#include "../include/ascii.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define ASCII_X86
+#endif
+
+// Letters in one case run over 26 consecutive bytes and differ from the other case only in this bit
+#define ASCII_LETTERS 26
+#define ASCII_CASE_BIT 0x20
+
+// Bytes from here up are parts of multibyte UTF-8 characters
+#define ASCII_HIGH 0x80
+
+// Flips the case of every byte that lands in [first, first + 26) once or-ed with fold, leaving everything else (including non-ASCII) alone.
+// Returns whether any byte was non-ASCII, which costs one or per vector and saves UTF-8 callers a second pass over pure ASCII
+typedef bool (*ascii_kernel)(uint8_t *data, size_t len, uint8_t first, uint8_t fold);
+
+// Returns the length of the leading run of ASCII bytes
+typedef size_t (*ascii_scanner)(const uint8_t *data, size_t len);
+
+static bool   flip_swar(uint8_t *data, size_t len, uint8_t first, uint8_t fold);
+static size_t span_swar(const uint8_t *data, size_t len);
+#ifdef ASCII_X86
+static bool   flip_sse2(uint8_t *data, size_t len, uint8_t first, uint8_t fold);
+static bool   flip_avx2(uint8_t *data, size_t len, uint8_t first, uint8_t fold);
+static bool   flip_avx512(uint8_t *data, size_t len, uint8_t first, uint8_t fold);
+static size_t span_sse2(const uint8_t *data, size_t len);
+static size_t span_avx2(const uint8_t *data, size_t len);
+#endif
+
+// Chosen once by ascii_init(); the portable kernels are always safe to use before that
+static ascii_kernel  flip_kernel = flip_swar;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static ascii_scanner span_kernel = span_swar;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static const char   *kernel_name = "swar";       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+void ascii_init(void)
+{
+#ifdef ASCII_X86
+    __builtin_cpu_init();
+
+    // Runs of ASCII between multibyte characters are short, so spans stop at AVX2
+    if(__builtin_cpu_supports("avx512bw"))
+    {
+        flip_kernel = flip_avx512;
+        span_kernel = span_avx2;
+        kernel_name = "avx512bw";
+    }
+    else if(__builtin_cpu_supports("avx2"))
+    {
+        flip_kernel = flip_avx2;
+        span_kernel = span_avx2;
+        kernel_name = "avx2";
+    }
+    else if(__builtin_cpu_supports("sse2"))
+    {
+        flip_kernel = flip_sse2;
+        span_kernel = span_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+}
+
+const char *ascii_kernel_name(void)
+{
+    return kernel_name;
+}
+
+bool ascii_upper(uint8_t *data, size_t len)
+{
+    return flip_kernel(data, len, 'a', 0);
+}
+
+bool ascii_lower(uint8_t *data, size_t len)
+{
+    return flip_kernel(data, len, 'A', 0);
+}
+
+// Folding both cases onto lowercase first selects every letter
+bool ascii_swap(uint8_t *data, size_t len)
+{
+    return flip_kernel(data, len, 'a', ASCII_CASE_BIT);
+}
+
+size_t ascii_span(const uint8_t *data, size_t len)
+{
+    return span_kernel(data, len);
+}
+
+static bool flip_swar(uint8_t *data, size_t len, uint8_t first, uint8_t fold)
+{
+    const uint64_t ones     = 0x0101010101010101ULL;
+    const uint64_t folds    = ones * fold;
+    const uint64_t high     = ones * 0x80;                                       // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    const uint64_t to_first = ones * (uint8_t)(0x80 - first);                    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    const uint64_t to_last  = ones * (uint8_t)(0x80 - first - ASCII_LETTERS);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    uint64_t       seen;
+    size_t         i;
+
+    seen = 0;
+
+    // Eight bytes per step: with the top bit masked off no per-byte sum can carry into its neighbour,
+    // so the top bit of each sum tells whether that byte is past the start and past the end of the range
+    for(i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        uint64_t low7;
+        uint64_t in_range;
+        uint64_t flipped;
+
+        memcpy(&word, data + i, sizeof(word));
+        seen |= word;
+        low7     = (word | folds) & ~high;
+        in_range = (low7 + to_first) & ~(low7 + to_last) & ~word & high;
+        flipped  = word ^ (in_range >> 2);
+        memcpy(data + i, &flipped, sizeof(flipped));
+    }
+
+    for(; i < len; i++)
+    {
+        seen |= data[i];
+
+        if((uint8_t)((data[i] | fold) - first) < ASCII_LETTERS)
+        {
+            data[i] ^= ASCII_CASE_BIT;
+        }
+    }
+
+    return (seen & high) != 0;
+}
+
+static size_t span_swar(const uint8_t *data, size_t len)
+{
+    const uint64_t high = 0x8080808080808080ULL;
+    size_t         i;
+
+    for(i = 0; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+
+        memcpy(&word, data + i, sizeof(word));
+
+        if((word & high) != 0)
+        {
+            break;
+        }
+    }
+
+    while(i < len && data[i] < ASCII_HIGH)
+    {
+        i++;
+    }
+
+    return i;
+}
+
+#ifdef ASCII_X86
+
+// Shifting by 0x80 - first maps the range onto the 26 smallest signed bytes, so one signed compare finds it
+__attribute__((target("sse2"))) static bool flip_sse2(uint8_t *data, size_t len, uint8_t first, uint8_t fold)
+{
+    const __m128i folds = _mm_set1_epi8((char)fold);
+    const __m128i shift = _mm_set1_epi8((char)(0x80 - first));            // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    const __m128i limit = _mm_set1_epi8((char)(-0x80 + ASCII_LETTERS));    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    const __m128i flip  = _mm_set1_epi8(ASCII_CASE_BIT);
+    __m128i       seen;
+    size_t        i;
+
+    seen = _mm_setzero_si128();
+
+    for(i = 0; i + sizeof(__m128i) <= len; i += sizeof(__m128i))
+    {
+        __m128i v;
+        __m128i in_range;
+
+        v        = _mm_loadu_si128((const __m128i_u *)(data + i));
+        seen     = _mm_or_si128(seen, v);
+        in_range = _mm_cmplt_epi8(_mm_add_epi8(_mm_or_si128(v, folds), shift), limit);
+        v        = _mm_xor_si128(v, _mm_and_si128(in_range, flip));
+        _mm_storeu_si128((__m128i_u *)(data + i), v);
+    }
+
+    return flip_swar(data + i, len - i, first, fold) || _mm_movemask_epi8(seen) != 0;
+}
+
+__attribute__((target("avx2"))) static bool flip_avx2(uint8_t *data, size_t len, uint8_t first, uint8_t fold)
+{
+    const __m256i folds = _mm256_set1_epi8((char)fold);
+    const __m256i shift = _mm256_set1_epi8((char)(0x80 - first));            // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    const __m256i limit = _mm256_set1_epi8((char)(-0x80 + ASCII_LETTERS));    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    const __m256i flip  = _mm256_set1_epi8(ASCII_CASE_BIT);
+    __m256i       seen;
+    size_t        i;
+
+    seen = _mm256_setzero_si256();
+
+    for(i = 0; i + sizeof(__m256i) <= len; i += sizeof(__m256i))
+    {
+        __m256i v;
+        __m256i in_range;
+
+        v        = _mm256_loadu_si256((const __m256i_u *)(data + i));
+        seen     = _mm256_or_si256(seen, v);
+        in_range = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(_mm256_or_si256(v, folds), shift));
+        v        = _mm256_xor_si256(v, _mm256_and_si256(in_range, flip));
+        _mm256_storeu_si256((__m256i_u *)(data + i), v);
+    }
+
+    return flip_sse2(data + i, len - i, first, fold) || _mm256_movemask_epi8(seen) != 0;
+}
+
+// AVX-512BW has unsigned byte compares and masked loads, so the tail needs no scalar loop
+__attribute__((target("avx512bw"))) static bool flip_avx512(uint8_t *data, size_t len, uint8_t first, uint8_t fold)
+{
+    const __m512i folds   = _mm512_set1_epi8((char)fold);
+    const __m512i start   = _mm512_set1_epi8((char)first);
+    const __m512i letters = _mm512_set1_epi8(ASCII_LETTERS);
+    const __m512i flip    = _mm512_set1_epi8(ASCII_CASE_BIT);
+    __m512i       seen;
+    size_t        i;
+
+    seen = _mm512_setzero_si512();
+
+    for(i = 0; i + sizeof(__m512i) <= len; i += sizeof(__m512i))
+    {
+        __m512i   v;
+        __mmask64 in_range;
+
+        v        = _mm512_loadu_si512((const void *)(data + i));
+        seen     = _mm512_or_si512(seen, v);
+        in_range = _mm512_cmplt_epu8_mask(_mm512_sub_epi8(_mm512_or_si512(v, folds), start), letters);
+        v        = _mm512_xor_si512(v, _mm512_maskz_mov_epi8(in_range, flip));
+        _mm512_storeu_si512((void *)(data + i), v);
+    }
+
+    if(i < len)
+    {
+        __m512i   v;
+        __mmask64 tail;
+        __mmask64 in_range;
+
+        tail     = ((__mmask64)1 << (len - i)) - 1;
+        v        = _mm512_maskz_loadu_epi8(tail, data + i);
+        seen     = _mm512_or_si512(seen, v);
+        in_range = _mm512_cmplt_epu8_mask(_mm512_sub_epi8(_mm512_or_si512(v, folds), start), letters);
+        v        = _mm512_xor_si512(v, _mm512_maskz_mov_epi8(in_range, flip));
+        _mm512_mask_storeu_epi8(data + i, tail, v);
+    }
+
+    return _mm512_movepi8_mask(seen) != 0;
+}
+
+__attribute__((target("sse2"))) static size_t span_sse2(const uint8_t *data, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i + sizeof(__m128i) <= len; i += sizeof(__m128i))
+    {
+        int high;
+
+        high = _mm_movemask_epi8(_mm_loadu_si128((const __m128i_u *)(data + i)));
+
+        if(high != 0)
+        {
+            return i + (size_t)__builtin_ctz((unsigned int)high);
+        }
+    }
+
+    return i + span_swar(data + i, len - i);
+}
+
+__attribute__((target("avx2"))) static size_t span_avx2(const uint8_t *data, size_t len)
+{
+    size_t i;
+
+    for(i = 0; i + sizeof(__m256i) <= len; i += sizeof(__m256i))
+    {
+        int high;
+
+        high = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i_u *)(data + i)));
+
+        if(high != 0)
+        {
+            return i + (size_t)__builtin_ctz((unsigned int)high);
+        }
+    }
+
+    return i + span_sse2(data + i, len - i);
+}
+
+#endif
@@ -0,0 +1,1474 @@
+#include "../include/ascii.h"
+#include "../include/codec.h"
+#include "../include/copy.h"
+#include "../include/pool.h"
+#include "../include/server.h"
+#include "../include/transform.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+    #define BENCH_TSC
+#endif
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define DEFAULT_REPEAT 15
+#define DEFAULT_WARMUP 3
+#define DEFAULT_SAMPLE_MS 2
+#define DEFAULT_CONVERSIONS "upper,lower,swap"
+#define MAX_REPEAT 1000
+#define MAX_WARMUP 1000
+#define MAX_SAMPLE_MS 10000
+#define MAX_CONVERSIONS 16
+#define MIN_SIZE 8
+#define MAX_SIZE (16 * 1024 * 1024)
+#define SIZE_STEP 8
+#define BENCH_CHUNK 65536
+#define KIB 1024
+#define MIB (1024 * 1024)
+#define SIZE_LABEL_LEN 24
+#define PAYLOAD_SEED 0x9E3779B97F4A7C15ULL
+
+// What to measure and how carefully
+struct bench_options
+{
+    const struct transform *transforms[MAX_CONVERSIONS];
+    unsigned int            transform_count;
+    size_t                  size_min;
+    size_t                  size_max;
+    unsigned int            repeat;
+    unsigned int            warmup;
+    uint64_t                sample_ns;
+    const char             *payload_path;
+    bool                    run_transform;
+    bool                    run_copy;
+    bool                    run_nwrite;
+    bool                    run_deflate;
+};
+
+// Where cycle counts come from: the core's own counter if the kernel lets us, else the time stamp counter
+enum cycle_source
+{
+    CYCLES_NONE,
+    CYCLES_PERF,
+    CYCLES_TSC
+};
+
+struct cycle_counter
+{
+    int               fd;
+    enum cycle_source source;
+};
+
+// Runs the measured operation iterations times, returns -1 with err set on failure
+typedef int (*bench_fn)(void *arg, uint64_t iterations, int *err);
+
+// Per-operation figures over all samples of one case
+struct bench_summary
+{
+    double median_ns;
+    double min_ns;
+    double mean_ns;
+    double stddev_ns;
+    double median_cycles;
+};
+
+struct bench_run
+{
+    const struct bench_options *opts;
+    struct cycle_counter        cycles;
+    double                     *sample_ns;
+    double                     *sample_cycles;
+    FILE                       *report;
+};
+
+// One conversion of a buffer, in place when the length stays the same
+struct transform_case
+{
+    const struct transform *transform;
+    uint8_t                *data;
+    uint8_t                *out;
+    size_t                  len;
+};
+
+// One whole streamed connection through convert_copy()
+struct copy_case
+{
+    const struct transform *transform;
+    const uint8_t          *request;    // What follows the hello: the payload, or the payload deflated
+    size_t                  request_len;
+    size_t                  expected;    // Reply bytes once inflated
+    size_t                  wire;        // Bytes both ways on the socket, hello included, as of the last connection
+    bool                    deflate;
+    uint8_t                *sink;
+    uint8_t                *plain;    // Where a deflated reply is inflated
+    struct buffer_pool     *pool;
+};
+
+struct copy_server
+{
+    int                 fd;
+    int                 err;
+    ssize_t             result;
+    struct buffer_pool *pool;
+};
+
+struct nwrite_case
+{
+    const char *data;
+    size_t      len;
+    int         fd;
+};
+
+// Functions dealing with arguments
+static void           parse_arguments(int argc, char *argv[], struct bench_options *opts);
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message);
+static unsigned long  convert_count(const char *str, unsigned long min, unsigned long max, char **end, int *err);
+static void           convert_size(const char *str, struct bench_options *opts, int *err);
+static void           convert_conversions(const char *str, struct bench_options *opts, int *err);
+static void           convert_benches(const char *str, struct bench_options *opts, int *err);
+static void           fill_words(uint8_t *payload, size_t len);
+static int            fill_file(uint8_t *payload, size_t len, const char *path, int *err);
+
+// Measuring
+static uint64_t now_ns(void);
+static void     cycles_open(struct cycle_counter *counter);
+static uint64_t cycles_read(const struct cycle_counter *counter);
+static int      measure(struct bench_run *run, bench_fn fn, void *arg, struct bench_summary *summary, int *err);
+static int      compare_double(const void *a, const void *b);
+static void     report_line(const struct bench_run *run, const char *name, size_t len, const struct bench_summary *summary);
+static void     format_size(char *buf, size_t buf_len, size_t len);
+
+// The benchmarks
+static int   bench_transforms(struct bench_run *run, const uint8_t *payload, int *err);
+static int   run_transform(void *arg, uint64_t iterations, int *err);
+static int   bench_copy(struct bench_run *run, const uint8_t *payload, int *err);
+static int   run_copy(void *arg, uint64_t iterations, int *err);
+static int   copy_connection(struct copy_case *bench, int *err);
+static void *copy_server_main(void *arg);
+static int   bench_nwrite(struct bench_run *run, const uint8_t *payload, int *err);
+static int   run_nwrite(void *arg, uint64_t iterations, int *err);
+static void *drain_main(void *arg);
+static int   bench_deflate(struct bench_run *run, const uint8_t *payload, int *err);
+static int   deflate_payload(const uint8_t *payload, size_t len, uint8_t *dst, size_t room, size_t *out_len, int *err);
+
+int main(int argc, char *argv[])
+{
+    struct bench_options opts;
+    struct bench_run     run;
+    uint8_t             *payload;
+    int                  report_fd;
+    int                  err;
+    int                  retval;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.size_min      = MIN_SIZE;
+    opts.size_max      = MAX_SIZE;
+    opts.repeat        = DEFAULT_REPEAT;
+    opts.warmup        = DEFAULT_WARMUP;
+    opts.sample_ns     = DEFAULT_SAMPLE_MS * NSEC_PER_MSEC;
+    opts.run_transform = true;
+    opts.run_copy      = true;
+    opts.run_nwrite    = true;
+    opts.run_deflate   = true;
+    convert_conversions(DEFAULT_CONVERSIONS, &opts, &err);
+
+    parse_arguments(argc, argv, &opts);
+    ascii_init();
+
+    memset(&run, 0, sizeof(run));
+    run.opts      = &opts;
+    run.cycles.fd = -1;
+    retval        = EXIT_FAILURE;
+    err           = 0;
+    payload       = NULL;
+
+    // convert_copy() logs every request to stdout, which would bury the results, so the report keeps the real stdout to itself
+    fflush(stdout);
+    report_fd = dup(STDOUT_FILENO);
+
+    if(report_fd == -1 || (run.report = fdopen(report_fd, "w")) == NULL || freopen("/dev/null", "w", stdout) == NULL)
+    {
+        perror("Error redirecting stdout");
+
+        if(report_fd != -1 && run.report == NULL)
+        {
+            close(report_fd);
+        }
+        goto cleanup;
+    }
+
+    run.sample_ns     = (double *)malloc(opts.repeat * sizeof(double));
+    run.sample_cycles = (double *)malloc(opts.repeat * sizeof(double));
+    payload           = (uint8_t *)malloc(opts.size_max);
+
+    if(run.sample_ns == NULL || run.sample_cycles == NULL || payload == NULL)
+    {
+        perror("Memory allocation error");
+        goto cleanup;
+    }
+
+    if(opts.payload_path == NULL)
+    {
+        fill_words(payload, opts.size_max);
+    }
+    else if(fill_file(payload, opts.size_max, opts.payload_path, &err) == -1)
+    {
+        fprintf(stderr, "Error reading %s: %s\n", opts.payload_path, strerror(err));
+        goto cleanup;
+    }
+
+    // Decoders reject text, measuring how fast they do so would say nothing about them
+    for(unsigned int i = 0; i < opts.transform_count; i++)
+    {
+        uint8_t scratch[MIN_SIZE * 2];
+
+        if(opts.transforms[i]->apply(scratch, payload, opts.size_max < MIN_SIZE ? opts.size_max : MIN_SIZE, 0) == TRANSFORM_INVALID)
+        {
+            fprintf(stderr, "Conversion %s does not accept the benchmark payload\n", opts.transforms[i]->name);
+            goto cleanup;
+        }
+    }
+
+    cycles_open(&run.cycles);
+    fprintf(run.report, "Case kernel:  %s\n", ascii_kernel_name());
+    fprintf(run.report,
+            "Cycles:       %s\n",
+            run.cycles.source == CYCLES_PERF  ? "cpu-cycles (perf)"
+            : run.cycles.source == CYCLES_TSC ? "time stamp counter (reference cycles)"
+                                              : "unavailable");
+    fprintf(run.report, "Payload:      %s\n", opts.payload_path != NULL ? opts.payload_path : "seeded random words");
+    fprintf(run.report, "Samples:      %u after %u warmup, each at least %.1f ms\n", opts.repeat, opts.warmup, (double)opts.sample_ns / NSEC_PER_MSEC);
+
+    if(opts.run_transform && bench_transforms(&run, payload, &err) == -1)
+    {
+        fprintf(stderr, "Error benchmarking transforms: %s\n", strerror(err));
+        goto cleanup;
+    }
+
+    if(opts.run_copy && bench_copy(&run, payload, &err) == -1)
+    {
+        fprintf(stderr, "Error benchmarking convert_copy: %s\n", strerror(err));
+        goto cleanup;
+    }
+
+    if(opts.run_nwrite && bench_nwrite(&run, payload, &err) == -1)
+    {
+        fprintf(stderr, "Error benchmarking nwrite: %s\n", strerror(err));
+        goto cleanup;
+    }
+
+    if(opts.run_deflate && bench_deflate(&run, payload, &err) == -1)
+    {
+        fprintf(stderr, "Error benchmarking deflated streams: %s\n", strerror(err));
+        goto cleanup;
+    }
+
+    retval = EXIT_SUCCESS;
+
+cleanup:
+    if(run.cycles.fd != -1)
+    {
+        close(run.cycles.fd);
+    }
+
+    if(run.report != NULL)
+    {
+        fclose(run.report);
+    }
+    free(run.sample_ns);
+    free(run.sample_cycles);
+    free(payload);
+
+    return retval;
+}
+
+static void parse_arguments(int argc, char *argv[], struct bench_options *opts)
+{
+    /*
+    struct option saved all possible options of the benchmark
+     */
+    static struct option long_options[] = {
+        {"bench",       required_argument, NULL, 'b'},
+        {"conversions", required_argument, NULL, 'x'},
+        {"size",        required_argument, NULL, 's'},
+        {"repeat",      required_argument, NULL, 'n'},
+        {"warmup",      required_argument, NULL, 'w'},
+        {"time",        required_argument, NULL, 't'},
+        {"file",        required_argument, NULL, 'f'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL,          0,                 NULL, 0  }
+    };
+    int   opt;
+    int   err;
+    char *end;
+
+    opterr = 0;
+
+    while((opt = getopt_long(argc, argv, "hb:x:s:n:w:t:f:", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'b':
+            {
+                convert_benches(optarg, opts, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "bench must be a list of transform, copy, nwrite and deflate");
+                }
+                break;
+            }
+            case 'x':
+            {
+                convert_conversions(optarg, opts, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "conversions must be a list of at most 16 known conversions");
+                }
+                break;
+            }
+            case 's':
+            {
+                convert_size(optarg, opts, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "size must be <max> or <min>-<max>, between 1 and 16777216");
+                }
+                break;
+            }
+            case 'n':
+            {
+                opts->repeat = (unsigned int)convert_count(optarg, 1, MAX_REPEAT, &end, &err);
+                if(err != ERR_NONE || *end != '\0')
+                {
+                    usage(argv[0], EXIT_FAILURE, "repeat must be between 1 and 1000");
+                }
+                break;
+            }
+            case 'w':
+            {
+                opts->warmup = (unsigned int)convert_count(optarg, 0, MAX_WARMUP, &end, &err);
+                if(err != ERR_NONE || *end != '\0')
+                {
+                    usage(argv[0], EXIT_FAILURE, "warmup must be between 0 and 1000");
+                }
+                break;
+            }
+            case 't':
+            {
+                opts->sample_ns = convert_count(optarg, 0, MAX_SAMPLE_MS, &end, &err) * NSEC_PER_MSEC;
+                if(err != ERR_NONE || *end != '\0')
+                {
+                    usage(argv[0], EXIT_FAILURE, "time must be between 0 and 10000 milliseconds");
+                }
+                break;
+            }
+            case 'f':
+            {
+                opts->payload_path = optarg;
+                break;
+            }
+            case 'h':
+            {
+                usage(argv[0], EXIT_SUCCESS, NULL);
+            }
+            // If option is unknown
+            case '?':
+            {
+                if(strchr("bxsnwtf", optopt) != NULL && optopt != '\0')
+                {
+                    char message[MISSING_OPTION_MESSAGE_LEN];
+
+                    snprintf(message, sizeof(message), "Option '-%c' requires a value.", optopt);
+                    usage(argv[0], EXIT_FAILURE, message);
+                }
+                else
+                {
+                    char message[UNKNOWN_OPTION_MESSAGE_LEN];
+
+                    snprintf(message, sizeof(message), "Unknown option '-%c'.", optopt);
+                    usage(argv[0], EXIT_FAILURE, message);
+                }
+            }
+            default:
+            {
+                usage(argv[0], EXIT_FAILURE, NULL);
+            }
+        }
+    }
+
+    if(optind < argc)
+    {
+        usage(argv[0], EXIT_FAILURE, "Too many arguments.");
+    }
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
+{
+    // Print Error message
+    if(message)
+    {
+        fprintf(stderr, "%s\n", message);
+    }
+
+    // Print the Usage message
+    fprintf(stderr, "Usage: %s [-b <benches>] [-x <conversions>] [-s <size>] [-n <repeat>] [-w <warmup>] [-t <ms>] [-f <file>]\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -h, --help                           Display this help message\n", stderr);
+    fputs("  -b, --bench <name>[,...]             Any of transform, copy, nwrite, deflate (default all)\n", stderr);
+    fputs("  -x, --conversions <conv>[,...]       Conversions to measure (default upper,lower,swap)\n", stderr);
+    fputs("  -s, --size <max>|<min>-<max>         Payload sizes, growing eightfold from min (default 8-16777216)\n", stderr);
+    fputs("  -n, --repeat <n>                     Samples per case (default 15)\n", stderr);
+    fputs("  -w, --warmup <n>                     Samples run and thrown away first (default 3)\n", stderr);
+    fputs("  -t, --time <ms>                      Shortest sample, short operations repeat to fill it (default 2)\n", stderr);
+    fputs("  -f, --file <path>                    Payload to convert, repeated to fill the largest size (default seeded random words)\n", stderr);
+    exit(exit_code);
+}
+
+static unsigned long convert_count(const char *str, unsigned long min, unsigned long max, char **end, int *err)
+{
+    long val;
+
+    *err  = ERR_NONE;
+    errno = 0;
+    val   = strtol(str, end, 10);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+    if(*end == str)
+    {
+        *err = ERR_NO_DIGITS;
+        return 0;
+    }
+
+    if(errno == ERANGE || val < 0 || (unsigned long)val < min || (unsigned long)val > max)
+    {
+        *err = ERR_OUT_OF_RANGE;
+        return 0;
+    }
+
+    return (unsigned long)val;
+}
+
+static void convert_size(const char *str, struct bench_options *opts, int *err)
+{
+    char *end;
+
+    opts->size_max = convert_count(str, 1, MAX_SIZE, &end, err);
+
+    if(*err != ERR_NONE)
+    {
+        return;
+    }
+
+    // A single number is the largest size, the sweep still starts at the smallest
+    opts->size_min = opts->size_max < MIN_SIZE ? opts->size_max : MIN_SIZE;
+
+    if(*end == '-')
+    {
+        opts->size_min = opts->size_max;
+        opts->size_max = convert_count(end + 1, opts->size_min, MAX_SIZE, &end, err);
+    }
+
+    if(*err == ERR_NONE && *end != '\0')
+    {
+        *err = ERR_INVALID_CHARS;
+    }
+}
+
+static void convert_conversions(const char *str, struct bench_options *opts, int *err)
+{
+    const char *entry;
+
+    *err                  = ERR_NONE;
+    opts->transform_count = 0;
+    entry                 = str;
+
+    while(*entry != '\0')
+    {
+        const struct transform *transform;
+        size_t                  name_len;
+
+        if(opts->transform_count == MAX_CONVERSIONS)
+        {
+            *err = ERR_OUT_OF_RANGE;
+            return;
+        }
+
+        name_len  = strcspn(entry, ",");
+        transform = transform_find(entry, name_len);
+
+        if(transform == NULL)
+        {
+            *err = ERR_INVALID_CHARS;
+            return;
+        }
+
+        opts->transforms[opts->transform_count++] = transform;
+        entry += name_len;
+        entry += *entry == ',' ? 1 : 0;
+    }
+
+    if(opts->transform_count == 0)
+    {
+        *err = ERR_NO_DIGITS;
+    }
+}
+
+static void convert_benches(const char *str, struct bench_options *opts, int *err)
+{
+    const char *entry;
+
+    *err                = ERR_NONE;
+    opts->run_transform = false;
+    opts->run_copy      = false;
+    opts->run_nwrite    = false;
+    opts->run_deflate   = false;
+    entry               = str;
+
+    while(*entry != '\0')
+    {
+        size_t name_len;
+
+        name_len = strcspn(entry, ",");
+
+        if(name_len == strlen("transform") && memcmp(entry, "transform", name_len) == 0)
+        {
+            opts->run_transform = true;
+        }
+        else if(name_len == strlen("copy") && memcmp(entry, "copy", name_len) == 0)
+        {
+            opts->run_copy = true;
+        }
+        else if(name_len == strlen("nwrite") && memcmp(entry, "nwrite", name_len) == 0)
+        {
+            opts->run_nwrite = true;
+        }
+        else if(name_len == strlen("deflate") && memcmp(entry, "deflate", name_len) == 0)
+        {
+            opts->run_deflate = true;
+        }
+        else
+        {
+            *err = ERR_INVALID_CHARS;
+            return;
+        }
+
+        entry += name_len;
+        entry += *entry == ',' ? 1 : 0;
+    }
+
+    if(!opts->run_transform && !opts->run_copy && !opts->run_nwrite && !opts->run_deflate)
+    {
+        *err = ERR_NO_DIGITS;
+    }
+}
+
+// Words from a fixed vocabulary in an order drawn from a seeded xorshift generator, with about a quarter of the letters
+// upper case and some punctuation: every case kernel has work on most bytes, and deflate finds no short repeating
+// pattern, only the redundancy of a small vocabulary, much as in prose. The same seed gives the same payload every run
+static void fill_words(uint8_t *payload, size_t len)
+{
+    static const char *const words[] = {
+        "the",    "of",     "and",    "to",     "in",     "is",      "that",   "for",    "it",     "as",     "was",
+        "with",   "be",     "by",     "on",     "not",    "he",      "this",   "are",    "or",     "his",    "from",
+        "at",     "which",  "but",    "have",   "an",     "they",    "you",    "were",   "their",  "one",    "all",
+        "we",     "can",    "her",    "has",    "there",  "been",    "if",     "more",   "when",   "will",   "would",
+        "who",    "so",     "no",     "server", "client", "request", "stream", "buffer", "socket", "worker", "reply",
+        "header", "length", "frame",  "kernel", "latency", "through", "between", "convert", "message",
+    };
+    uint64_t state;
+    size_t   i;
+
+    state = PAYLOAD_SEED;
+    i     = 0;
+
+    while(i < len)
+    {
+        const char *word;
+
+        // NOLINTBEGIN(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        word = words[state % (sizeof(words) / sizeof(words[0]))];
+
+        // Two bits per letter from the middle of the state pick its case, the top bits pick what follows the word
+        for(size_t j = 0; word[j] != '\0' && i < len; j++, i++)
+        {
+            payload[i] = ((state >> (8 + 2 * j)) & 3) == 0 ? (uint8_t)(word[j] - ('a' - 'A')) : (uint8_t)word[j];
+        }
+
+        if(i < len && (state >> 60) < 2)
+        {
+            payload[i++] = (state >> 60) == 0 ? '.' : ',';
+        }
+        // NOLINTEND(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+        if(i < len)
+        {
+            payload[i++] = ' ';
+        }
+    }
+}
+
+// Reads up to len bytes of the file, and repeats what there is when it is shorter
+static int fill_file(uint8_t *payload, size_t len, const char *path, int *err)
+{
+    size_t nread;
+    int    fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if(fd == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    nread = 0;
+    while(nread < len)
+    {
+        ssize_t result;
+
+        result = read(fd, payload + nread, len - nread);
+
+        if(result == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            *err = errno;
+            close(fd);
+            return -1;
+        }
+
+        if(result == 0)
+        {
+            break;
+        }
+        nread += (size_t)result;
+    }
+    close(fd);
+
+    if(nread == 0)
+    {
+        *err = ENODATA;
+        return -1;
+    }
+
+    for(size_t i = nread; i < len; i++)
+    {
+        payload[i] = payload[i - nread];
+    }
+
+    return 0;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static void cycles_open(struct cycle_counter *counter)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size    = sizeof(attr);
+    attr.type    = PERF_TYPE_HARDWARE;
+    attr.config  = PERF_COUNT_HW_CPU_CYCLES;
+    attr.inherit = 1;    // Threads started later count too, so convert_copy()'s server side is included once joined
+
+    // Kernel cycles matter for the socket benchmarks, but an unprivileged user may only be allowed to count its own
+    counter->fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+
+    if(counter->fd == -1)
+    {
+        attr.exclude_kernel = 1;
+        attr.exclude_hv     = 1;
+        counter->fd         = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    if(counter->fd != -1)
+    {
+        counter->source = CYCLES_PERF;
+        return;
+    }
+
+#ifdef BENCH_TSC
+    counter->source = CYCLES_TSC;
+#else
+    counter->source = CYCLES_NONE;
+#endif
+}
+
+static uint64_t cycles_read(const struct cycle_counter *counter)
+{
+    if(counter->source == CYCLES_PERF)
+    {
+        uint64_t count;
+
+        if(read(counter->fd, &count, sizeof(count)) != (ssize_t)sizeof(count))
+        {
+            return 0;
+        }
+        return count;
+    }
+
+#ifdef BENCH_TSC
+    if(counter->source == CYCLES_TSC)
+    {
+        return (uint64_t)__rdtsc();
+    }
+#endif
+
+    return 0;
+}
+
+static int measure(struct bench_run *run, bench_fn fn, void *arg, struct bench_summary *summary, int *err)
+{
+    const struct bench_options *opts;
+    uint64_t                    iterations;
+    double                      sum;
+    double                      squares;
+
+    opts = run->opts;
+
+    // Double the iterations until one sample lasts long enough for the clock to resolve it
+    iterations = 1;
+
+    for(;;)
+    {
+        uint64_t start;
+        uint64_t elapsed;
+
+        start = now_ns();
+
+        if(fn(arg, iterations, err) == -1)
+        {
+            return -1;
+        }
+        elapsed = now_ns() - start;
+
+        if(elapsed >= opts->sample_ns || iterations >= UINT64_MAX / 2)
+        {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    // Warmup samples fault in the buffers and settle the caches and clock speed before anything counts
+    for(unsigned int i = 0; i < opts->warmup; i++)
+    {
+        if(fn(arg, iterations, err) == -1)
+        {
+            return -1;
+        }
+    }
+
+    for(unsigned int i = 0; i < opts->repeat; i++)
+    {
+        uint64_t start;
+        uint64_t start_cycles;
+        uint64_t end;
+        uint64_t end_cycles;
+
+        start_cycles = cycles_read(&run->cycles);
+        start        = now_ns();
+
+        if(fn(arg, iterations, err) == -1)
+        {
+            return -1;
+        }
+        end        = now_ns();
+        end_cycles = cycles_read(&run->cycles);
+
+        run->sample_ns[i]     = (double)(end - start) / (double)iterations;
+        run->sample_cycles[i] = (double)(end_cycles - start_cycles) / (double)iterations;
+    }
+
+    sum     = 0;
+    squares = 0;
+
+    for(unsigned int i = 0; i < opts->repeat; i++)
+    {
+        sum += run->sample_ns[i];
+    }
+    summary->mean_ns = sum / opts->repeat;
+
+    for(unsigned int i = 0; i < opts->repeat; i++)
+    {
+        squares += (run->sample_ns[i] - summary->mean_ns) * (run->sample_ns[i] - summary->mean_ns);
+    }
+    summary->stddev_ns = opts->repeat > 1 ? sqrt(squares / (opts->repeat - 1)) : 0.0;
+
+    // The median shrugs off the odd sample hit by an interrupt or a migration, so it is what gets reported
+    qsort(run->sample_ns, opts->repeat, sizeof(double), compare_double);
+    qsort(run->sample_cycles, opts->repeat, sizeof(double), compare_double);
+    summary->min_ns        = run->sample_ns[0];
+    summary->median_ns     = run->sample_ns[opts->repeat / 2];
+    summary->median_cycles = run->sample_cycles[opts->repeat / 2];
+
+    return 0;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x;
+    double y;
+
+    x = *(const double *)a;
+    y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void report_line(const struct bench_run *run, const char *name, size_t len, const struct bench_summary *summary)
+{
+    char size[SIZE_LABEL_LEN];
+
+    format_size(size, sizeof(size), len);
+    fprintf(run->report, "%-10s %6s %14.1f %14.1f %8.1f%% %12.1f", name, size, summary->median_ns, summary->min_ns, summary->mean_ns > 0 ? 100.0 * summary->stddev_ns / summary->mean_ns : 0.0, (double)len / summary->median_ns * 1e3);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+    if(run->cycles.source == CYCLES_NONE)
+    {
+        fprintf(run->report, " %10s\n", "-");
+    }
+    else
+    {
+        fprintf(run->report, " %10.3f\n", summary->median_cycles / (double)len);
+    }
+}
+
+static void format_size(char *buf, size_t buf_len, size_t len)
+{
+    if(len >= MIB && len % MIB == 0)
+    {
+        snprintf(buf, buf_len, "%zuM", len / MIB);
+    }
+    else if(len >= KIB && len % KIB == 0)
+    {
+        snprintf(buf, buf_len, "%zuK", len / KIB);
+    }
+    else
+    {
+        snprintf(buf, buf_len, "%zu", len);
+    }
+}
+
+static int bench_transforms(struct bench_run *run, const uint8_t *payload, int *err)
+{
+    const struct bench_options *opts;
+    struct transform_case       bench;
+    int                         retval;
+
+    opts   = run->opts;
+    retval = -1;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.data = (uint8_t *)malloc(opts->size_max);
+    bench.out  = (uint8_t *)malloc(opts->size_max * 2);
+
+    if(bench.data == NULL || bench.out == NULL)
+    {
+        *err = errno;
+        goto done;
+    }
+
+    fprintf(run->report, "\ntransform->apply(), per call\n");
+    fprintf(run->report, "%-10s %6s %14s %14s %9s %12s %10s\n", "conversion", "size", "median ns", "min ns", "stddev", "MB/s", "cycles/B");
+
+    for(unsigned int i = 0; i < opts->transform_count; i++)
+    {
+        bench.transform = opts->transforms[i];
+
+        for(size_t len = opts->size_min; len <= opts->size_max; len *= SIZE_STEP)
+        {
+            struct bench_summary summary;
+
+            // Converting in place keeps hitting the same letters, so the buffer is refreshed before each sample
+            bench.len = len;
+            memcpy(bench.data, payload, len);
+
+            if(measure(run, run_transform, &bench, &summary, err) == -1)
+            {
+                goto done;
+            }
+            report_line(run, bench.transform->name, len, &summary);
+        }
+    }
+
+    retval = 0;
+
+done:
+    free(bench.data);
+    free(bench.out);
+
+    return retval;
+}
+
+// Same as the server: length-preserving conversions work in place, the rest into a second buffer
+static int run_transform(void *arg, uint64_t iterations, int *err)
+{
+    struct transform_case *bench;
+    uint8_t               *dst;
+
+    (void)err;
+    bench = (struct transform_case *)arg;
+    dst   = transform_resizes(bench->transform) ? bench->out : bench->data;
+
+    for(uint64_t i = 0; i < iterations; i++)
+    {
+        bench->transform->apply(dst, bench->data, bench->len, 0);
+        __asm__ __volatile__("" : : "r"(dst) : "memory");    // Keep the compiler from dropping the unused result
+    }
+
+    return 0;
+}
+
+static int bench_copy(struct bench_run *run, const uint8_t *payload, int *err)
+{
+    const struct bench_options *opts;
+    struct copy_case            bench;
+    struct buffer_pool          pool;
+    uint8_t                    *scratch;
+    int                         retval;
+
+    opts   = run->opts;
+    retval = -1;
+
+    // One connection at a time, so a single pool serves them all, as it would one server worker
+    if(pool_init(&pool, false, err) == -1)
+    {
+        return -1;
+    }
+
+    memset(&bench, 0, sizeof(bench));
+    bench.request = payload;
+    bench.pool    = &pool;
+    scratch       = (uint8_t *)malloc(opts->size_max * 2);
+    bench.sink    = (uint8_t *)malloc(BENCH_CHUNK);
+
+    if(scratch == NULL || bench.sink == NULL)
+    {
+        *err = errno;
+        goto done;
+    }
+
+    fprintf(run->report, "\nconvert_copy() over a socketpair, per streamed connection\n");
+    fprintf(run->report, "%-10s %6s %14s %14s %9s %12s %10s\n", "conversion", "size", "median ns", "min ns", "stddev", "MB/s", "cycles/B");
+
+    for(unsigned int i = 0; i < opts->transform_count; i++)
+    {
+        bench.transform = opts->transforms[i];
+
+        // Connections are streamed so every size fits, which only works for conversions that go block by block
+        if(bench.transform->in_block == 0)
+        {
+            fprintf(run->report, "%-10s cannot be streamed, skipped\n", bench.transform->name);
+            continue;
+        }
+
+        for(size_t len = opts->size_min; len <= opts->size_max; len *= SIZE_STEP)
+        {
+            struct bench_summary summary;
+
+            bench.request_len = len;
+            bench.expected    = bench.transform->apply(scratch, payload, len, 0);
+
+            if(measure(run, run_copy, &bench, &summary, err) == -1)
+            {
+                goto done;
+            }
+            report_line(run, bench.transform->name, len, &summary);
+        }
+    }
+
+    retval = 0;
+
+done:
+    free(scratch);
+    free(bench.sink);
+    pool_destroy(&pool);
+
+    return retval;
+}
+
+static int run_copy(void *arg, uint64_t iterations, int *err)
+{
+    for(uint64_t i = 0; i < iterations; i++)
+    {
+        if(copy_connection((struct copy_case *)arg, err) == -1)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// A fresh connection served by convert_copy() on its own thread, fed and drained together so neither side stalls on a full socket
+static int copy_connection(struct copy_case *bench, int *err)
+{
+    struct copy_server server;
+    struct codec       codec;
+    pthread_t          thread;
+    char               hello[BUFSIZE];
+    int                fds[2];
+    size_t             hello_len;
+    size_t             sent;
+    size_t             received;
+    size_t             received_wire;
+    int                retval;
+    int                result;
+
+    // Inflating the reply is the client's share of the work and is timed with the rest; the request was deflated up front
+    if(bench->deflate && codec_init(&codec, err) == -1)
+    {
+        return -1;
+    }
+
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+    {
+        *err = errno;
+        goto fail;
+    }
+
+    server.fd     = fds[1];
+    server.err    = 0;
+    server.result = 0;
+    server.pool   = bench->pool;
+    result        = pthread_create(&thread, NULL, copy_server_main, &server);
+
+    if(result != 0)
+    {
+        *err = result;
+        close(fds[0]);
+        close(fds[1]);
+        goto fail;
+    }
+
+    retval        = -1;
+    hello_len     = (size_t)snprintf(hello, sizeof(hello), "%s%s%s\n", STREAM_HELLO, bench->transform->name, bench->deflate ? "|" CODEC_DEFLATE : "");
+    sent          = 0;
+    received      = 0;
+    received_wire = 0;
+
+    if(fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1)
+    {
+        *err = errno;
+        goto done;
+    }
+
+    for(;;)
+    {
+        struct pollfd pfd;
+        ssize_t       n;
+
+        pfd.fd     = fds[0];
+        pfd.events = POLLIN;
+
+        if(sent < hello_len + bench->request_len)
+        {
+            pfd.events |= POLLOUT;
+        }
+
+        if(poll(&pfd, 1, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            *err = errno;
+            goto done;
+        }
+
+        if((pfd.revents & POLLOUT) != 0)
+        {
+            const uint8_t *data;
+            size_t         len;
+
+            data = sent < hello_len ? (const uint8_t *)hello + sent : bench->request + sent - hello_len;
+            len  = sent < hello_len ? hello_len - sent : hello_len + bench->request_len - sent;
+            n    = write(fds[0], data, len);
+
+            if(n < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                *err = errno;
+                goto done;
+            }
+
+            if(n > 0)
+            {
+                sent += (size_t)n;
+
+                // The end of the stream is the end of the payload
+                if(sent == hello_len + bench->request_len && shutdown(fds[0], SHUT_WR) == -1)
+                {
+                    *err = errno;
+                    goto done;
+                }
+            }
+        }
+
+        if((pfd.revents & (POLLIN | POLLHUP | POLLERR)) != 0)
+        {
+            n = read(fds[0], bench->sink, BENCH_CHUNK);
+
+            if(n < 0 && errno != EAGAIN && errno != EINTR)
+            {
+                *err = errno;
+                goto done;
+            }
+
+            if(n == 0)
+            {
+                break;
+            }
+
+            if(n > 0 && !bench->deflate)
+            {
+                received += (size_t)n;
+            }
+
+            // Like the client, inflating until a buffer is no longer filled, which leaves nothing with zlib
+            if(n > 0 && bench->deflate)
+            {
+                const uint8_t *src;
+                size_t         left;
+                ssize_t        inflated;
+
+                src  = bench->sink;
+                left = (size_t)n;
+                received_wire += left;
+
+                do
+                {
+                    size_t used;
+
+                    used     = left;
+                    inflated = codec_inflate(&codec, src, &used, bench->plain, BENCH_CHUNK);
+
+                    if(inflated < 0)
+                    {
+                        *err = EPROTO;
+                        goto done;
+                    }
+                    received += (size_t)inflated;
+                    src += used;
+                    left -= used;
+                } while(!codec.ended && (left > 0 || (size_t)inflated == BENCH_CHUNK));
+            }
+        }
+    }
+
+    // A short reply means the server failed, and the timing would be of the failure
+    if(received != bench->expected || (bench->deflate && !codec.ended))
+    {
+        *err = EPROTO;
+        goto done;
+    }
+
+    bench->wire = hello_len + bench->request_len + (bench->deflate ? received_wire : received);
+    retval      = 0;
+
+done:
+    close(fds[0]);
+    pthread_join(thread, NULL);
+
+    if(retval == 0 && server.result < 0)
+    {
+        *err   = server.err;
+        retval = -1;
+    }
+
+    if(bench->deflate)
+    {
+        codec_destroy(&codec);
+    }
+
+    return retval;
+
+fail:
+    if(bench->deflate)
+    {
+        codec_destroy(&codec);
+    }
+
+    return -1;
+}
+
+static void *copy_server_main(void *arg)
+{
+    struct copy_server *server;
+
+    server         = (struct copy_server *)arg;
+    server->result = convert_copy(server->fd, BUFSIZE, server->pool, NULL, -1, NULL, &server->err);
+    close(server->fd);
+
+    return NULL;
+}
+
+static int bench_nwrite(struct bench_run *run, const uint8_t *payload, int *err)
+{
+    const struct bench_options *opts;
+    struct nwrite_case          bench;
+    pthread_t                   drainer;
+    int                         fds[2];
+    int                         result;
+    int                         retval;
+
+    opts       = run->opts;
+    retval     = -1;
+    bench.data = (const char *)payload;
+
+    fprintf(run->report, "\nnwrite(), per call\n");
+    fprintf(run->report, "%-10s %6s %14s %14s %9s %12s %10s\n", "sink", "size", "median ns", "min ns", "stddev", "MB/s", "cycles/B");
+
+    // /dev/null takes everything at once, so this is the cost of the loop and the system call alone
+    bench.fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+    if(bench.fd == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    for(size_t len = opts->size_min; len <= opts->size_max; len *= SIZE_STEP)
+    {
+        struct bench_summary summary;
+
+        bench.len = len;
+
+        if(measure(run, run_nwrite, &bench, &summary, err) == -1)
+        {
+            close(bench.fd);
+            return -1;
+        }
+        report_line(run, "/dev/null", len, &summary);
+    }
+    close(bench.fd);
+
+    // A socket takes a buffer's worth per write, so large sizes go round the loop with a reader draining the other end
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    result = pthread_create(&drainer, NULL, drain_main, &fds[1]);
+
+    if(result != 0)
+    {
+        *err = result;
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    bench.fd = fds[0];
+
+    for(size_t len = opts->size_min; len <= opts->size_max; len *= SIZE_STEP)
+    {
+        struct bench_summary summary;
+
+        bench.len = len;
+
+        if(measure(run, run_nwrite, &bench, &summary, err) == -1)
+        {
+            goto done;
+        }
+        report_line(run, "socket", len, &summary);
+    }
+
+    retval = 0;
+
+done:
+    close(fds[0]);
+    pthread_join(drainer, NULL);
+    close(fds[1]);
+
+    return retval;
+}
+
+static int run_nwrite(void *arg, uint64_t iterations, int *err)
+{
+    const struct nwrite_case *bench;
+
+    bench = (const struct nwrite_case *)arg;
+
+    for(uint64_t i = 0; i < iterations; i++)
+    {
+        if(nwrite(bench->data, bench->fd, bench->len, err) == -1)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void *drain_main(void *arg)
+{
+    static uint8_t sink[BENCH_CHUNK];
+    int            fd;
+
+    fd = *(int *)arg;
+
+    // Until the writer closes its end
+    while(read(fd, sink, sizeof(sink)) > 0)
+    {
+    }
+
+    return NULL;
+}
+
+// Each conversion and size streamed plain and deflated. Deflating costs CPU and saves bytes; the crossover is the link
+// speed at which the bytes saved take as long to send as the CPU spent, any slower link and the deflated stream wins
+static int bench_deflate(struct bench_run *run, const uint8_t *payload, int *err)
+{
+    const struct bench_options *opts;
+    struct copy_case            plain;
+    struct copy_case            deflated;
+    struct buffer_pool          pool;
+    uint8_t                    *scratch;
+    uint8_t                    *request;
+    size_t                      request_cap;
+    int                         retval;
+
+    opts   = run->opts;
+    retval = -1;
+
+    if(pool_init(&pool, false, err) == -1)
+    {
+        return -1;
+    }
+
+    memset(&plain, 0, sizeof(plain));
+    request_cap      = compressBound((uLong)opts->size_max);
+    plain.request    = payload;
+    plain.pool       = &pool;
+    scratch          = (uint8_t *)malloc(opts->size_max * 2);
+    request          = (uint8_t *)malloc(request_cap);
+    plain.sink       = (uint8_t *)malloc(BENCH_CHUNK);
+    plain.plain      = (uint8_t *)malloc(BENCH_CHUNK);
+    deflated         = plain;
+    deflated.deflate = true;
+    deflated.request = request;
+
+    if(scratch == NULL || request == NULL || plain.sink == NULL || plain.plain == NULL)
+    {
+        *err = errno;
+        goto done;
+    }
+
+    fprintf(run->report, "\nconvert_copy() of a deflated stream against a plain one, per streamed connection; ratio is the deflated bytes on the wire over the plain ones\n");
+    fprintf(run->report, "%-10s %6s %14s %14s %9s %16s\n", "conversion", "size", "plain ns", "deflated ns", "ratio", "crossover MB/s");
+
+    for(unsigned int i = 0; i < opts->transform_count; i++)
+    {
+        plain.transform    = opts->transforms[i];
+        deflated.transform = opts->transforms[i];
+
+        if(plain.transform->in_block == 0)
+        {
+            fprintf(run->report, "%-10s cannot be streamed, skipped\n", plain.transform->name);
+            continue;
+        }
+
+        for(size_t len = opts->size_min; len <= opts->size_max; len *= SIZE_STEP)
+        {
+            struct bench_summary plain_summary;
+            struct bench_summary deflated_summary;
+            char                 size[SIZE_LABEL_LEN];
+            double               saved;
+            double               extra;
+
+            plain.request_len = len;
+            plain.expected    = plain.transform->apply(scratch, payload, len, 0);
+            deflated.expected = plain.expected;
+
+            // A client sending a stored file would have it deflated already, so only the reply's inflating is timed
+            if(deflate_payload(payload, len, request, request_cap, &deflated.request_len, err) == -1)
+            {
+                goto done;
+            }
+
+            if(measure(run, run_copy, &plain, &plain_summary, err) == -1 || measure(run, run_copy, &deflated, &deflated_summary, err) == -1)
+            {
+                goto done;
+            }
+
+            format_size(size, sizeof(size), len);
+            saved = (double)plain.wire - (double)deflated.wire;
+            extra = deflated_summary.median_ns - plain_summary.median_ns;
+            fprintf(run->report, "%-10s %6s %14.1f %14.1f %8.1f%%", plain.transform->name, size, plain_summary.median_ns, deflated_summary.median_ns, 100.0 * (double)deflated.wire / (double)plain.wire);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+            // Bytes per nanosecond are GB/s, a thousand of them MB/s
+            if(saved <= 0)
+            {
+                fprintf(run->report, " %16s\n", "never");
+            }
+            else if(extra <= 0)
+            {
+                fprintf(run->report, " %16s\n", "always");
+            }
+            else
+            {
+                fprintf(run->report, " %16.1f\n", saved / extra * 1e3);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+            }
+        }
+    }
+
+    retval = 0;
+
+done:
+    free(scratch);
+    free(request);
+    free(plain.sink);
+    free(plain.plain);
+    pool_destroy(&pool);
+
+    return retval;
+}
+
+static int deflate_payload(const uint8_t *payload, size_t len, uint8_t *dst, size_t room, size_t *out_len, int *err)
+{
+    struct codec codec;
+
+    if(codec_init(&codec, err) == -1)
+    {
+        return -1;
+    }
+
+    codec_feed(&codec, payload, len);
+    *out_len = 0;
+
+    // Sized by compressBound(), so it always finishes; the loop only guards against zlib's 32-bit lengths
+    while(!codec.finished && *out_len < room)
+    {
+        *out_len += codec_deflate(&codec, dst + *out_len, room - *out_len, true);
+    }
+    codec_destroy(&codec);
+
+    return 0;
+}
@@ -1,10 +1,14 @@
+#include "../include/codec.h"
 #include "../include/copy.h"
 #include "../include/open.h"
 #include "../include/server.h"
+#include "../include/transform.h"
+#include "../include/wire.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,17 +16,56 @@
 #include <sys/fcntl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/un.h>
 #include <unistd.h>
 
+// Requests of a batch run that are queued, in flight and answered
+struct batch
+{
+    uint8_t      *out;
+    size_t        out_cap;
+    size_t        out_len;
+    size_t        out_off;
+    uint8_t      *in;
+    size_t        in_cap;
+    size_t        in_len;
+    char         *line;
+    size_t        line_cap;
+    size_t        frame_start;      // Where the batch frame being filled begins in out
+    unsigned int  frame_records;    // Lines in it so far, 0 when none is open
+    unsigned int *frame_lines;      // Lines in each frame in flight, by request id modulo the window
+    unsigned int  window;
+    uint32_t      next_id;
+    uint32_t      expect_id;
+    unsigned int  in_flight;
+    unsigned int  failed;           // Lines the server answered with an error
+    bool          input_eof;
+};
+
 // Functions dealing with arguments
 static void           parse_arguments(int argc, char *argv[], struct options *opts);
 static void           check_arguments(const char *binary_name, const struct options *opts);
 _Noreturn static void usage(const char *program_name, int exit_code, const char *message);
 
 // Help functions for get input and output
-static int       get_output(const struct options *opts, int *err);
-static in_port_t convert_port(const char *str, int *err);
+static int          get_output(const struct options *opts, int *err);
+static in_port_t    convert_port(const char *str, int *err);
+static unsigned int convert_window(const char *str, int *err);
+static ssize_t      send_legacy(int out_fd, const struct options *opts, char *buffer, int *err);
+static ssize_t      send_session(int out_fd, const struct options *opts, char *buffer, int *err);
+static ssize_t      send_binary(int out_fd, const struct options *opts, char *buffer, int *err);
+static ssize_t      send_datagram(int out_fd, const struct options *opts, char *buffer, int *err);
+static ssize_t      read_fully(int fd, uint8_t *buffer, size_t size);
+static int          stream_copy(int out_fd, const struct options *opts, int *err);
+static int          write_inflated(struct codec *codec, const uint8_t *src, size_t len, int stdout_fd, int *err);
+static int          batch_copy(int out_fd, const struct options *opts, int *err);
+static int          queue_requests(FILE *in, const struct options *opts, struct batch *batch, int *err);
+static int          queue_record(struct batch *batch, uint8_t opcode, size_t len, int *err);
+static void         close_frame(struct batch *batch);
+static int          print_replies(struct batch *batch, int *err);
+static ssize_t      print_records(const uint8_t *payload, size_t len);
+static int          reserve(uint8_t **buf, size_t *cap, size_t len, int *err);
 
 int main(int argc, char *argv[])
 {
@@ -38,6 +81,7 @@ int main(int argc, char *argv[])
     opts.inport          = PORT;
     opts.outport         = PORT;
     opts.conversion_type = NULL;
+    opts.window          = BATCH_WINDOW;
 
     // Get address and coversion type from argv
     parse_arguments(argc, argv, &opts);
@@ -47,7 +91,7 @@ int main(int argc, char *argv[])
 
     // Get server descriptor
     err    = 0;
-    out_fd = get_output(&opts, &err);
+    out_fd = opts.udp ? open_datagram_socket_client(opts.outaddress, opts.outport, &err) : get_output(&opts, &err);
 
     // check if server descriptor has error
     if(out_fd < 0)
@@ -59,12 +103,56 @@ int main(int argc, char *argv[])
         goto err_out;
     }
 
-    // Combine conversion type and message save in the buffer
+    // A stream pumps stdin through the server to stdout, so nothing else may be printed
+    if(opts.stream)
+    {
+        if(stream_copy(out_fd, &opts, &err) == -1)
+        {
+            const char *msg;
+
+            msg = strerror(err);
+            fprintf(stderr, "Error streaming: %s\n", msg);
+            close(out_fd);
+            exit(EXIT_FAILURE);
+        }
+        close(out_fd);
+        goto err_out;
+    }
+
+    // Batch replies go to stdout one per line, so nothing else may be printed either
+    if(opts.batch != NULL)
+    {
+        if(batch_copy(out_fd, &opts, &err) == -1)
+        {
+            const char *msg;
+
+            msg = strerror(err);
+            fprintf(stderr, "Error in batch: %s\n", msg);
+            close(out_fd);
+            exit(EXIT_FAILURE);
+        }
+        close(out_fd);
+        goto err_out;
+    }
+
     printf("Message sent to server: %s|%s\n", opts.conversion_type, opts.message);
-    snprintf(buffer, BUFSIZ, "%s|%s", opts.conversion_type, opts.message);
 
-    // copy data from buffer and send to server
-    result = nwrite(buffer, out_fd, BUFSIZ, &err);
+    if(opts.binary)
+    {
+        result = send_binary(out_fd, &opts, buffer, &err);
+    }
+    else if(opts.udp)
+    {
+        result = send_datagram(out_fd, &opts, buffer, &err);
+    }
+    else if(opts.session)
+    {
+        result = send_session(out_fd, &opts, buffer, &err);
+    }
+    else
+    {
+        result = send_legacy(out_fd, &opts, buffer, &err);
+    }
 
     if(result == -1)
     {
@@ -73,10 +161,7 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    // Receive converted data from server
-    result = read(out_fd, buffer, BUFSIZ);
-
-    if(result < 0)
+    if(result == -2)
     {
         perror("Error receive data from server");
         close(out_fd);
@@ -85,7 +170,6 @@ int main(int argc, char *argv[])
 
     if(result > 0)
     {
-        buffer[result] = '\0';
         printf("Message received from server: %s\n", buffer);
     }
 
@@ -95,6 +179,799 @@ err_out:
     return EXIT_SUCCESS;
 }
 
+static ssize_t send_legacy(int out_fd, const struct options *opts, char *buffer, int *err)
+{
+    ssize_t result;
+    size_t  len;
+
+    // Combine conversion type and message save in the buffer
+    len = (size_t)snprintf(buffer, BUFSIZ, "%s|%s", opts->conversion_type, opts->message);
+
+    if(len >= BUFSIZ)
+    {
+        len = BUFSIZ - 1;
+    }
+
+    // Send the request and its terminator, not the whole buffer
+    result = nwrite(buffer, out_fd, len + 1, err);
+
+    if(result == -1)
+    {
+        return -1;
+    }
+
+    // Receive converted data from server
+    result = read(out_fd, buffer, BUFSIZ - 1);
+
+    if(result < 0)
+    {
+        return -2;
+    }
+    buffer[result] = '\0';
+
+    return result;
+}
+
+static ssize_t send_session(int out_fd, const struct options *opts, char *buffer, int *err)
+{
+    size_t len;
+    size_t nread;
+
+    // Announce the session, then send one newline-terminated request
+    len = (size_t)snprintf(buffer, BUFSIZ, "%s%s|%s\n", SESSION_HELLO, opts->conversion_type, opts->message);
+
+    if(len >= BUFSIZ)
+    {
+        *err  = EMSGSIZE;
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if(nwrite(buffer, out_fd, len, err) == -1)
+    {
+        return -1;
+    }
+
+    // The reply is complete once its newline arrives
+    nread = 0;
+    while(nread < BUFSIZ - 1)
+    {
+        ssize_t result;
+        char   *eol;
+
+        result = read(out_fd, buffer + nread, BUFSIZ - 1 - nread);
+
+        if(result < 0)
+        {
+            return -2;
+        }
+
+        // The server hangs up instead of answering a request it cannot convert
+        if(result == 0)
+        {
+            errno = ECONNRESET;
+            return -2;
+        }
+
+        eol = (char *)memchr(buffer + nread, '\n', (size_t)result);
+        nread += (size_t)result;
+
+        if(eol != NULL)
+        {
+            *eol = '\0';
+            return eol - buffer;
+        }
+    }
+
+    errno = EMSGSIZE;
+    return -2;
+}
+
+static ssize_t send_binary(int out_fd, const struct options *opts, char *buffer, int *err)
+{
+    struct wire_header      header;
+    const struct transform *transform;
+    size_t                  len;
+    ssize_t                 result;
+
+    len       = strlen(opts->message);
+    transform = opts->conversion_type ? transform_find(opts->conversion_type, strlen(opts->conversion_type)) : transform_get(0);
+
+    if(len > BUFSIZ - 1 - WIRE_HEADER_LEN)
+    {
+        *err  = EMSGSIZE;
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    // One frame: the fixed header followed by exactly the payload bytes
+    memset(&header, 0, sizeof(header));
+    header.magic      = WIRE_MAGIC;
+    header.version    = WIRE_VERSION;
+    header.opcode     = transform_opcode(transform);
+    header.length     = (uint32_t)len;
+    header.request_id = 1;
+    wire_encode_header((uint8_t *)buffer, &header);
+    memcpy(buffer + WIRE_HEADER_LEN, opts->message, len);
+
+    if(nwrite(buffer, out_fd, WIRE_HEADER_LEN + len, err) == -1)
+    {
+        return -1;
+    }
+
+    result = read_fully(out_fd, (uint8_t *)buffer, WIRE_HEADER_LEN);
+
+    if(result < (ssize_t)WIRE_HEADER_LEN)
+    {
+        if(result >= 0)
+        {
+            errno = ECONNRESET;
+        }
+        return -2;
+    }
+    wire_decode_header((const uint8_t *)buffer, &header);
+
+    if(header.magic != WIRE_MAGIC || header.request_id != 1 || header.length > BUFSIZ - 1)
+    {
+        errno = EPROTO;
+        return -2;
+    }
+
+    // The server could not convert the message, an error reply has no payload
+    if(header.flags & WIRE_FLAG_ERROR)
+    {
+        errno = EINVAL;
+        return -2;
+    }
+
+    result = read_fully(out_fd, (uint8_t *)buffer, header.length);
+
+    if(result < (ssize_t)header.length)
+    {
+        if(result >= 0)
+        {
+            errno = ECONNRESET;
+        }
+        return -2;
+    }
+    buffer[result] = '\0';
+
+    return result;
+}
+
+static ssize_t send_datagram(int out_fd, const struct options *opts, char *buffer, int *err)
+{
+    struct timeval timeout;
+    ssize_t        result;
+    size_t         len;
+
+    // One datagram is the whole request, so it needs no terminator
+    len = (size_t)snprintf(buffer, BUFSIZ, "%s|%s", opts->conversion_type, opts->message);
+
+    if(len >= BUFSIZ)
+    {
+        *err  = EMSGSIZE;
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if(send(out_fd, buffer, len, 0) == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    // The server drops requests it cannot answer and the network may drop the rest, so do not wait forever
+    timeout.tv_sec  = 1;
+    timeout.tv_usec = 0;
+    setsockopt(out_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    result = recv(out_fd, buffer, BUFSIZ - 1, 0);
+
+    if(result < 0)
+    {
+        return -2;
+    }
+    buffer[result] = '\0';
+
+    return result;
+}
+
+static ssize_t read_fully(int fd, uint8_t *buffer, size_t size)
+{
+    size_t nread;
+
+    nread = 0;
+    while(nread < size)
+    {
+        ssize_t result;
+
+        result = read(fd, buffer + nread, size - nread);
+
+        if(result < 0)
+        {
+            return -1;
+        }
+
+        if(result == 0)
+        {
+            break;
+        }
+        nread += (size_t)result;
+    }
+
+    return (ssize_t)nread;
+}
+
+static int stream_copy(int out_fd, const struct options *opts, int *err)
+{
+    static uint8_t in_buf[STREAM_CHUNK];
+    static uint8_t out_buf[STREAM_CHUNK];
+    static uint8_t raw_buf[STREAM_CHUNK];
+    struct codec   codec;
+    struct pollfd  fds[2];
+    size_t         in_len;
+    size_t         in_off;
+    bool           in_eof;
+    bool           shut;
+    int            in_fd;
+    int            stdout_fd;
+    int            retval;
+
+    in_fd     = open_keyboard();
+    stdout_fd = open_stdout();
+    in_len    = (size_t)snprintf((char *)in_buf, sizeof(in_buf), "%s%s%s\n", STREAM_HELLO, opts->conversion_type ? opts->conversion_type : "none", opts->compress ? "|" CODEC_DEFLATE : "");
+    in_off    = 0;
+    in_eof    = false;
+    shut      = false;
+    retval    = -1;
+
+    // Compressed, stdin is read into a buffer of its own and what the deflater makes of it is sent
+    if(opts->compress && codec_init(&codec, err) == -1)
+    {
+        return -1;
+    }
+
+    // Send and receive at the same time, otherwise both sides can fill their socket buffers and stall
+    if(set_nonblocking(out_fd, err) == -1)
+    {
+        goto done;
+    }
+
+    while(true)
+    {
+        // Whatever the deflater holds goes out before more of stdin is read, and all of it once stdin ended
+        if(opts->compress && in_off == in_len && (codec_pending(&codec) || (in_eof && !codec.finished)))
+        {
+            in_len = codec_deflate(&codec, in_buf, sizeof(in_buf), in_eof);
+            in_off = 0;
+        }
+
+        // End of input: tell the server, then keep reading until it has sent everything back
+        if(in_eof && !shut && in_off == in_len && (!opts->compress || codec.finished))
+        {
+            shutdown(out_fd, SHUT_WR);
+            shut = true;
+        }
+
+        // A hung up pipe reports POLLHUP even with no events asked for, so leave stdin out while input is pending
+        fds[0].fd      = (in_off == in_len && !in_eof && !(opts->compress && codec_pending(&codec))) ? in_fd : -1;
+        fds[0].events  = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd      = out_fd;
+        fds[1].events  = (short)(POLLIN | (in_off < in_len ? POLLOUT : 0));
+        fds[1].revents = 0;
+
+        if(poll(fds, 2, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            *err = errno;
+            goto done;
+        }
+
+        if(fds[0].revents & (POLLIN | POLLHUP))
+        {
+            ssize_t nread;
+
+            nread = read(in_fd, opts->compress ? raw_buf : in_buf, STREAM_CHUNK);
+
+            if(nread < 0)
+            {
+                *err = errno;
+                goto done;
+            }
+
+            if(nread == 0)
+            {
+                in_eof = true;
+            }
+
+            if(opts->compress)
+            {
+                codec_feed(&codec, raw_buf, (size_t)nread);
+                nread = 0;
+            }
+            in_len = (size_t)nread;
+            in_off = 0;
+        }
+
+        if(fds[1].revents & POLLOUT)
+        {
+            ssize_t nwrote;
+
+            nwrote = write(out_fd, in_buf + in_off, in_len - in_off);
+
+            if(nwrote < 0 && errno != EAGAIN)
+            {
+                *err = errno;
+                goto done;
+            }
+
+            if(nwrote > 0)
+            {
+                in_off += (size_t)nwrote;
+            }
+        }
+
+        if(fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t nread;
+
+            nread = read(out_fd, out_buf, sizeof(out_buf));
+
+            if(nread < 0 && errno != EAGAIN)
+            {
+                *err = errno;
+                goto done;
+            }
+
+            // A compressed reply is only whole once its stream ended
+            if(nread == 0)
+            {
+                if(opts->compress && !codec.ended)
+                {
+                    *err = EPROTO;
+                    goto done;
+                }
+                retval = 0;
+                goto done;
+            }
+
+            if(nread > 0)
+            {
+                if(opts->compress ? write_inflated(&codec, out_buf, (size_t)nread, stdout_fd, err) == -1 : nwrite((const char *)out_buf, stdout_fd, (size_t)nread, err) == -1)
+                {
+                    goto done;
+                }
+            }
+        }
+    }
+
+done:
+    if(opts->compress)
+    {
+        codec_destroy(&codec);
+    }
+
+    return retval;
+}
+
+// Inflates one read of a compressed reply and writes all it holds to stdout
+static int write_inflated(struct codec *codec, const uint8_t *src, size_t len, int stdout_fd, int *err)
+{
+    static uint8_t plain[STREAM_CHUNK];
+    ssize_t        n;
+
+    // A full buffer may have left more with zlib, so keep going until it stops filling one
+    do
+    {
+        size_t used;
+
+        used = len;
+        n    = codec_inflate(codec, src, &used, plain, sizeof(plain));
+
+        if(n < 0)
+        {
+            *err = n == -1 ? ENOMEM : EPROTO;
+            return -1;
+        }
+
+        if(n > 0 && nwrite((const char *)plain, stdout_fd, (size_t)n, err) == -1)
+        {
+            return -1;
+        }
+        src += used;
+        len -= used;
+    } while(!codec->ended && (len > 0 || (size_t)n == sizeof(plain)));
+
+    return 0;
+}
+
+static int batch_copy(int out_fd, const struct options *opts, int *err)
+{
+    struct batch batch;
+    FILE        *in;
+    bool         owned;
+    int          retval;
+
+    memset(&batch, 0, sizeof(batch));
+    owned  = strcmp(opts->batch, "-") != 0;
+    in     = owned ? fopen(opts->batch, "r") : stdin;
+    retval = -1;
+
+    if(in == NULL)
+    {
+        *err = errno;
+        goto cleanup;
+    }
+
+    // Frames in flight never outnumber the lines in flight, so the window bounds the ring of their sizes
+    batch.window      = opts->window;
+    batch.frame_lines = (unsigned int *)calloc(batch.window, sizeof(*batch.frame_lines));
+
+    if(batch.frame_lines == NULL)
+    {
+        *err = errno;
+        goto cleanup;
+    }
+
+    // Requests go out while replies come back, otherwise a large window could fill both socket buffers and stall
+    if(set_nonblocking(out_fd, err) == -1)
+    {
+        goto cleanup;
+    }
+
+    while(!batch.input_eof || batch.in_flight > 0)
+    {
+        struct pollfd fds[1];
+
+        // Read more lines once everything queued has been sent and the window has room
+        if(batch.out_off == batch.out_len && !batch.input_eof && batch.in_flight < opts->window)
+        {
+            if(queue_requests(in, opts, &batch, err) == -1)
+            {
+                goto cleanup;
+            }
+            continue;
+        }
+
+        fds[0].fd      = out_fd;
+        fds[0].events  = (short)(POLLIN | (batch.out_off < batch.out_len ? POLLOUT : 0));
+        fds[0].revents = 0;
+
+        if(poll(fds, 1, -1) == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            *err = errno;
+            goto cleanup;
+        }
+
+        if(fds[0].revents & POLLOUT)
+        {
+            ssize_t nwrote;
+
+            nwrote = write(out_fd, batch.out + batch.out_off, batch.out_len - batch.out_off);
+
+            if(nwrote < 0 && errno != EAGAIN)
+            {
+                *err = errno;
+                goto cleanup;
+            }
+
+            if(nwrote > 0)
+            {
+                batch.out_off += (size_t)nwrote;
+            }
+        }
+
+        if(fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            ssize_t nread;
+
+            if(reserve(&batch.in, &batch.in_cap, batch.in_len + STREAM_CHUNK, err) == -1)
+            {
+                goto cleanup;
+            }
+
+            nread = read(out_fd, batch.in + batch.in_len, batch.in_cap - batch.in_len);
+
+            if(nread < 0 && errno != EAGAIN)
+            {
+                *err = errno;
+                goto cleanup;
+            }
+
+            // The server only hangs up early when it rejected a request
+            if(nread == 0)
+            {
+                *err = ECONNRESET;
+                goto cleanup;
+            }
+
+            if(nread > 0)
+            {
+                batch.in_len += (size_t)nread;
+
+                if(print_replies(&batch, err) == -1)
+                {
+                    goto cleanup;
+                }
+            }
+        }
+    }
+
+    // A rejected line does not stop the others, but the run still fails once they are done
+    if(batch.failed > 0)
+    {
+        fprintf(stderr, "Server rejected %u lines\n", batch.failed);
+        *err = EINVAL;
+        goto cleanup;
+    }
+
+    retval = 0;
+
+cleanup:
+    if(fflush(stdout) == EOF && retval == 0)
+    {
+        *err   = errno;
+        retval = -1;
+    }
+
+    if(owned && in != NULL)
+    {
+        fclose(in);
+    }
+    free(batch.out);
+    free(batch.in);
+    free(batch.line);
+    free(batch.frame_lines);
+
+    return retval;
+}
+
+static int queue_requests(FILE *in, const struct options *opts, struct batch *batch, int *err)
+{
+    uint8_t opcode;
+
+    opcode         = opts->conversion_type ? transform_opcode(transform_find(opts->conversion_type, strlen(opts->conversion_type))) : TRANSFORM_NONE;
+    batch->out_len = 0;
+    batch->out_off = 0;
+
+    // Fill the window, but send what is queued rather than keep a slow input waiting
+    while(batch->in_flight < opts->window && batch->out_len < STREAM_CHUNK)
+    {
+        struct wire_header header;
+        ssize_t            len;
+
+        errno = 0;
+        len   = getline(&batch->line, &batch->line_cap, in);
+
+        if(len == -1)
+        {
+            if(errno != 0)
+            {
+                *err = errno;
+                return -1;
+            }
+            batch->input_eof = true;
+            break;
+        }
+
+        if(len > 0 && batch->line[len - 1] == '\n')
+        {
+            len--;
+        }
+
+        batch->in_flight++;
+
+        // A line too long for any batch frame goes in a frame of its own, which the server can stream
+        if(opts->gather && WIRE_HEADER_LEN + WIRE_RECORD_LEN + (size_t)len < STREAM_CHUNK)
+        {
+            if(queue_record(batch, opcode, (size_t)len, err) == -1)
+            {
+                return -1;
+            }
+            continue;
+        }
+        close_frame(batch);
+
+        if(reserve(&batch->out, &batch->out_cap, batch->out_len + WIRE_HEADER_LEN + (size_t)len, err) == -1)
+        {
+            return -1;
+        }
+
+        memset(&header, 0, sizeof(header));
+        header.magic      = WIRE_MAGIC;
+        header.version    = WIRE_VERSION;
+        header.opcode     = opcode;
+        header.length     = (uint32_t)len;
+        header.request_id = batch->next_id++;
+        wire_encode_header(batch->out + batch->out_len, &header);
+        batch->frame_lines[header.request_id % batch->window] = 1;
+        memcpy(batch->out + batch->out_len + WIRE_HEADER_LEN, batch->line, (size_t)len);
+        batch->out_len += WIRE_HEADER_LEN + (size_t)len;
+    }
+    close_frame(batch);
+
+    return 0;
+}
+
+// Lines go into one batch frame until it holds WIRE_BATCH_MAX of them or would outgrow what the server holds whole
+static int queue_record(struct batch *batch, uint8_t opcode, size_t len, int *err)
+{
+    struct wire_record record;
+
+    if(batch->frame_records == WIRE_BATCH_MAX || (batch->frame_records > 0 && batch->out_len - batch->frame_start + WIRE_RECORD_LEN + len >= STREAM_CHUNK))
+    {
+        close_frame(batch);
+    }
+
+    if(reserve(&batch->out, &batch->out_cap, batch->out_len + WIRE_HEADER_LEN + WIRE_RECORD_LEN + len, err) == -1)
+    {
+        return -1;
+    }
+
+    // The header is written once the frame's length is known
+    if(batch->frame_records == 0)
+    {
+        batch->frame_start = batch->out_len;
+        batch->out_len += WIRE_HEADER_LEN;
+    }
+
+    record.opcode = opcode;
+    record.length = (uint32_t)len;
+    wire_encode_record(batch->out + batch->out_len, &record);
+    memcpy(batch->out + batch->out_len + WIRE_RECORD_LEN, batch->line, len);
+    batch->out_len += WIRE_RECORD_LEN + len;
+    batch->frame_records++;
+
+    return 0;
+}
+
+static void close_frame(struct batch *batch)
+{
+    struct wire_header header;
+
+    if(batch->frame_records == 0)
+    {
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic      = WIRE_MAGIC;
+    header.version    = WIRE_VERSION;
+    header.flags      = WIRE_FLAG_BATCH;
+    header.length     = (uint32_t)(batch->out_len - batch->frame_start - WIRE_HEADER_LEN);
+    header.request_id = batch->next_id++;
+    wire_encode_header(batch->out + batch->frame_start, &header);
+    batch->frame_lines[header.request_id % batch->window] = batch->frame_records;
+    batch->frame_records = 0;
+}
+
+static int print_replies(struct batch *batch, int *err)
+{
+    size_t consumed;
+
+    consumed = 0;
+
+    // Replies come back in request order, each is printed as one line
+    while(batch->in_len - consumed >= WIRE_HEADER_LEN)
+    {
+        struct wire_header header;
+        ssize_t            records;
+
+        wire_decode_header(batch->in + consumed, &header);
+
+        if(header.magic != WIRE_MAGIC || !(header.flags & WIRE_FLAG_REPLY) || header.request_id != batch->expect_id || batch->in_flight == 0)
+        {
+            *err = EPROTO;
+            return -1;
+        }
+
+        if(batch->in_len - consumed - WIRE_HEADER_LEN < header.length)
+        {
+            break;
+        }
+
+        // An error reply stands for every line of its frame; those are counted and left out of the output
+        if(header.flags & WIRE_FLAG_ERROR)
+        {
+            records = batch->frame_lines[header.request_id % batch->window];
+            batch->failed += (unsigned int)records;
+        }
+        else if(header.flags & WIRE_FLAG_BATCH)
+        {
+            records = print_records(batch->in + consumed + WIRE_HEADER_LEN, header.length);
+        }
+        else
+        {
+            fwrite(batch->in + consumed + WIRE_HEADER_LEN, 1, header.length, stdout);
+            putchar('\n');
+            records = 1;
+        }
+
+        if(records < 0 || (size_t)records > batch->in_flight)
+        {
+            *err = EPROTO;
+            return -1;
+        }
+        consumed += WIRE_HEADER_LEN + header.length;
+        batch->expect_id++;
+        batch->in_flight -= (unsigned int)records;
+    }
+
+    batch->in_len -= consumed;
+    memmove(batch->in, batch->in + consumed, batch->in_len);
+
+    return 0;
+}
+
+// Prints each record of a batch reply as one line and returns how many there were, or -1 if they do not add up
+static ssize_t print_records(const uint8_t *payload, size_t len)
+{
+    size_t  offset;
+    ssize_t count;
+
+    count = 0;
+
+    for(offset = 0; offset < len; count++)
+    {
+        struct wire_record record;
+
+        if(len - offset < WIRE_RECORD_LEN)
+        {
+            return -1;
+        }
+        wire_decode_record(payload + offset, &record);
+
+        if(record.length > len - offset - WIRE_RECORD_LEN)
+        {
+            return -1;
+        }
+
+        fwrite(payload + offset + WIRE_RECORD_LEN, 1, record.length, stdout);
+        putchar('\n');
+        offset += WIRE_RECORD_LEN + record.length;
+    }
+
+    return count;
+}
+
+static int reserve(uint8_t **buf, size_t *cap, size_t len, int *err)
+{
+    uint8_t *grown;
+    size_t   new_cap;
+
+    if(len <= *cap)
+    {
+        return 0;
+    }
+
+    new_cap = *cap > 0 ? *cap : STREAM_CHUNK;
+    while(new_cap < len)
+    {
+        new_cap *= 2;
+    }
+
+    grown = (uint8_t *)realloc(*buf, new_cap);
+
+    if(grown == NULL)
+    {
+        *err = errno;
+        return -1;
+    }
+    *buf = grown;
+    *cap = new_cap;
+
+    return 0;
+}
+
 static void parse_arguments(int argc, char *argv[], struct options *opts)
 {
     /*
@@ -106,6 +983,14 @@ static void parse_arguments(int argc, char *argv[], struct options *opts)
         {"inport",     required_argument, NULL, 't'},
         {"outport",    required_argument, NULL, 'T'},
         {"convert",    required_argument, NULL, 'c'},
+        {"session",    no_argument,       NULL, 's'},
+        {"binary",     no_argument,       NULL, 'b'},
+        {"stream",     no_argument,       NULL, 'S'},
+        {"compress",   no_argument,       NULL, 'z'},
+        {"batch",      required_argument, NULL, 'B'},
+        {"window",     required_argument, NULL, 'W'},
+        {"gather",     no_argument,       NULL, 'g'},
+        {"udp",        no_argument,       NULL, 'u'},
         {"help",       no_argument,       NULL, 'h'},
         {NULL,         0,                 NULL, 0  }
     };
@@ -114,7 +999,7 @@ static void parse_arguments(int argc, char *argv[], struct options *opts)
 
     opterr = 0;
 
-    while((opt = getopt_long(argc, argv, "ha:p:m:c:", long_options, NULL)) != -1)
+    while((opt = getopt_long(argc, argv, "ha:p:m:c:sbSzB:W:gu", long_options, NULL)) != -1)
     {
         switch(opt)
         {
@@ -144,6 +1029,50 @@ static void parse_arguments(int argc, char *argv[], struct options *opts)
                 opts->conversion_type = optarg;
                 break;
             }
+            case 's':
+            {
+                opts->session = true;
+                break;
+            }
+            case 'b':
+            {
+                opts->binary = true;
+                break;
+            }
+            case 'S':
+            {
+                opts->stream = true;
+                break;
+            }
+            case 'z':
+            {
+                opts->compress = true;
+                break;
+            }
+            case 'B':
+            {
+                opts->batch = optarg;
+                break;
+            }
+            case 'W':
+            {
+                opts->window = convert_window(optarg, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "window must be between 1 and 65536");
+                }
+                break;
+            }
+            case 'g':
+            {
+                opts->gather = true;
+                break;
+            }
+            case 'u':
+            {
+                opts->udp = true;
+                break;
+            }
             case 'h':
             {
                 usage(argv[0], EXIT_SUCCESS, NULL);
@@ -151,7 +1080,7 @@ static void parse_arguments(int argc, char *argv[], struct options *opts)
             // If option is unknown
             case '?':
             {
-                if(optopt == 'a' || optopt == 'p' || optopt == 'm' || optopt == 'c')
+                if(optopt == 'a' || optopt == 'p' || optopt == 'm' || optopt == 'c' || optopt == 'B' || optopt == 'W')
                 {
                     char message[MISSING_OPTION_MESSAGE_LEN];
 
@@ -181,12 +1110,44 @@ static void check_arguments(const char *binary_name, const struct options *opts)
         usage(binary_name, EXIT_FAILURE, "an network address is required");
     }
 
-    if(opts->conversion_type != NULL)
+    if(opts->conversion_type != NULL && transform_find(opts->conversion_type, strlen(opts->conversion_type)) == NULL)
     {
-        if(strcmp(opts->conversion_type, "upper") != 0 && strcmp(opts->conversion_type, "lower") != 0 && strcmp(opts->conversion_type, "none") != 0)
-        {
-            usage(binary_name, EXIT_FAILURE, "conversion type can only be upper, lower, or none");
-        }
+        usage(binary_name, EXIT_FAILURE, "unknown conversion type");
+    }
+
+    if(opts->batch != NULL && (opts->stream || opts->session || opts->binary || opts->message != NULL))
+    {
+        usage(binary_name, EXIT_FAILURE, "batch mode reads its messages from a file and cannot be combined with -m, -s, -b or -S");
+    }
+
+    if(opts->udp && (opts->session || opts->binary || opts->stream || opts->batch != NULL || opts->message == NULL))
+    {
+        usage(binary_name, EXIT_FAILURE, "UDP sends one message with -m and cannot be combined with -s, -b, -S or -B");
+    }
+
+    if(opts->udp && is_unix_address(opts->outaddress))
+    {
+        usage(binary_name, EXIT_FAILURE, "UDP needs a network address");
+    }
+
+    if(opts->compress && !opts->stream)
+    {
+        usage(binary_name, EXIT_FAILURE, "-z compresses a stream and needs -S");
+    }
+
+    if(opts->gather && opts->batch == NULL)
+    {
+        usage(binary_name, EXIT_FAILURE, "-g packs the lines of a batch and needs -B");
+    }
+
+    if((opts->session || opts->binary) && opts->message == NULL)
+    {
+        usage(binary_name, EXIT_FAILURE, "a message is required");
+    }
+
+    if(opts->session && opts->message != NULL && strchr(opts->message, '\n') != NULL)
+    {
+        usage(binary_name, EXIT_FAILURE, "a session message cannot contain a newline");
     }
 }
 
@@ -199,13 +1160,26 @@ _Noreturn static void usage(const char *program_name, int exit_code, const char
     }
 
     // Print the Usage message
-    fprintf(stderr, "Usage: %s [-a <address>] [-p <port>] [-m <message>] [-c <conversion>]\n", program_name);
+    fprintf(stderr, "Usage: %s [-a <address>] [-p <port>] [-m <message>] [-c <conversion>] [-s] [-b] [-S] [-z] [-B <file>] [-W <window>] [-g] [-u]\n", program_name);
     fputs("Options:\n", stderr);
     fputs("  -h, --help                           Display help message\n", stderr);
-    fputs("  -a <address>, --inaddress <address>  Network socket <address>\n", stderr);
+    fputs("  -a <address>, --inaddress <address>  Network socket <address>, or unix:/path or unix:@name\n", stderr);
     fputs("  -p <port>, --inaddress <address>     Network socket (PORT) <address>\n", stderr);
     fputs("  -m, --message                        Message to convert\n", stderr);
-    fputs("  -c, --conversion type 				  Conversion type (upper, lower, or none)\n", stderr);
+    fputs("  -c, --conversion type 				  Conversion type, one of:", stderr);
+    for(unsigned int i = 0; i < transform_count(); i++)
+    {
+        fprintf(stderr, " %s", transform_get(i)->name);
+    }
+    fputs("\n", stderr);
+    fputs("  -s, --session                        Use the newline-delimited session framing\n", stderr);
+    fputs("  -b, --binary                         Use the binary frame protocol\n", stderr);
+    fputs("  -S, --stream                         Convert stdin to stdout through the server, any size\n", stderr);
+    fputs("  -z, --compress                       Deflate the stream both ways, for links slower than the CPU\n", stderr);
+    fputs("  -B, --batch <file>                   Convert each line of <file> (- for stdin) over one connection\n", stderr);
+    fputs("  -W, --window <window>                Requests in flight in batch mode (default 64)\n", stderr);
+    fputs("  -g, --gather                         Pack up to 64 batch lines into each frame, answered in one write\n", stderr);
+    fputs("  -u, --udp                            Send the message as one UDP datagram\n", stderr);
     exit(exit_code);
 }
 
@@ -262,3 +1236,33 @@ static in_port_t convert_port(const char *str, int *err)
 done:
     return port;
 }
+
+static unsigned int convert_window(const char *str, int *err)
+{
+    char *endptr;
+    long  val;
+
+    *err  = ERR_NONE;
+    errno = 0;
+    val   = strtol(str, &endptr, 10);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+    if(endptr == str)
+    {
+        *err = ERR_NO_DIGITS;
+        return 0;
+    }
+
+    if(val < 1 || val > MAX_WINDOW)
+    {
+        *err = ERR_OUT_OF_RANGE;
+        return 0;
+    }
+
+    if(*endptr != '\0')
+    {
+        *err = ERR_INVALID_CHARS;
+        return 0;
+    }
+
+    return (unsigned int)val;
+}
@@ -0,0 +1,122 @@
+#include "../include/codec.h"
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+
+static uInt clamp_len(size_t len);
+
+bool codec_find(const char *name, size_t len)
+{
+    return len == strlen(CODEC_DEFLATE) && memcmp(name, CODEC_DEFLATE, len) == 0;
+}
+
+int codec_init(struct codec *codec, int *err)
+{
+    memset(codec, 0, sizeof(*codec));
+
+    if(inflateInit(&codec->inflater) != Z_OK)
+    {
+        *err = ENOMEM;
+        return -1;
+    }
+    codec->inflating = true;
+
+    if(deflateInit(&codec->deflater, CODEC_LEVEL) != Z_OK)
+    {
+        *err = ENOMEM;
+        codec_destroy(codec);
+        return -1;
+    }
+    codec->deflating = true;
+
+    return 0;
+}
+
+void codec_destroy(struct codec *codec)
+{
+    if(codec->inflating)
+    {
+        inflateEnd(&codec->inflater);
+        codec->inflating = false;
+    }
+
+    if(codec->deflating)
+    {
+        deflateEnd(&codec->deflater);
+        codec->deflating = false;
+    }
+}
+
+// Inflates from src into dst and returns the bytes written, -1 when zlib runs out of memory or -3 on a corrupt stream.
+// src_len holds how much there is and comes back as how much was used; zlib keeps what did not fit dst for the next call
+ssize_t codec_inflate(struct codec *codec, const uint8_t *src, size_t *src_len, uint8_t *dst, size_t room)
+{
+    z_stream *stream;
+    int       result;
+
+    if(codec->ended)
+    {
+        *src_len = 0;
+        return 0;
+    }
+
+    stream            = &codec->inflater;
+    stream->next_in   = src;
+    stream->avail_in  = clamp_len(*src_len);
+    stream->next_out  = dst;
+    stream->avail_out = clamp_len(room);
+    result            = inflate(stream, Z_NO_FLUSH);
+
+    // Z_BUF_ERROR only says no progress was possible, which is what an empty src or a full dst means
+    if(result == Z_MEM_ERROR)
+    {
+        return -1;
+    }
+
+    if(result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+    {
+        return -3;
+    }
+    codec->ended = result == Z_STREAM_END;
+    *src_len -= stream->avail_in;
+
+    return (ssize_t)(clamp_len(room) - stream->avail_out);
+}
+
+// Hands the deflater its next input, which must stay in place until codec_pending() says it was all taken
+void codec_feed(struct codec *codec, const uint8_t *src, size_t len)
+{
+    codec->deflater.next_in  = src;
+    codec->deflater.avail_in = clamp_len(len);
+}
+
+bool codec_pending(const struct codec *codec)
+{
+    return codec->deflater.avail_in > 0;
+}
+
+// Deflates what was fed into dst and returns the bytes written, often none: zlib holds output back until a block fills.
+// Once finish is passed it must be passed until the stream has finished, each call emptying more of what zlib held
+size_t codec_deflate(struct codec *codec, uint8_t *dst, size_t room, bool finish)
+{
+    z_stream *stream;
+
+    if(codec->finished)
+    {
+        return 0;
+    }
+
+    stream            = &codec->deflater;
+    stream->next_out  = dst;
+    stream->avail_out = clamp_len(room);
+
+    // Only a misuse of the stream fails, which leaves it as it was
+    codec->finished = deflate(stream, finish ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_END;
+
+    return clamp_len(room) - stream->avail_out;
+}
+
+static uInt clamp_len(size_t len)
+{
+    return len > UINT_MAX ? UINT_MAX : (uInt)len;
+}
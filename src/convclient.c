@@ -0,0 +1,458 @@
+#include "../include/convclient.h"
+#include "../include/admission.h"
+#include "../include/open.h"
+#include "../include/transform.h"
+#include "../include/wire.h"
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Returned by exchange() when a pooled connection turns out to be gone before the request could be sent
+#define CONV_STALE (-2)
+
+// Scratch space for draining the rest of a reply the caller has no room for
+#define DRAIN_CHUNK 4096
+
+struct conv_client
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  available;
+    char           *address;
+    in_port_t       port;
+    int            *idle;
+    unsigned int    nidle;
+    unsigned int    nopen;
+    unsigned int    max;
+    uint32_t        next_id;
+};
+
+static int     connect_server(const struct conv_client *client, int *err);
+static int     acquire(struct conv_client *client, bool *reused, uint32_t *request_id, int *err);
+static void    release(struct conv_client *client, int fd, bool reusable);
+static bool    still_open(int fd);
+static ssize_t exchange(int fd, bool reused, const struct wire_header *request, const void *src, void *dst, size_t cap, bool *reusable, int *err);
+static ssize_t send_frame(int fd, const uint8_t *header, const void *src, size_t len, int *err);
+static ssize_t recv_fully(int fd, void *buf, size_t len, int *err);
+
+struct conv_client *conv_client_open(const char *address, in_port_t port, unsigned int connections, int *err)
+{
+    struct conv_client *client;
+    int                 fd;
+
+    client = (struct conv_client *)calloc(1, sizeof(*client));
+
+    if(client == NULL)
+    {
+        *err = errno;
+        return NULL;
+    }
+
+    client->port    = port;
+    client->max     = connections == 0 ? CONV_CLIENT_CONNECTIONS : connections;
+    client->address = strdup(address);
+    client->idle    = (int *)calloc(client->max, sizeof(*client->idle));
+
+    if(client->address == NULL || client->idle == NULL)
+    {
+        *err = errno;
+        goto fail;
+    }
+
+    // One connection up front, so a wrong address or a server that is down is reported here and not on the first request
+    fd = connect_server(client, err);
+
+    if(fd == -1)
+    {
+        goto fail;
+    }
+    client->idle[client->nidle++] = fd;
+    client->nopen                 = 1;
+
+    pthread_mutex_init(&client->lock, NULL);
+    pthread_cond_init(&client->available, NULL);
+
+    return client;
+
+fail:
+    free(client->idle);
+    free(client->address);
+    free(client);
+
+    return NULL;
+}
+
+ssize_t conv_request(struct conv_client *client, const char *conversion, const void *src, size_t len, void *dst, size_t cap, int *err)
+{
+    const struct transform *transform;
+    struct wire_header      header;
+
+    transform = conversion != NULL ? transform_find(conversion, strlen(conversion)) : transform_get(TRANSFORM_NONE);
+
+    if(transform == NULL)
+    {
+        *err = EINVAL;
+        return -1;
+    }
+
+    if(len > UINT32_MAX)
+    {
+        *err = EMSGSIZE;
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic   = WIRE_MAGIC;
+    header.version = WIRE_VERSION;
+    header.opcode  = transform_opcode(transform);
+    header.length  = (uint32_t)len;
+
+    // A pooled connection the server has already closed is set aside before anything reaches it, and one that fails while
+    // the request is being sent is retried on another; once sent, a request is never sent again. After a server restart
+    // every idle connection is stale, so that may take one try per pooled connection
+    for(unsigned int attempt = 0; attempt <= client->max; attempt++)
+    {
+        ssize_t result;
+        bool    reused;
+        bool    reusable;
+        int     fd;
+
+        fd = acquire(client, &reused, &header.request_id, err);
+
+        if(fd == -1)
+        {
+            return -1;
+        }
+
+        result = exchange(fd, reused, &header, src, dst, cap, &reusable, err);
+        release(client, fd, result >= 0 || reusable);
+
+        if(result != CONV_STALE)
+        {
+            return result;
+        }
+
+        if(!reused)
+        {
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+size_t conv_reply_max(const char *conversion, size_t len)
+{
+    const struct transform *transform;
+
+    transform = conversion != NULL ? transform_find(conversion, strlen(conversion)) : transform_get(TRANSFORM_NONE);
+
+    return transform != NULL ? transform_max_output(transform, len) : 0;
+}
+
+void conv_close(struct conv_client *client)
+{
+    if(client == NULL)
+    {
+        return;
+    }
+
+    for(unsigned int i = 0; i < client->nidle; i++)
+    {
+        close(client->idle[i]);
+    }
+
+    pthread_cond_destroy(&client->available);
+    pthread_mutex_destroy(&client->lock);
+    free(client->idle);
+    free(client->address);
+    free(client);
+}
+
+static int connect_server(const struct conv_client *client, int *err)
+{
+    int fd;
+    int one;
+
+    // open_network_socket_client() only reports an address error into an err that starts out clear
+    *err = 0;
+    fd   = open_network_socket_client(client->address, client->port, err);
+
+    if(fd == -1)
+    {
+        return -1;
+    }
+
+    // Each request is one small frame that waits for its reply, Nagle would only hold it back; fails harmlessly on Unix sockets
+    one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return fd;
+}
+
+// Takes an idle connection, opens another while under the limit, or waits for one to come back
+static int acquire(struct conv_client *client, bool *reused, uint32_t *request_id, int *err)
+{
+    int fd;
+
+    pthread_mutex_lock(&client->lock);
+
+    while(client->nidle == 0 && client->nopen == client->max)
+    {
+        pthread_cond_wait(&client->available, &client->lock);
+    }
+
+    *request_id = ++client->next_id;
+
+    if(client->nidle > 0)
+    {
+        fd = client->idle[--client->nidle];
+        pthread_mutex_unlock(&client->lock);
+        *reused = true;
+        return fd;
+    }
+
+    // Reserve the slot before connecting, so the lock is not held across connect()
+    client->nopen++;
+    pthread_mutex_unlock(&client->lock);
+    *reused = false;
+
+    fd = connect_server(client, err);
+
+    if(fd == -1)
+    {
+        pthread_mutex_lock(&client->lock);
+        client->nopen--;
+        pthread_cond_signal(&client->available);
+        pthread_mutex_unlock(&client->lock);
+    }
+
+    return fd;
+}
+
+// A connection that is out of step with its replies is closed, the next request opens a fresh one in its place
+static void release(struct conv_client *client, int fd, bool reusable)
+{
+    if(!reusable)
+    {
+        close(fd);
+    }
+
+    pthread_mutex_lock(&client->lock);
+
+    if(reusable)
+    {
+        client->idle[client->nidle++] = fd;
+    }
+    else
+    {
+        client->nopen--;
+    }
+
+    pthread_cond_signal(&client->available);
+    pthread_mutex_unlock(&client->lock);
+}
+
+// An idle connection has nothing to read, so a pending EOF or reset means the server went away while it sat in the pool
+static bool still_open(int fd)
+{
+    uint8_t byte;
+    ssize_t result;
+
+    result = recv(fd, &byte, sizeof(byte), MSG_PEEK | MSG_DONTWAIT);
+
+    return result > 0 || (result == -1 && (errno == EAGAIN || errno == EINTR));
+}
+
+static ssize_t exchange(int fd, bool reused, const struct wire_header *request, const void *src, void *dst, size_t cap, bool *reusable, int *err)
+{
+    struct wire_header reply;
+    uint8_t            header[WIRE_HEADER_LEN];
+    ssize_t            result;
+
+    *reusable = false;
+
+    if(reused && !still_open(fd))
+    {
+        *err = ECONNRESET;
+        return CONV_STALE;
+    }
+    wire_encode_header(header, request);
+
+    if(send_frame(fd, header, src, request->length, err) == -1)
+    {
+        return (*err == EPIPE || *err == ECONNRESET) ? CONV_STALE : -1;
+    }
+
+    result = recv_fully(fd, header, WIRE_HEADER_LEN, err);
+
+    if(result == -1)
+    {
+        return -1;
+    }
+
+    if(result == 0)
+    {
+        *err = ECONNRESET;
+        return -1;
+    }
+
+    // A server at its connection limit answers a new connection this way and closes it; trying again right away would not help
+    if((size_t)result >= BUSY_REPLY_LEN && memcmp(header, BUSY_REPLY, BUSY_REPLY_LEN) == 0)
+    {
+        *err = EBUSY;
+        return -1;
+    }
+
+    if(result < WIRE_HEADER_LEN)
+    {
+        *err = EPROTO;
+        return -1;
+    }
+    wire_decode_header(header, &reply);
+
+    if(reply.magic != WIRE_MAGIC || (reply.flags & WIRE_FLAG_REPLY) == 0 || reply.request_id != request->request_id)
+    {
+        *err = EPROTO;
+        return -1;
+    }
+
+    // The server could not convert the input; the reply carries no payload and the connection stays in step
+    if(reply.flags & WIRE_FLAG_ERROR)
+    {
+        *reusable = true;
+        *err      = EINVAL;
+        return -1;
+    }
+
+    result = recv_fully(fd, dst, reply.length < cap ? reply.length : cap, err);
+
+    if(result == -1 || (size_t)result < (reply.length < cap ? reply.length : cap))
+    {
+        *err = result == -1 ? *err : EPROTO;
+        return -1;
+    }
+
+    if(reply.length <= cap)
+    {
+        *reusable = true;
+        return result;
+    }
+
+    // Read past what does not fit, which keeps the connection usable for the next request
+    for(size_t left = reply.length - cap; left > 0;)
+    {
+        uint8_t drain[DRAIN_CHUNK];
+        size_t  chunk;
+
+        chunk  = left < sizeof(drain) ? left : sizeof(drain);
+        result = recv_fully(fd, drain, chunk, err);
+
+        if(result == -1 || (size_t)result < chunk)
+        {
+            *err = result == -1 ? *err : EPROTO;
+            return -1;
+        }
+        left -= chunk;
+    }
+
+    *reusable = true;
+    *err      = EMSGSIZE;
+
+    return -1;
+}
+
+// Header and payload leave in one call, so the payload never waits on the header's acknowledgement
+static ssize_t send_frame(int fd, const uint8_t *header, const void *src, size_t len, int *err)
+{
+    struct iovec  iov[2];
+    struct msghdr msg;
+    size_t        left;
+
+    iov[0].iov_base = (void *)(uintptr_t)header;
+    iov[0].iov_len  = WIRE_HEADER_LEN;
+    iov[1].iov_base = (void *)(uintptr_t)src;
+    iov[1].iov_len  = len;
+    left            = WIRE_HEADER_LEN + len;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = 2;
+
+    while(left > 0)
+    {
+        ssize_t nwrote;
+        size_t  n;
+
+        // An embedding application must not die of SIGPIPE because the server went away
+        nwrote = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+        if(nwrote == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            *err = errno;
+            return -1;
+        }
+
+        left -= (size_t)nwrote;
+
+        for(n = (size_t)nwrote; n > 0 && msg.msg_iovlen > 0;)
+        {
+            size_t step;
+
+            step = n < msg.msg_iov->iov_len ? n : msg.msg_iov->iov_len;
+            msg.msg_iov->iov_base = (uint8_t *)msg.msg_iov->iov_base + step;
+            msg.msg_iov->iov_len -= step;
+            n -= step;
+
+            if(msg.msg_iov->iov_len == 0)
+            {
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+        }
+    }
+
+    return (ssize_t)(WIRE_HEADER_LEN + len);
+}
+
+static ssize_t recv_fully(int fd, void *buf, size_t len, int *err)
+{
+    size_t nread;
+
+    nread = 0;
+    while(nread < len)
+    {
+        ssize_t result;
+
+        result = read(fd, (uint8_t *)buf + nread, len - nread);
+
+        if(result == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            *err = errno;
+            return -1;
+        }
+
+        if(result == 0)
+        {
+            break;
+        }
+        nread += (size_t)result;
+    }
+
+    return (ssize_t)nread;
+}
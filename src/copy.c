@@ -1,106 +1,1457 @@
 #include "../include/copy.h"
-#include <ctype.h>
+#include "../include/codec.h"
+#include "../include/open.h"
+#include "../include/utf8.h"
+#include "../include/wire.h"
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-static void convert_case(char *message, const char *conversion_type)
+#define NSEC_PER_MSEC 1000000ULL
+
+// A compressed stream goes through three buffers of a chunk each: what arrived, inflated; converted; deflated to send
+struct copy_codec
+{
+    struct codec codec;
+    uint8_t     *plain;        // Inflated and not converted yet, once converted only a partial block or character is left
+    uint8_t     *converted;    // Fed to the deflater, which must have taken all of it before the next chunk is converted
+    size_t       plain_len;
+    bool         finishing;    // The inflated stream ended and all of it is fed, what the deflater holds is the last
+};
+
+// How far the reply had got before a frame added to it, so a frame that turns out invalid can be taken back
+struct reply_mark
+{
+    size_t pieces;
+    size_t reply_len;
+    size_t last_len;    // The last piece grows when the frame lies right behind it
+};
+
+static const struct transform *resolve_transform(struct copy_state *state, const char *name, size_t len);
+static ssize_t                 parse_request(struct copy_state *state, size_t nread);
+static bool                    hello_prefix(const struct copy_state *state, const char *hello, size_t len);
+static ssize_t                 detect_mode(struct copy_state *state);
+static int                     grow_buffer(struct copy_state *state, size_t size);
+static int                     open_codec(struct copy_state *state);
+static void                    reply_reset(struct copy_state *state);
+static void                    reply_add(struct copy_state *state, const uint8_t *data, size_t len);
+static void                    reply_mark(const struct copy_state *state, struct reply_mark *mark);
+static void                    reply_error(struct copy_state *state, const struct reply_mark *mark, uint8_t *frame, struct wire_header *header);
+static ssize_t                 queue_gathered(struct copy_state *state, size_t consumed);
+static ssize_t                 queue_reply(struct copy_state *state, const uint8_t *reply, size_t len, size_t consumed);
+static ssize_t                 process_lines(struct copy_state *state);
+static bool                    frame_fits(const struct copy_state *state, const struct wire_header *header, const struct transform *transform);
+static size_t                  convert_payload(struct copy_state *state, const struct transform *transform, uint8_t *payload, size_t len, size_t *out_len);
+static ssize_t                 measure_batch(const uint8_t *payload, size_t len, size_t *out_needed, size_t *pieces);
+static ssize_t                 convert_batch(struct copy_state *state, uint8_t *frame, const struct wire_header *header, size_t *out_len);
+static ssize_t                 process_frames(struct copy_state *state);
+static size_t                  whole_units(const struct transform *transform, const uint8_t *src, size_t len);
+static ssize_t                 process_chunk(struct copy_state *state, size_t skip);
+static ssize_t                 process_compressed(struct copy_state *state);
+static ssize_t                 splice_step(struct copy_state *state, int *err);
+static int                     await_ready(const struct copy_state *state, const struct copy_timeouts *timeouts, int drain_fd, int *err);
+
+static const struct transform *resolve_transform(struct copy_state *state, const char *name, size_t len)
+{
+    // Clients tend to repeat one conversion, so check the last one before searching the registry
+    if(state->transform != NULL && strlen(state->transform->name) == len && memcmp(state->transform->name, name, len) == 0)
+    {
+        return state->transform;
+    }
+
+    state->transform = transform_find(name, len);
+
+    if(state->transform == NULL)
+    {
+        fprintf(stderr, "Unknown conversion: %.*s\n", (int)len, name);
+    }
+
+    return state->transform;
+}
+
+// drain_fd turns readable once the server drains, which ends the connection at its next pause between requests; -1 for never
+ssize_t convert_copy(int fd, size_t size, struct buffer_pool *pool, const struct copy_timeouts *timeouts, int drain_fd, struct worker_metrics *metrics, int *err)
+{
+    struct copy_state state;
+    ssize_t           retval;
+
+    if(copy_state_init(&state, fd, size, pool, err) == -1)
+    {
+        retval = -1;
+        goto done;
+    }
+    state.metrics = metrics;
+
+    // With deadlines to keep, a step only starts once poll() says it can make progress, so no read or write blocks past one
+    if(timeouts != NULL && set_nonblocking(fd, err) == -1)
+    {
+        retval = -2;
+        goto cleanup;
+    }
+
+    // Each step makes progress, keep going until the peer is done
+    do
+    {
+        if(timeouts != NULL)
+        {
+            int ready;
+
+            ready = await_ready(&state, timeouts, drain_fd, err);
+
+            if(ready == -1)
+            {
+                retval = -2;
+                break;
+            }
+
+            if(ready == 0)
+            {
+                copy_report_timeout(&state);
+                retval = (ssize_t)state.nwrote;
+                break;
+            }
+
+            if(ready == 2)
+            {
+                retval = (ssize_t)state.nwrote;
+                break;
+            }
+        }
+
+        retval = convert_copy_step(&state, err);
+    } while(retval >= 0 && state.phase != COPY_PHASE_DONE);
+
+cleanup:
+    copy_state_destroy(&state);
+
+done:
+    return retval;
+}
+
+int copy_state_init(struct copy_state *state, int fd, size_t size, struct buffer_pool *pool, int *err)
+{
+    *err  = 0;
+    errno = 0;
+    memset(state, 0, sizeof(*state));
+    state->fd          = fd;
+    state->size        = size;
+    state->mode        = COPY_MODE_UNKNOWN;
+    state->phase       = COPY_PHASE_READ;
+    state->pipe_fds[0] = -1;
+    state->pipe_fds[1] = -1;
+    state->pool        = pool;
+
+    // Requests and session replies share one allocation
+    state->buf = (uint8_t *)pool_alloc(pool, size * 2);
+
+    if(state->buf == NULL)
+    {
+        *err = errno;
+        return -1;
+    }
+    state->out = state->buf + size;
+
+    return 0;
+}
+
+void copy_state_destroy(struct copy_state *state)
+{
+    pool_free(state->pool, state->buf, state->size * 2);
+    state->buf = NULL;
+    state->out = NULL;
+
+    if(state->pipe_fds[0] != -1)
+    {
+        close(state->pipe_fds[0]);
+        close(state->pipe_fds[1]);
+        state->pipe_fds[0] = -1;
+        state->pipe_fds[1] = -1;
+    }
+
+    if(state->codec != NULL)
+    {
+        codec_destroy(&state->codec->codec);
+        pool_free(state->pool, state->codec->plain, STREAM_CHUNK * 2);
+        pool_free(state->pool, state->codec, sizeof(*state->codec));
+        state->codec = NULL;
+    }
+}
+
+static ssize_t parse_request(struct copy_state *state, size_t nread)
+{
+    const struct transform *transform;
+    char                   *conversion_type;
+    char                   *message;
+    char                   *save;
+    size_t                  message_len;
+    size_t                  needed;
+    size_t                  out_len;
+
+    state->buf[nread] = '\0';    // Null-terminate the read data
+
+    // Parse conversion type and message
+    conversion_type = strtok_r((char *)state->buf, "|", &save);
+    message         = strtok_r(NULL, "|", &save);
+
+    if(!conversion_type || !message)
+    {
+        fprintf(stderr, "Invalid format. Expected format: <conversion>|<message>\n");
+        return -3;
+    }
+    printf("Message received from client: %s\n", message);
+
+    transform = resolve_transform(state, conversion_type, strlen(conversion_type));
+
+    if(transform == NULL)
+    {
+        return -3;
+    }
+
+    // An encoder's reply can outgrow the output buffer
+    message_len = strlen(message);
+    needed      = transform_max_output(transform, message_len);
+
+    if(needed > state->size)
+    {
+        size_t offset;
+
+        offset = (size_t)((uint8_t *)message - state->buf);
+
+        if(grow_buffer(state, needed) == -1)
+        {
+            return -1;
+        }
+        message = (char *)state->buf + offset;
+    }
+
+    // Perform the conversion
+    out_len = transform->apply(state->out, (const uint8_t *)message, message_len, 0);
+
+    if(out_len == TRANSFORM_INVALID)
+    {
+        fprintf(stderr, "Invalid input for %s\n", transform->name);
+        return -3;
+    }
+    metrics_request(state->metrics, transform_opcode(transform));
+
+    reply_reset(state);
+    reply_add(state, state->out, out_len);
+
+    return 0;
+}
+
+static bool hello_prefix(const struct copy_state *state, const char *hello, size_t len)
+{
+    return memcmp(state->buf, hello, state->nread < len ? state->nread : len) == 0;
+}
+
+static ssize_t detect_mode(struct copy_state *state)
+{
+    if(state->nread > 0 && state->buf[0] == WIRE_MAGIC)
+    {
+        state->mode = COPY_MODE_BINARY;
+        return 0;
+    }
+
+    if(hello_prefix(state, SESSION_HELLO, SESSION_HELLO_LEN))
+    {
+        // Only part of the hello has arrived, wait for the rest unless the peer already hung up
+        if(state->nread < SESSION_HELLO_LEN)
+        {
+            if(state->eof)
+            {
+                state->mode = COPY_MODE_LEGACY;
+            }
+            return 0;
+        }
+
+        state->nread -= SESSION_HELLO_LEN;
+        memmove(state->buf, state->buf + SESSION_HELLO_LEN, state->nread);
+        state->mode = COPY_MODE_SESSION;
+
+        // The hello is no request, a session that has not sent one yet is idle rather than slow
+        if(state->nread == 0)
+        {
+            state->started = 0;
+        }
+        return 0;
+    }
+
+    if(hello_prefix(state, STREAM_HELLO, STREAM_HELLO_LEN))
+    {
+        uint8_t    *eol;
+        const char *name;
+        const char *sep;
+        size_t      name_len;
+        size_t      conversion_len;
+        size_t      hello_len;
+
+        eol = (uint8_t *)memchr(state->buf, '\n', state->nread);
+
+        if(eol == NULL)
+        {
+            if(state->eof && state->nread < STREAM_HELLO_LEN)
+            {
+                state->mode = COPY_MODE_LEGACY;
+                return 0;
+            }
+
+            if(state->eof || state->nread >= state->size - 1)
+            {
+                fprintf(stderr, "Invalid format. Expected format: STREAM|<conversion>\n");
+                return -3;
+            }
+            return 0;
+        }
+
+        *eol           = '\0';
+        name           = (const char *)state->buf + STREAM_HELLO_LEN;
+        name_len       = (size_t)(eol - state->buf) - STREAM_HELLO_LEN;
+        sep            = (const char *)memchr(name, '|', name_len);
+        conversion_len = sep != NULL ? (size_t)(sep - name) : name_len;
+
+        if(resolve_transform(state, name, conversion_len) == NULL)
+        {
+            return -3;
+        }
+
+        if(sep != NULL && !codec_find(sep + 1, name_len - conversion_len - 1))
+        {
+            fprintf(stderr, "Unknown compression: %s\n", sep + 1);
+            return -3;
+        }
+
+        if(state->transform->in_block == 0)
+        {
+            fprintf(stderr, "Conversion %s cannot be streamed\n", state->transform->name);
+            return -3;
+        }
+        metrics_request(state->metrics, transform_opcode(state->transform));
+
+        hello_len = (size_t)(eol - state->buf) + 1;
+        state->nread -= hello_len;
+        memmove(state->buf, state->buf + hello_len, state->nread);
+
+        if(grow_buffer(state, STREAM_CHUNK) == -1 || (sep != NULL && open_codec(state) == -1))
+        {
+            return -1;
+        }
+        state->stream_remaining = SIZE_MAX;
+        state->mode             = COPY_MODE_STREAM;
+        return 0;
+    }
+
+    state->mode = COPY_MODE_LEGACY;
+
+    return 0;
+}
+
+static int grow_buffer(struct copy_state *state, size_t size)
+{
+    uint8_t *buf;
+
+    if(state->size >= size)
+    {
+        return 0;
+    }
+
+    // Only called before a reply is queued, so none points into the old buffer and only the request bytes move
+    buf = (uint8_t *)pool_alloc(state->pool, size * 2);
+
+    if(buf == NULL)
+    {
+        return -1;
+    }
+    memcpy(buf, state->buf, state->nread);
+    pool_free(state->pool, state->buf, state->size * 2);
+    state->buf  = buf;
+    state->out  = buf + size;
+    state->size = size;
+
+    return 0;
+}
+
+static int open_codec(struct copy_state *state)
+{
+    struct copy_codec *codec;
+    int                err;
+
+    codec = (struct copy_codec *)pool_alloc(state->pool, sizeof(*codec));
+
+    if(codec == NULL)
+    {
+        return -1;
+    }
+
+    // The two side buffers share one allocation, like the request and reply ones
+    codec->plain = (uint8_t *)pool_alloc(state->pool, STREAM_CHUNK * 2);
+
+    if(codec->plain == NULL || codec_init(&codec->codec, &err) == -1)
+    {
+        pool_free(state->pool, codec->plain, STREAM_CHUNK * 2);
+        pool_free(state->pool, codec, sizeof(*codec));
+        return -1;
+    }
+    codec->converted = codec->plain + STREAM_CHUNK;
+    codec->plain_len = 0;
+    codec->finishing = false;
+    state->codec     = codec;
+
+    return 0;
+}
+
+static void reply_reset(struct copy_state *state)
+{
+    state->pieces      = 0;
+    state->pieces_sent = 0;
+    state->reply_len   = 0;
+    state->nwrote      = 0;
+}
+
+static void reply_add(struct copy_state *state, const uint8_t *data, size_t len)
+{
+    struct iovec *last;
+
+    if(len == 0)
+    {
+        return;
+    }
+    state->reply_len += len;
+
+    // Pieces that follow each other in memory, like frames converted in place, go out as one
+    last = state->pieces > 0 ? &state->reply[state->pieces - 1] : NULL;
+
+    if(last != NULL && (const uint8_t *)last->iov_base + last->iov_len == data)
+    {
+        last->iov_len += len;
+        return;
+    }
+
+    state->reply[state->pieces].iov_base = (void *)(uintptr_t)data;
+    state->reply[state->pieces].iov_len  = len;
+    state->pieces++;
+}
+
+static void reply_mark(const struct copy_state *state, struct reply_mark *mark)
+{
+    mark->pieces    = state->pieces;
+    mark->reply_len = state->reply_len;
+    mark->last_len  = state->pieces > 0 ? state->reply[state->pieces - 1].iov_len : 0;
+}
+
+// Takes back whatever a frame added to the reply since the mark and answers it with an empty error frame instead,
+// under the same request id; the frames around it are answered as usual and the connection stays open
+static void reply_error(struct copy_state *state, const struct reply_mark *mark, uint8_t *frame, struct wire_header *header)
+{
+    state->pieces    = mark->pieces;
+    state->reply_len = mark->reply_len;
+
+    if(state->pieces > 0)
+    {
+        state->reply[state->pieces - 1].iov_len = mark->last_len;
+    }
+
+    metrics_error(state->metrics, -3);
+    header->flags  = (uint8_t)(header->flags | WIRE_FLAG_REPLY | WIRE_FLAG_ERROR);
+    header->length = 0;
+    wire_encode_header(frame, header);
+    reply_add(state, frame, WIRE_HEADER_LEN);
+}
+
+static ssize_t queue_gathered(struct copy_state *state, size_t consumed)
+{
+    state->consumed = consumed;
+
+    if(state->reply_len > 0)
+    {
+        state->phase = COPY_PHASE_WRITE;
+    }
+    else
+    {
+        state->phase = state->eof ? COPY_PHASE_DONE : COPY_PHASE_READ;
+    }
+
+    return 0;
+}
+
+static ssize_t queue_reply(struct copy_state *state, const uint8_t *reply, size_t len, size_t consumed)
+{
+    reply_reset(state);
+    reply_add(state, reply, len);
+
+    return queue_gathered(state, consumed);
+}
+
+static ssize_t process_lines(struct copy_state *state)
+{
+    size_t consumed;
+    size_t out_len;
+
+    consumed = 0;
+    out_len  = 0;
+
+    // Convert every complete line buffered so far, replies go out in request order
+    while(consumed < state->nread)
+    {
+        const struct transform *transform;
+        uint8_t                *line;
+        uint8_t                *eol;
+        uint8_t                *sep;
+        size_t                  message_len;
+        size_t                  needed;
+        size_t                  n;
+
+        line = state->buf + consumed;
+        eol  = (uint8_t *)memchr(line, '\n', state->nread - consumed);
+
+        if(eol == NULL)
+        {
+            break;
+        }
+
+        sep = (uint8_t *)memchr(line, '|', (size_t)(eol - line));
+
+        if(sep == NULL)
+        {
+            fprintf(stderr, "Invalid format. Expected format: <conversion>|<message>\n");
+            return -3;
+        }
+
+        transform = resolve_transform(state, (const char *)line, (size_t)(sep - line));
+
+        if(transform == NULL)
+        {
+            return -3;
+        }
+
+        // Send what is already converted before this reply would overflow the output buffer
+        message_len = (size_t)(eol - sep) - 1;
+        needed      = transform_max_output(transform, message_len) + 1;
+        if(out_len + needed > state->size)
+        {
+            if(out_len > 0)
+            {
+                break;
+            }
+
+            // Nothing is converted yet, so the buffers can move; then look at this line again
+            if(grow_buffer(state, needed) == -1)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        n = transform->apply(state->out + out_len, sep + 1, message_len, 0);
+
+        if(n == TRANSFORM_INVALID)
+        {
+            fprintf(stderr, "Invalid input for %s\n", transform->name);
+            return -3;
+        }
+
+        // A decoded newline would split the reply in two
+        if(memchr(state->out + out_len, '\n', n) != NULL)
+        {
+            fprintf(stderr, "Reply to %s contains a newline\n", transform->name);
+            return -3;
+        }
+        metrics_request(state->metrics, transform_opcode(transform));
+
+        state->out[out_len + n] = '\n';
+        out_len += n + 1;
+        consumed = (size_t)(eol - state->buf) + 1;
+    }
+
+    state->nread -= consumed;
+    memmove(state->buf, state->buf + consumed, state->nread);
+
+    // A full buffer without a newline can never become a complete request
+    if(out_len == 0 && state->nread >= state->size - 1)
+    {
+        fprintf(stderr, "Request too long, limit is %zu bytes\n", state->size - 2);
+        return -3;
+    }
+
+    return queue_reply(state, state->out, out_len, 0);
+}
+
+static bool frame_fits(const struct copy_state *state, const struct wire_header *header, const struct transform *transform)
+{
+    if(header->length > state->size - 1 - WIRE_HEADER_LEN)
+    {
+        return false;
+    }
+
+    // A reply of another length is built in the output buffer, which is no bigger than the input one
+    return transform == NULL || !transform_resizes(transform) || transform_max_output(transform, header->length) <= state->size;
+}
+
+// Converts a payload where it lies, or into the output buffer when the length changes, and adds it to the reply
+static size_t convert_payload(struct copy_state *state, const struct transform *transform, uint8_t *payload, size_t len, size_t *out_len)
+{
+    uint8_t *dst;
+    size_t   n;
+
+    dst = transform_resizes(transform) ? state->out + *out_len : payload;
+    n   = transform->apply(dst, payload, len, 0);
+
+    if(n == TRANSFORM_INVALID)
+    {
+        fprintf(stderr, "Invalid input for %s\n", transform->name);
+        return TRANSFORM_INVALID;
+    }
+    metrics_request(state->metrics, transform_opcode(transform));
+
+    if(dst != payload)
+    {
+        *out_len += n;
+    }
+    reply_add(state, dst, n);
+
+    return n;
+}
+
+// Checks every record of a batch before any is converted, and works out what its reply takes
+static ssize_t measure_batch(const uint8_t *payload, size_t len, size_t *out_needed, size_t *pieces)
+{
+    size_t offset;
+    size_t count;
+
+    *out_needed = 0;
+    *pieces     = 1;
+    count       = 0;
+
+    for(offset = 0; offset < len;)
+    {
+        const struct transform *transform;
+        struct wire_record      record;
+
+        if(len - offset < WIRE_RECORD_LEN)
+        {
+            fprintf(stderr, "Invalid batch record\n");
+            return -3;
+        }
+        wire_decode_record(payload + offset, &record);
+        transform = transform_get(record.opcode);
+
+        if(transform == NULL || record.length > len - offset - WIRE_RECORD_LEN)
+        {
+            fprintf(stderr, "Invalid batch record\n");
+            return -3;
+        }
+
+        if(++count > WIRE_BATCH_MAX)
+        {
+            fprintf(stderr, "Batch frame has more than %d records\n", WIRE_BATCH_MAX);
+            return -3;
+        }
+
+        // A reply of another length is one piece in the output buffer, then the request bytes go on after it
+        if(transform_resizes(transform))
+        {
+            *out_needed += transform_max_output(transform, record.length);
+            *pieces += 2;
+        }
+        offset += WIRE_RECORD_LEN + record.length;
+    }
+
+    return 0;
+}
+
+// Record headers, and the replies that keep their length, stay where the request put them; only their lengths change
+static ssize_t convert_batch(struct copy_state *state, uint8_t *frame, const struct wire_header *header, size_t *out_len)
+{
+    struct wire_header reply;
+    size_t             offset;
+    size_t             reply_len;
+
+    reply_add(state, frame, WIRE_HEADER_LEN);
+    reply_len = 0;
+
+    for(offset = WIRE_HEADER_LEN; offset < WIRE_HEADER_LEN + header->length;)
+    {
+        struct wire_record record;
+        uint8_t           *at;
+        size_t             n;
+
+        at = frame + offset;
+        wire_decode_record(at, &record);
+        reply_add(state, at, WIRE_RECORD_LEN);
+        n = convert_payload(state, transform_get(record.opcode), at + WIRE_RECORD_LEN, record.length, out_len);
+
+        if(n == TRANSFORM_INVALID)
+        {
+            return -3;
+        }
+        offset += WIRE_RECORD_LEN + record.length;
+
+        record.length = (uint32_t)n;
+        wire_encode_record(at, &record);
+        reply_len += WIRE_RECORD_LEN + n;
+    }
+
+    reply        = *header;
+    reply.flags  = (uint8_t)(reply.flags | WIRE_FLAG_REPLY);
+    reply.length = (uint32_t)reply_len;
+    wire_encode_header(frame, &reply);
+
+    return 0;
+}
+
+static ssize_t process_frames(struct copy_state *state)
+{
+    size_t consumed;
+    size_t out_len;
+
+    // The rest of an oversized frame passes straight through a chunk at a time
+    if(state->stream_remaining > 0)
+    {
+        return process_chunk(state, 0);
+    }
+
+    consumed = 0;
+    out_len  = 0;
+    reply_reset(state);
+
+    // Frames are converted where they lie and their headers reused for the replies; replies of another length are
+    // built in the output buffer, and the pieces all go out together in one gathered write
+    while(state->nread - consumed >= WIRE_HEADER_LEN)
+    {
+        const struct transform *transform;
+        struct wire_header      header;
+        struct reply_mark       mark;
+        uint8_t                *frame;
+        size_t                  out_needed;
+        size_t                  pieces;
+        bool                    valid;
+
+        frame = state->buf + consumed;
+        wire_decode_header(frame, &header);
+
+        // Past a header that is not one nothing can be trusted, not even where the next frame starts: the replies
+        // converted in front of it still go out, then the connection closes
+        if(header.magic != WIRE_MAGIC || header.version != WIRE_VERSION)
+        {
+            if(consumed > 0)
+            {
+                break;
+            }
+            fprintf(stderr, "Invalid frame header\n");
+            return -3;
+        }
+
+        // A frame with an unknown opcode is still skipped by its length, and answered with an error
+        transform = (header.flags & WIRE_FLAG_BATCH) ? NULL : transform_get(header.opcode);
+        valid     = transform != NULL || (header.flags & WIRE_FLAG_BATCH);
+
+        if(!frame_fits(state, &header, transform))
+        {
+            // Flush the complete frames in front of it first
+            if(consumed > 0)
+            {
+                break;
+            }
+
+            if(grow_buffer(state, STREAM_CHUNK) == -1)
+            {
+                return -1;
+            }
+            frame = state->buf;
+
+            // Still too big to hold whole: send the reply header now and stream the payload behind it,
+            // which needs a transform that keeps the length and works on any split of its input
+            if(!frame_fits(state, &header, transform))
+            {
+                if(!valid)
+                {
+                    fprintf(stderr, "Frame too large for unknown opcode %u\n", header.opcode);
+                    return -3;
+                }
+
+                if(transform == NULL || transform_resizes(transform) || transform->in_block == 0)
+                {
+                    fprintf(stderr, "Frame too large for %s\n", transform != NULL ? transform->name : "a batch");
+                    return -3;
+                }
+
+                metrics_request(state->metrics, header.opcode);
+                state->buf[3] |= WIRE_FLAG_REPLY;
+                state->stream_remaining = header.length;
+                state->stream_prev      = 0;
+                state->transform        = transform;
+                return process_chunk(state, WIRE_HEADER_LEN);
+            }
+        }
+
+        if(state->nread - consumed - WIRE_HEADER_LEN < header.length)
+        {
+            break;
+        }
+
+        if(!valid)
+        {
+            out_needed = 0;
+            pieces     = 1;
+        }
+        else if(transform != NULL)
+        {
+            out_needed = transform_resizes(transform) ? transform_max_output(transform, header.length) : 0;
+            pieces     = transform_resizes(transform) ? 2 : 1;
+        }
+        else if(measure_batch(frame + WIRE_HEADER_LEN, header.length, &out_needed, &pieces) < 0)
+        {
+            valid      = false;
+            out_needed = 0;
+            pieces     = 1;
+        }
+
+        // Send what is already converted before this reply would overflow the output buffer or the pieces of one write
+        if(out_len + out_needed > state->size || state->pieces + pieces > COPY_IOV_MAX)
+        {
+            if(consumed > 0)
+            {
+                break;
+            }
+
+            // Nothing is converted yet, so the buffers can move; then look at this frame again
+            if(grow_buffer(state, out_needed) == -1)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        consumed += WIRE_HEADER_LEN + header.length;
+        reply_mark(state, &mark);
+
+        if(!valid)
+        {
+            if(transform == NULL && !(header.flags & WIRE_FLAG_BATCH))
+            {
+                fprintf(stderr, "Unknown opcode %u\n", header.opcode);
+            }
+            reply_error(state, &mark, frame, &header);
+        }
+        else if(transform == NULL)
+        {
+            if(convert_batch(state, frame, &header, &out_len) < 0)
+            {
+                reply_error(state, &mark, frame, &header);
+            }
+        }
+        else
+        {
+            size_t n;
+
+            reply_add(state, frame, WIRE_HEADER_LEN);
+            n = convert_payload(state, transform, frame + WIRE_HEADER_LEN, header.length, &out_len);
+
+            if(n == TRANSFORM_INVALID)
+            {
+                reply_error(state, &mark, frame, &header);
+                continue;
+            }
+
+            header.flags  = (uint8_t)(header.flags | WIRE_FLAG_REPLY);
+            header.length = (uint32_t)n;
+            wire_encode_header(frame, &header);
+        }
+    }
+
+    return queue_gathered(state, consumed);
+}
+
+static ssize_t process_chunk(struct copy_state *state, size_t skip)
 {
-    if(conversion_type == NULL || strcmp(conversion_type, "none") == 0)
+    const struct transform *transform;
+    uint8_t                *dst;
+    size_t                  chunk;
+    size_t                  n;
+    uint8_t                 prev;
+
+    // Convert whatever part of the streamed payload is buffered after the first skip bytes and send it right back
+    transform = state->transform;
+    chunk     = state->nread - skip;
+
+    if(chunk > state->stream_remaining)
     {
-        return;
+        chunk = state->stream_remaining;
+    }
+
+    // Expanding transforms write to the output buffer, take no more than their result can fill
+    if(transform_max_output(transform, chunk) > state->size)
+    {
+        chunk = state->size / transform->out_block * transform->in_block;
+    }
+
+    // Blocks and characters are never split between chunks, only the end of the payload may be a partial one
+    if(chunk != state->stream_remaining && !(state->eof && chunk == state->nread - skip))
+    {
+        chunk = whole_units(transform, state->buf + skip, chunk);
+    }
+
+    // Transforms that change the length cannot work in place
+    dst  = transform_resizes(transform) ? state->out : state->buf + skip;
+    prev = chunk > 0 ? state->buf[skip + chunk - 1] : state->stream_prev;
+    n    = transform->apply(dst, state->buf + skip, chunk, state->stream_prev);
+
+    if(n == TRANSFORM_INVALID)
+    {
+        fprintf(stderr, "Invalid input for %s\n", transform->name);
+        return -3;
+    }
+    state->stream_prev = prev;
+    state->stream_remaining -= chunk;
+
+    if(dst == state->out)
+    {
+        return queue_reply(state, state->out, n, chunk);
+    }
+
+    return queue_reply(state, state->buf, skip + n, skip + chunk);
+}
+
+// Trims a chunk to the whole blocks and characters at its start
+static size_t whole_units(const struct transform *transform, const uint8_t *src, size_t len)
+{
+    len -= len % transform->in_block;
+
+    return transform->utf8 ? utf8_complete(src, len) : len;
+}
+
+// Moves a compressed stream along until there is a reply to send or nothing left to work on: what the deflater holds
+// goes out first, then more is inflated and converted. Each stage holds at most a chunk, whatever the payload size
+static ssize_t process_compressed(struct copy_state *state)
+{
+    const struct transform *transform;
+    struct copy_codec      *codec;
+
+    transform = state->transform;
+    codec     = state->codec;
+
+    while(true)
+    {
+        size_t  out_len;
+        size_t  used;
+        size_t  chunk;
+        ssize_t n;
+        uint8_t prev;
+
+        if(codec_pending(&codec->codec) || codec->finishing)
+        {
+            out_len = codec_deflate(&codec->codec, state->out, state->size, codec->finishing);
+
+            if(out_len > 0)
+            {
+                return queue_reply(state, state->out, out_len, 0);
+            }
+        }
+
+        // The last of the reply went out
+        if(codec->codec.finished)
+        {
+            state->phase = COPY_PHASE_DONE;
+            return 0;
+        }
+
+        // Request bytes are dropped as soon as they are inflated, the reply never points at them
+        used = state->nread;
+        n    = codec_inflate(&codec->codec, state->buf, &used, codec->plain + codec->plain_len, STREAM_CHUNK - codec->plain_len);
+
+        if(n < 0)
+        {
+            fprintf(stderr, "Invalid compressed stream\n");
+            return n;
+        }
+        state->nread -= used;
+        memmove(state->buf, state->buf + used, state->nread);
+        codec->plain_len += (size_t)n;
+
+        // Like a plain stream, whole blocks and characters until the end, and no more than the converted buffer holds
+        chunk = codec->plain_len;
+
+        if(transform_max_output(transform, chunk) > STREAM_CHUNK)
+        {
+            chunk = STREAM_CHUNK / transform->out_block * transform->in_block;
+        }
+
+        if(!(codec->codec.ended && chunk == codec->plain_len))
+        {
+            chunk = whole_units(transform, codec->plain, chunk);
+        }
+
+        if(chunk == 0 && !codec->codec.ended)
+        {
+            if(state->eof)
+            {
+                fprintf(stderr, "Compressed stream ends early\n");
+                return -3;
+            }
+            state->phase = COPY_PHASE_READ;
+            return 0;
+        }
+
+        prev    = chunk > 0 ? codec->plain[chunk - 1] : state->stream_prev;
+        out_len = transform->apply(codec->converted, codec->plain, chunk, state->stream_prev);
+
+        if(out_len == TRANSFORM_INVALID)
+        {
+            fprintf(stderr, "Invalid input for %s\n", transform->name);
+            return -3;
+        }
+        state->stream_prev = prev;
+        codec->plain_len -= chunk;
+        memmove(codec->plain, codec->plain + chunk, codec->plain_len);
+        codec_feed(&codec->codec, codec->converted, out_len);
+        codec->finishing = codec->codec.ended && codec->plain_len == 0;
+    }
+}
+
+size_t copy_input(struct copy_state *state, uint8_t **ptr)
+{
+    *ptr = state->buf + state->nread;
+
+    return state->size - 1 - state->nread;    // Leave space for null terminator
+}
+
+ssize_t copy_received(struct copy_state *state, size_t n)
+{
+    state->nread += n;
+
+    if(n == 0)
+    {
+        state->eof = true;
+    }
+
+    metrics_bytes(state->metrics, n, 0);
+
+    // Also what a request that is slow to arrive is timed against, so it is kept whether or not anyone watches latency
+    if(n > 0 && state->started == 0)
+    {
+        state->started = metrics_now();
     }
 
-    if(strcmp(conversion_type, "upper") == 0)
+    if(state->mode == COPY_MODE_UNKNOWN)
     {
-        for(size_t i = 0; message[i]; i++)
+        ssize_t result;
+
+        result = detect_mode(state);
+
+        if(result < 0)
         {
-            message[i] = (char)toupper((unsigned char)message[i]);
+            return result;
         }
     }
-    else if(strcmp(conversion_type, "lower") == 0)
+
+    if(state->mode == COPY_MODE_SESSION)
+    {
+        return process_lines(state);
+    }
+
+    if(state->mode == COPY_MODE_BINARY)
+    {
+        return process_frames(state);
+    }
+
+    if(state->mode == COPY_MODE_STREAM)
     {
-        for(size_t i = 0; message[i]; i++)
+        return state->codec != NULL ? process_compressed(state) : process_chunk(state, 0);
+    }
+
+    if(state->mode == COPY_MODE_LEGACY)
+    {
+        ssize_t result;
+
+        // A legacy request is whatever the first read delivered
+        result = parse_request(state, state->nread);
+
+        if(result < 0)
         {
-            message[i] = (char)tolower((unsigned char)message[i]);
+            return result;
         }
+        state->phase = state->reply_len > 0 ? COPY_PHASE_WRITE : COPY_PHASE_DONE;
     }
+
+    return 0;
 }
 
-ssize_t convert_copy(int fd, size_t size, int *err)
+size_t copy_output(const struct copy_state *state, const struct iovec **iov)
 {
-    uint8_t    *buf;
-    ssize_t     retval;
-    ssize_t     nread;
-    ssize_t     nwrote;
-    const char *conversion_type;
-    char       *message;
-    char       *save;
-    size_t      message_len;
+    *iov = state->reply + state->pieces_sent;
 
-    *err  = 0;
-    errno = 0;
-    buf   = (uint8_t *)malloc(size);
+    return state->pieces - state->pieces_sent;
+}
 
-    if(buf == NULL)
+ssize_t copy_sent(struct copy_state *state, size_t n)
+{
+    state->nwrote += n;
+    metrics_bytes(state->metrics, 0, n);
+
+    // Drop the pieces sent whole and start the next write where this one stopped
+    while(n > 0)
     {
-        *err   = errno;
-        retval = -1;
-        goto done;
+        struct iovec *piece;
+        size_t        step;
+
+        piece           = &state->reply[state->pieces_sent];
+        step            = n < piece->iov_len ? n : piece->iov_len;
+        piece->iov_base = (uint8_t *)piece->iov_base + step;
+        piece->iov_len -= step;
+        n -= step;
+
+        if(piece->iov_len == 0)
+        {
+            state->pieces_sent++;
+        }
     }
 
-    // Read from the file descriptor
-    nread = read(fd, buf, size - 1);    // Leave space for null terminator
-    if(nread < 0)
+    if(state->nwrote < state->reply_len)
     {
-        *err   = errno;
-        retval = -2;
-        goto cleanup;
+        return 0;
     }
-    buf[nread] = '\0';    // Null-terminate the read data
+    state->answered = true;
 
-    // Parse conversion type and message
-    conversion_type = strtok_r((char *)buf, "|", &save);
-    message         = strtok_r(NULL, "|", &save);
+    if(state->started != 0)
+    {
+        uint64_t now;
 
-    if(!conversion_type || !message)
+        now = metrics_now();
+        metrics_latency(state->metrics, now - state->started);
+
+        // Requests pipelined behind this reply have been waiting at least since now
+        state->started = state->nread > state->consumed ? now : 0;
+    }
+
+    // A session goes on with whatever requests were pipelined behind this batch
+    if(state->mode == COPY_MODE_SESSION)
     {
-        fprintf(stderr, "Invalid format. Expected format: <conversion>|<message>\n");
-        retval = -3;
-        goto cleanup;
+        return process_lines(state);
     }
-    printf("Message received from client: %s\n", message);
 
-    // Perform the conversion
-    convert_case(message, conversion_type);
+    // A compressed stream dropped its request bytes as it inflated them
+    if(state->codec != NULL)
+    {
+        return process_compressed(state);
+    }
 
-    // Write the converted message back to fd
-    nwrote      = 0;
-    message_len = strlen(message);
-    while(nwrote < (ssize_t)message_len)
+    // Binary and stream requests are dropped once answered, before looking at the next ones
+    if(state->mode == COPY_MODE_BINARY || state->mode == COPY_MODE_STREAM)
+    {
+        state->nread -= state->consumed;
+        memmove(state->buf, state->buf + state->consumed, state->nread);
+        return state->mode == COPY_MODE_BINARY ? process_frames(state) : process_chunk(state, 0);
+    }
+    state->phase = COPY_PHASE_DONE;
+
+    return 0;
+}
+
+size_t copy_splice(struct copy_state *state, int *fd_in, int *fd_out)
+{
+    // Whatever is in the pipe goes out before anything else is read
+    if(state->piped > 0)
+    {
+        *fd_in  = state->pipe_fds[0];
+        *fd_out = state->fd;
+        return state->piped;
+    }
+
+    // Only passthrough bytes that are not buffered yet can skip user space
+    if(state->phase != COPY_PHASE_READ || state->eof || state->nread > 0 || state->stream_remaining == 0 || state->codec != NULL || state->transform != transform_get(TRANSFORM_NONE))
+    {
+        return 0;
+    }
+
+    // Without a pipe the bytes just take the read/write path
+    if(state->pipe_fds[0] == -1 && pipe2(state->pipe_fds, O_CLOEXEC) == -1)
+    {
+        state->pipe_fds[0] = -1;
+        state->pipe_fds[1] = -1;
+        return 0;
+    }
+
+    *fd_in  = state->fd;
+    *fd_out = state->pipe_fds[1];
+
+    return state->stream_remaining < STREAM_CHUNK ? state->stream_remaining : STREAM_CHUNK;
+}
+
+ssize_t copy_spliced(struct copy_state *state, size_t n)
+{
+    // Draining the pipe
+    if(state->piped > 0)
+    {
+        metrics_bytes(state->metrics, 0, n);
+        state->piped -= n;
+        state->phase = state->piped > 0 ? COPY_PHASE_WRITE : COPY_PHASE_READ;
+        return 0;
+    }
+
+    // Filling it
+    if(n == 0)
+    {
+        state->eof   = true;
+        state->phase = COPY_PHASE_DONE;
+        return 0;
+    }
+    metrics_bytes(state->metrics, n, 0);
+    state->piped = n;
+    state->stream_remaining -= n;
+    state->phase = COPY_PHASE_WRITE;
+
+    return 0;
+}
+
+static ssize_t splice_step(struct copy_state *state, int *err)
+{
+    // Fill the pipe once, like a read, then drain it for as long as the socket takes it
+    do
+    {
+        int     fd_in;
+        int     fd_out;
+        size_t  len;
+        ssize_t nspliced;
+
+        len = copy_splice(state, &fd_in, &fd_out);
+
+        if(len == 0)
+        {
+            break;
+        }
+
+        nspliced = splice(fd_in, NULL, fd_out, NULL, len, SPLICE_F_MOVE);
+        if(nspliced < 0)
+        {
+            if(errno == EAGAIN || errno == EINTR)
+            {
+                break;
+            }
+            *err = errno;
+            return state->piped > 0 ? -4 : -2;
+        }
+
+        copy_spliced(state, (size_t)nspliced);
+    } while(state->phase == COPY_PHASE_WRITE);
+
+    return 0;
+}
+
+ssize_t convert_copy_step(struct copy_state *state, int *err)
+{
+    ssize_t retval;
+    int     fd_in;
+    int     fd_out;
+
+    *err = 0;
+
+    // A passthrough stream moves socket to pipe to socket without its bytes entering user space
+    if(copy_splice(state, &fd_in, &fd_out) > 0)
+    {
+        retval = splice_step(state, err);
+        goto done;
+    }
+
+    if(state->phase == COPY_PHASE_READ)
+    {
+        uint8_t *in;
+        size_t   room;
+        ssize_t  nread;
+
+        // Read from the file descriptor
+        room  = copy_input(state, &in);
+        nread = read(state->fd, in, room);
+        if(nread < 0)
+        {
+            if(errno == EAGAIN || errno == EINTR)
+            {
+                retval = 0;
+                goto done;
+            }
+            *err   = errno;
+            retval = -2;
+            goto done;
+        }
+
+        retval = copy_received(state, (size_t)nread);
+        if(retval < 0)
+        {
+            goto done;
+        }
+    }
+
+    // Write the converted message back to fd, resuming after any partial write
+    while(state->phase == COPY_PHASE_WRITE)
     {
-        ssize_t twrote = write(fd, message + nwrote, (message_len - (size_t)nwrote));
+        const struct iovec *iov;
+        size_t              count;
+        ssize_t             twrote;
+
+        count  = copy_output(state, &iov);
+        twrote = writev(state->fd, iov, (int)count);
         if(twrote < 0)
         {
+            if(errno == EAGAIN || errno == EINTR)
+            {
+                break;
+            }
             *err   = errno;
             retval = -4;
-            goto cleanup;
+            goto done;
         }
-        nwrote += twrote;
-    }
 
-    retval = nwrote;
+        retval = copy_sent(state, (size_t)twrote);
+        if(retval < 0)
+        {
+            goto done;
+        }
+    }
 
-cleanup:
-    free(buf);
+    retval = (ssize_t)state->nwrote;
 
 done:
     return retval;
 }
 
+enum copy_wait copy_waiting(const struct copy_state *state)
+{
+    if(state->phase == COPY_PHASE_WRITE)
+    {
+        return COPY_WAIT_REPLY;
+    }
+
+    // Only a request that has started to arrive, or was pipelined behind the last reply, has a start time
+    return state->started != 0 ? COPY_WAIT_REQUEST : COPY_WAIT_IDLE;
+}
+
+// A session or binary connection that has been answered and sent nothing since can be closed without losing work, its
+// client expects that of any server going away and opens a new one. A stream is one request until its EOF
+bool copy_between_requests(const struct copy_state *state)
+{
+    return (state->mode == COPY_MODE_SESSION || state->mode == COPY_MODE_BINARY) && state->answered && copy_waiting(state) == COPY_WAIT_IDLE;
+}
+
+// When the connection's current wait runs out, 0 for never; now is when it last made progress
+uint64_t copy_deadline(const struct copy_state *state, const struct copy_timeouts *timeouts, uint64_t now)
+{
+    enum copy_wait wait;
+
+    wait = copy_waiting(state);
+
+    // Counted from the request's first byte and never pushed back, so a request trickled in a byte at a time still runs out
+    if(wait == COPY_WAIT_REQUEST)
+    {
+        return timeouts->request != 0 ? state->started + timeouts->request : 0;
+    }
+
+    if(wait == COPY_WAIT_REPLY)
+    {
+        return timeouts->reply != 0 ? now + timeouts->reply : 0;
+    }
+
+    return timeouts->idle != 0 ? now + timeouts->idle : 0;
+}
+
+void copy_report_timeout(const struct copy_state *state)
+{
+    enum copy_wait wait;
+
+    wait = copy_waiting(state);
+
+    if(wait == COPY_WAIT_REQUEST)
+    {
+        metrics_timeout(state->metrics, METRICS_TIMEOUT_REQUEST);
+    }
+    else if(wait == COPY_WAIT_REPLY)
+    {
+        metrics_timeout(state->metrics, METRICS_TIMEOUT_REPLY);
+    }
+    else
+    {
+        metrics_timeout(state->metrics, METRICS_TIMEOUT_IDLE);
+    }
+}
+
+void copy_report_error(struct worker_metrics *metrics, ssize_t result, int err)
+{
+    const char *msg;
+
+    metrics_error(metrics, result);
+
+    msg = strerror(err);
+
+    if(result == -1)
+    {
+        fprintf(stderr, "Memory allocation error: %s\n", msg);
+    }
+    else if(result == -2)
+    {
+        fprintf(stderr, "Read error: %s\n", msg);
+    }
+    else if(result == -4)
+    {
+        fprintf(stderr, "Write error: %s\n", msg);
+    }
+}
+
+// Waits until the connection can read or write, whichever it is waiting to do: 1 then, 0 once its deadline passes first,
+// 2 once the server drains. The drain only counts between requests, one under way is finished first
+static int await_ready(const struct copy_state *state, const struct copy_timeouts *timeouts, int drain_fd, int *err)
+{
+    struct pollfd pfds[2];
+    uint64_t      deadline;
+
+    memset(pfds, 0, sizeof(pfds));
+    pfds[0].fd     = state->fd;
+    pfds[0].events = state->phase == COPY_PHASE_WRITE ? POLLOUT : POLLIN;
+    pfds[1].fd     = copy_between_requests(state) ? drain_fd : -1;
+    pfds[1].events = POLLIN;
+    deadline       = copy_deadline(state, timeouts, metrics_now());
+
+    while(true)
+    {
+        uint64_t now;
+        uint64_t left_ms;
+        int      wait_ms;
+        int      result;
+
+        wait_ms = -1;
+
+        if(deadline != 0)
+        {
+            now = metrics_now();
+
+            if(now >= deadline)
+            {
+                return 0;
+            }
+
+            // Rounded up, so poll() never gives up just short of the deadline
+            left_ms = (deadline - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+            wait_ms = left_ms > INT_MAX ? INT_MAX : (int)left_ms;
+        }
+
+        result = poll(pfds, 2, wait_ms);
+
+        if(result > 0)
+        {
+            return (pfds[1].revents & POLLIN) ? 2 : 1;
+        }
+
+        if(result == -1 && errno != EINTR)
+        {
+            *err = errno;
+            return -1;
+        }
+    }
+}
+
 ssize_t nwrite(const char *buffer, int fd, size_t size, int *err)
 {
     ssize_t nwrote;
@@ -0,0 +1,186 @@
+#include "../include/datagram.h"
+#include "../include/transform.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// One request and where its reply goes
+struct datagram_slot
+{
+    struct sockaddr_storage peer;
+    uint8_t                 request[DATAGRAM_MAX];
+    uint8_t                 reply[DATAGRAM_REPLY_MAX];
+};
+
+// Everything one recvmmsg()/sendmmsg() round works on, kept between rounds
+struct datagram_batch
+{
+    struct datagram_slot    slots[DATAGRAM_BATCH];
+    struct mmsghdr          in[DATAGRAM_BATCH];
+    struct mmsghdr          out[DATAGRAM_BATCH];
+    struct iovec            in_iov[DATAGRAM_BATCH];
+    struct iovec            out_iov[DATAGRAM_BATCH];
+    const struct transform *transform;    // Last transform used, so repeated names resolve once
+};
+
+static bool answer(struct datagram_batch *batch, unsigned int i, struct mmsghdr *out, struct iovec *iov, struct worker_metrics *metrics);
+static void send_replies(int fd, struct mmsghdr *out, unsigned int count, struct worker_metrics *metrics);
+
+int run_datagram_loop(int fd, struct worker_metrics *metrics, int *err)
+{
+    struct datagram_batch *batch;
+
+    batch = (struct datagram_batch *)calloc(1, sizeof(*batch));
+
+    if(batch == NULL)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    for(unsigned int i = 0; i < DATAGRAM_BATCH; i++)
+    {
+        batch->in_iov[i].iov_base       = batch->slots[i].request;
+        batch->in_iov[i].iov_len        = DATAGRAM_MAX;
+        batch->in[i].msg_hdr.msg_name   = &batch->slots[i].peer;
+        batch->in[i].msg_hdr.msg_iov    = &batch->in_iov[i];
+        batch->in[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while(true)
+    {
+        unsigned int nreplies;
+        int          nreceived;
+
+        for(unsigned int i = 0; i < DATAGRAM_BATCH; i++)
+        {
+            batch->in[i].msg_hdr.msg_namelen = sizeof(batch->slots[i].peer);
+        }
+
+        // Wait for one datagram, then take whatever else has queued up behind it without waiting again
+        nreceived = recvmmsg(fd, batch->in, DATAGRAM_BATCH, MSG_WAITFORONE, NULL);
+
+        if(nreceived == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            *err = errno;
+            break;
+        }
+
+        nreplies = 0;
+
+        for(unsigned int i = 0; i < (unsigned int)nreceived; i++)
+        {
+            if(answer(batch, i, &batch->out[nreplies], &batch->out_iov[nreplies], metrics))
+            {
+                nreplies++;
+            }
+        }
+
+        send_replies(fd, batch->out, nreplies, metrics);
+    }
+
+    free(batch);
+
+    return -1;
+}
+
+// Converts one "<conversion>|<message>" request; one that cannot be answered is dropped, as UDP may drop it anyway
+static bool answer(struct datagram_batch *batch, unsigned int i, struct mmsghdr *out, struct iovec *iov, struct worker_metrics *metrics)
+{
+    struct datagram_slot *slot;
+    uint8_t              *sep;
+    uint8_t              *message;
+    uint8_t              *dst;
+    size_t                len;
+    size_t                message_len;
+    size_t                n;
+
+    slot = &batch->slots[i];
+    len  = batch->in[i].msg_len;
+    metrics_bytes(metrics, len, 0);
+
+    sep = (batch->in[i].msg_hdr.msg_flags & MSG_TRUNC) ? NULL : (uint8_t *)memchr(slot->request, '|', len);
+
+    if(sep == NULL)
+    {
+        metrics_error(metrics, -3);
+        return false;
+    }
+
+    if(batch->transform == NULL || strlen(batch->transform->name) != (size_t)(sep - slot->request) || memcmp(batch->transform->name, slot->request, (size_t)(sep - slot->request)) != 0)
+    {
+        batch->transform = transform_find((const char *)slot->request, (size_t)(sep - slot->request));
+    }
+
+    message     = sep + 1;
+    message_len = len - (size_t)(message - slot->request);
+
+    if(batch->transform == NULL || transform_max_output(batch->transform, message_len) > DATAGRAM_REPLY_MAX)
+    {
+        metrics_error(metrics, -3);
+        return false;
+    }
+
+    // A reply of the same length is converted where the request lies
+    dst = transform_resizes(batch->transform) ? slot->reply : message;
+    n   = batch->transform->apply(dst, message, message_len, 0);
+
+    // Nothing vouches for a datagram's source address, so a reply larger than its request would let a forged one
+    // amplify traffic at someone else; such conversions, the encoders among them, are only served over a connection
+    if(n == TRANSFORM_INVALID || n > len)
+    {
+        metrics_error(metrics, -3);
+        return false;
+    }
+    metrics_request(metrics, transform_opcode(batch->transform));
+
+    iov->iov_base = dst;
+    iov->iov_len  = n;
+    memset(out, 0, sizeof(*out));
+    out->msg_hdr.msg_name    = &slot->peer;
+    out->msg_hdr.msg_namelen = batch->in[i].msg_hdr.msg_namelen;
+    out->msg_hdr.msg_iov     = iov;
+    out->msg_hdr.msg_iovlen  = 1;
+
+    return true;
+}
+
+static void send_replies(int fd, struct mmsghdr *out, unsigned int count, struct worker_metrics *metrics)
+{
+    unsigned int sent;
+
+    sent = 0;
+    while(sent < count)
+    {
+        int result;
+
+        result = sendmmsg(fd, out + sent, count - sent, 0);
+
+        if(result == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+
+            // sendmmsg() stops at the first reply that fails; count it and go on with the rest
+            metrics_error(metrics, -4);
+            sent++;
+            continue;
+        }
+
+        for(int i = 0; i < result; i++)
+        {
+            metrics_bytes(metrics, 0, out[sent + (unsigned int)i].msg_len);
+        }
+        sent += (unsigned int)result;
+    }
+}
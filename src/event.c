@@ -0,0 +1,422 @@
+#include "../include/event.h"
+#include "../include/copy.h"
+#include "../include/open.h"
+#include "../include/timer.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define NSEC_PER_MSEC 1000000ULL
+
+// Per-client state kept between readiness events
+struct connection
+{
+    struct copy_state  copy;
+    struct timer       timer;    // Deadline of whatever the connection is waiting for
+    struct connection *prev;
+    struct connection *next;
+    uint32_t           events;
+    bool               requesting;    // Holds one of the admission's request slots
+};
+
+// What one event loop shares with every connection it serves
+struct event_loop
+{
+    int                         epoll_fd;
+    int                        *server_fds;    // Every listener, each registered with a pointer to its own slot
+    unsigned int                nservers;
+    size_t                      bufsize;
+    struct buffer_pool         *pool;
+    struct admission           *admission;
+    const struct copy_timeouts *timeouts;
+    struct worker_metrics      *metrics;
+    struct connection          *connections;    // Every open connection, walked only when the server drains
+    bool                        draining;
+    struct timer_wheel          wheel;
+};
+
+static bool is_listener(const struct event_loop *loop, const void *ptr);
+static void accept_clients(struct event_loop *loop, int server_fd, uint64_t now);
+static void handle_client(struct event_loop *loop, struct connection *conn, uint64_t now);
+static void expire_clients(struct event_loop *loop, uint64_t now);
+static void start_drain(struct event_loop *loop);
+static int  wait_timeout(const struct event_loop *loop, uint64_t now);
+static void close_connection(struct event_loop *loop, struct connection *conn);
+
+int run_event_loop(int *server_fds, unsigned int nservers, size_t bufsize, struct buffer_pool *pool, struct admission *admission, const struct copy_timeouts *timeouts, struct worker_metrics *metrics, int *err)
+{
+    struct epoll_event ev;
+    struct epoll_event events[MAX_EVENTS];
+    struct event_loop  loop;
+    uint64_t           now;
+
+    for(unsigned int i = 0; i < nservers; i++)
+    {
+        if(set_nonblocking(server_fds[i], err) == -1)
+        {
+            return -1;
+        }
+    }
+
+    loop.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if(loop.epoll_fd == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    loop.server_fds  = server_fds;
+    loop.nservers    = nservers;
+    loop.bufsize     = bufsize;
+    loop.pool        = pool;
+    loop.admission   = admission;
+    loop.timeouts    = timeouts;
+    loop.metrics     = metrics;
+    loop.connections = NULL;
+    loop.draining    = false;
+    now              = metrics_now();
+    timer_wheel_init(&loop.wheel, now);
+
+    // A listener's own slot marks the listener, the loop itself the drain eventfd, every other event carries its connection
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+
+    for(unsigned int i = 0; i < nservers; i++)
+    {
+        ev.data.ptr = &server_fds[i];
+
+        if(epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, server_fds[i], &ev) == -1)
+        {
+            *err = errno;
+            goto cleanup;
+        }
+    }
+
+    ev.data.ptr = &loop;
+
+    if(admission->drain_fd != -1 && epoll_ctl(loop.epoll_fd, EPOLL_CTL_ADD, admission->drain_fd, &ev) == -1)
+    {
+        *err = errno;
+        goto cleanup;
+    }
+
+    // Once draining, the loop ends with its last connection
+    while(!loop.draining || loop.connections != NULL)
+    {
+        bool drain;
+        int  nready;
+
+        nready = epoll_wait(loop.epoll_fd, events, MAX_EVENTS, wait_timeout(&loop, now));
+
+        if(nready == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            *err = errno;
+            goto cleanup;
+        }
+
+        // One clock read per wakeup dates every event in it, connections never ask for the time themselves
+        now   = metrics_now();
+        drain = false;
+
+        for(int i = 0; i < nready; i++)
+        {
+            if(is_listener(&loop, events[i].data.ptr))
+            {
+                accept_clients(&loop, *(int *)events[i].data.ptr, now);
+            }
+            else if(events[i].data.ptr == &loop)
+            {
+                drain = true;
+            }
+            else
+            {
+                handle_client(&loop, (struct connection *)events[i].data.ptr, now);
+            }
+        }
+
+        // After the batch, like the deadlines: the connections it closes may still have events in it
+        if(drain)
+        {
+            start_drain(&loop);
+        }
+        expire_clients(&loop, now);
+        metrics_pool(metrics, pool);
+    }
+
+    close(loop.epoll_fd);
+    return 0;
+
+cleanup:
+    close(loop.epoll_fd);
+    return -1;
+}
+
+// A handful of listeners at most, so comparing against each slot is as quick as anything cleverer
+static bool is_listener(const struct event_loop *loop, const void *ptr)
+{
+    for(unsigned int i = 0; i < loop->nservers; i++)
+    {
+        if(ptr == &loop->server_fds[i])
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void accept_clients(struct event_loop *loop, int server_fd, uint64_t now)
+{
+    admission_sample_queue(server_fd, loop->metrics);
+
+    // Drain the accept queue until it reports EAGAIN, turning away whoever comes in over the limit
+    while(true)
+    {
+        struct epoll_event ev;
+        struct connection *conn;
+        int                client_fd;
+        int                err;
+
+        client_fd = accept4(server_fd, NULL, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if(client_fd == -1)
+        {
+            if(errno != EAGAIN && errno != EINTR)
+            {
+                perror("Failed to accept client connection");
+            }
+            return;
+        }
+
+        if(!admission_enter(loop->admission))
+        {
+            admission_shed(client_fd, loop->metrics);
+            continue;
+        }
+
+        // Connections come from the worker's pool as well, so a new client costs no heap allocation either
+        conn = (struct connection *)pool_alloc(loop->pool, sizeof(*conn));
+
+        if(conn == NULL || copy_state_init(&conn->copy, client_fd, loop->bufsize, loop->pool, &err) == -1)
+        {
+            perror("Memory allocation error");
+            pool_free(loop->pool, conn, sizeof(*conn));
+            admission_leave(loop->admission);
+            close(client_fd);
+            continue;
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        conn->copy.metrics = loop->metrics;
+        conn->events       = EPOLLIN;
+        conn->requesting   = false;
+        ev.events          = conn->events;
+        ev.data.ptr        = conn;
+        timer_init(&conn->timer);
+
+        if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1)
+        {
+            perror("Failed to watch client connection");
+            copy_state_destroy(&conn->copy);
+            pool_free(loop->pool, conn, sizeof(*conn));
+            admission_leave(loop->admission);
+            close(client_fd);
+            continue;
+        }
+        metrics_accept(loop->metrics);
+        conn->prev = NULL;
+        conn->next = loop->connections;
+
+        if(loop->connections != NULL)
+        {
+            loop->connections->prev = conn;
+        }
+        loop->connections = conn;
+
+        // A client that connects and never says anything is on the idle clock from the start
+        if(loop->timeouts->idle != 0)
+        {
+            timer_schedule(&loop->wheel, &conn->timer, now + loop->timeouts->idle);
+        }
+    }
+}
+
+static void handle_client(struct event_loop *loop, struct connection *conn, uint64_t now)
+{
+    ssize_t  result;
+    int      err;
+    uint32_t desired;
+    uint64_t deadline;
+
+    // A request holds a slot from its first byte until its reply is out; one that finds none left is answered BUSY
+    // before its bytes are even read
+    if(!conn->requesting && copy_waiting(&conn->copy) == COPY_WAIT_IDLE)
+    {
+        if(!admission_request_enter(loop->admission))
+        {
+            admission_refuse(conn->copy.fd, loop->metrics);
+            close_connection(loop, conn);
+            return;
+        }
+        conn->requesting = true;
+    }
+
+    result = convert_copy_step(&conn->copy, &err);
+
+    if(result < 0)
+    {
+        copy_report_error(conn->copy.metrics, result, err);
+        close_connection(loop, conn);
+        return;
+    }
+
+    // A draining server lets a connection go as soon as it has nothing left in hand
+    if(conn->copy.phase == COPY_PHASE_DONE || (loop->draining && copy_between_requests(&conn->copy)))
+    {
+        close_connection(loop, conn);
+        return;
+    }
+
+    if(conn->requesting && copy_waiting(&conn->copy) == COPY_WAIT_IDLE)
+    {
+        admission_request_leave(loop->admission);
+        conn->requesting = false;
+    }
+
+    // Whatever the connection waits for next is on its own clock from here
+    deadline = copy_deadline(&conn->copy, loop->timeouts, now);
+
+    if(deadline != 0)
+    {
+        timer_schedule(&loop->wheel, &conn->timer, deadline);
+    }
+    else
+    {
+        timer_cancel(&loop->wheel, &conn->timer);
+    }
+
+    // Wait for the socket to drain while a reply is pending, otherwise for the next request
+    desired = conn->copy.phase == COPY_PHASE_WRITE ? EPOLLOUT : EPOLLIN;
+
+    if(conn->events != desired)
+    {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        conn->events = desired;
+        ev.events    = conn->events;
+        ev.data.ptr  = conn;
+
+        if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, conn->copy.fd, &ev) == -1)
+        {
+            perror("Failed to watch client connection");
+            close_connection(loop, conn);
+        }
+    }
+}
+
+// Closes every connection whose deadline passed; a connection closed earlier in this pass took its timer with it
+static void expire_clients(struct event_loop *loop, uint64_t now)
+{
+    struct timer *timer;
+
+    timer = timer_expire(&loop->wheel, now);
+
+    while(timer != NULL)
+    {
+        struct connection *conn;
+
+        conn  = (struct connection *)(void *)((uint8_t *)timer - offsetof(struct connection, timer));
+        timer = timer->next;
+        copy_report_timeout(&conn->copy);
+        close_connection(loop, conn);
+    }
+}
+
+// Stops accepting, leaving the queues to the server that took over the listeners, and closes whoever is between requests
+static void start_drain(struct event_loop *loop)
+{
+    struct connection *conn;
+
+    for(unsigned int i = 0; i < loop->nservers; i++)
+    {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->server_fds[i], NULL);
+    }
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->admission->drain_fd, NULL);
+    loop->draining = true;
+    conn           = loop->connections;
+
+    while(conn != NULL)
+    {
+        struct connection *next;
+
+        next = conn->next;
+
+        if(copy_between_requests(&conn->copy))
+        {
+            close_connection(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+// Milliseconds epoll_wait() may sleep before the wheel is due, -1 while no connection has a deadline
+static int wait_timeout(const struct event_loop *loop, uint64_t now)
+{
+    int64_t  wait_ns;
+    uint64_t wait_ms;
+
+    wait_ns = timer_wait(&loop->wheel, now);
+
+    if(wait_ns < 0)
+    {
+        return -1;
+    }
+
+    // Rounded up, so the loop does not wake just short of the tick and go straight back to sleep
+    wait_ms = ((uint64_t)wait_ns + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC;
+
+    return wait_ms > INT_MAX ? INT_MAX : (int)wait_ms;
+}
+
+static void close_connection(struct event_loop *loop, struct connection *conn)
+{
+    if(conn->prev != NULL)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        loop->connections = conn->next;
+    }
+
+    if(conn->next != NULL)
+    {
+        conn->next->prev = conn->prev;
+    }
+
+    timer_cancel(&loop->wheel, &conn->timer);
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, conn->copy.fd, NULL);
+    close(conn->copy.fd);
+    metrics_close(conn->copy.metrics);
+    admission_leave(loop->admission);
+
+    if(conn->requesting)
+    {
+        admission_request_leave(loop->admission);
+    }
+    copy_state_destroy(&conn->copy);
+    pool_free(conn->copy.pool, conn, sizeof(*conn));
+}
@@ -0,0 +1,476 @@
+#include "../include/handoff.h"
+#include "../include/open.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Room for the descriptors of one batch, aligned the way the kernel lays out a control message
+union handoff_control
+{
+    struct cmsghdr align;
+    char           buf[CMSG_SPACE(HANDOFF_BATCH * sizeof(int))];
+};
+
+static bool  peer_trusted(int fd);
+static int   set_timeout(int fd, int *err);
+static int   receive_batch(struct handoff *handoff, int peer_fd, bool *done, int *err);
+static int   send_sockets(const struct handoff *handoff, int peer_fd, int *err);
+static int   send_message(int peer_fd, const struct msghdr *msg, int *err);
+static void *handoff_main(void *arg);
+
+void handoff_init(struct handoff *handoff, const char *path)
+{
+    handoff->path      = path;
+    handoff->peer_fd   = -1;
+    handoff->listen_fd = -1;
+    handoff->admission = NULL;
+    handoff->count     = 0;
+}
+
+// Number of sockets inherited, 0 for a cold start: nothing at the path, or a socket file no server listens on any more
+int handoff_receive(struct handoff *handoff, int *err)
+{
+    bool done;
+    int  peer_fd;
+
+    if(handoff->path == NULL)
+    {
+        return 0;
+    }
+
+    *err    = 0;
+    peer_fd = open_unix_seqpacket_client(handoff->path, err);
+
+    if(peer_fd == -1)
+    {
+        if(*err == ENOENT || *err == ECONNREFUSED)
+        {
+            *err = 0;
+            return 0;
+        }
+        return -1;
+    }
+
+    // Whoever listens at the path hands over what this server will serve, so it has to be this same user
+    if(!peer_trusted(peer_fd))
+    {
+        *err = EPERM;
+        goto fail;
+    }
+
+    if(set_timeout(peer_fd, err) == -1)
+    {
+        goto fail;
+    }
+
+    done = false;
+
+    while(!done)
+    {
+        if(receive_batch(handoff, peer_fd, &done, err) == -1)
+        {
+            goto fail;
+        }
+    }
+
+    // Kept open to tell the old server when to drain
+    handoff->peer_fd = peer_fd;
+
+    return (int)handoff->count;
+
+fail:
+    for(unsigned int i = 0; i < handoff->count; i++)
+    {
+        close(handoff->sockets[i].fd);
+    }
+    handoff->count = 0;
+    close(peer_fd);
+
+    return -1;
+}
+
+// An inherited socket of this kind nobody has taken yet, -1 when the server has to open its own
+int handoff_take(struct handoff *handoff, enum handoff_kind kind)
+{
+    for(unsigned int i = 0; i < handoff->count; i++)
+    {
+        if(handoff->sockets[i].kind == kind && !handoff->sockets[i].serving)
+        {
+            handoff->sockets[i].serving = true;
+            return handoff->sockets[i].fd;
+        }
+    }
+
+    return -1;
+}
+
+// An inherited socket of this kind bound to the address, so every endpoint gets back the listeners its clients know
+int handoff_take_bound(struct handoff *handoff, enum handoff_kind kind, const char *address, in_port_t port)
+{
+    for(unsigned int i = 0; i < handoff->count; i++)
+    {
+        if(handoff->sockets[i].kind == kind && !handoff->sockets[i].serving && bound_to(handoff->sockets[i].fd, address, port))
+        {
+            handoff->sockets[i].serving = true;
+            return handoff->sockets[i].fd;
+        }
+    }
+
+    return -1;
+}
+
+// A socket the server opened itself, passed on along with the inherited ones
+void handoff_keep(struct handoff *handoff, int fd, enum handoff_kind kind)
+{
+    if(handoff->path == NULL || handoff->count == HANDOFF_MAX_SOCKETS)
+    {
+        return;
+    }
+
+    handoff->sockets[handoff->count].fd      = fd;
+    handoff->sockets[handoff->count].kind    = kind;
+    handoff->sockets[handoff->count].serving = true;
+    handoff->count++;
+}
+
+// Called once every socket is open: the old server is told to drain, and this one starts listening for its own successor
+int handoff_ready(struct handoff *handoff, struct admission *admission, int *err)
+{
+    pthread_t    thread;
+    unsigned int kept;
+    int          result;
+
+    if(handoff->path == NULL)
+    {
+        return 0;
+    }
+
+    // A socket this server did not take over it does not serve either, so the next server does not get it. Whoever
+    // waits in the queue of a listener closed here is reset, which a server with fewer workers or endpoints than the
+    // last causes
+    kept = 0;
+
+    for(unsigned int i = 0; i < handoff->count; i++)
+    {
+        if(!handoff->sockets[i].serving)
+        {
+            if(handoff->sockets[i].kind == HANDOFF_LISTENER)
+            {
+                fprintf(stderr, "Closing an inherited listener this server does not serve, its queued clients are reset\n");
+            }
+            close(handoff->sockets[i].fd);
+            continue;
+        }
+        handoff->sockets[kept++] = handoff->sockets[i];
+    }
+    handoff->count     = kept;
+    handoff->admission = admission;
+
+    // Replaces the old server's socket file, which it no longer needs once it has handed over; its listener still
+    // answers, so the file is removed here rather than probed as stale
+    if(handoff->peer_fd != -1 && handoff->path[0] != '@')
+    {
+        unlink(handoff->path);
+    }
+
+    *err               = 0;
+    handoff->listen_fd = listen_unix_seqpacket(handoff->path, 1, err);
+
+    if(handoff->listen_fd == -1)
+    {
+        return -1;
+    }
+
+    if(handoff->path[0] != '@' && chmod(handoff->path, S_IRUSR | S_IWUSR) == -1)
+    {
+        *err = errno;
+        goto fail;
+    }
+
+    // The new server's sockets are ready, whatever arrives from here on it can take; a lost answer leaves both serving
+    if(handoff->peer_fd != -1)
+    {
+        char ready;
+
+        ready = HANDOFF_READY;
+
+        if(send(handoff->peer_fd, &ready, sizeof(ready), MSG_NOSIGNAL) == -1)
+        {
+            perror("Failed to tell the old server to drain");
+        }
+        close(handoff->peer_fd);
+        handoff->peer_fd = -1;
+    }
+
+    result = start_background_thread(&thread, handoff_main, handoff);
+
+    if(result != 0)
+    {
+        *err = result;
+        goto fail;
+    }
+    pthread_detach(thread);
+
+    return 0;
+
+fail:
+    close(handoff->listen_fd);
+    handoff->listen_fd = -1;
+
+    return -1;
+}
+
+static bool peer_trusted(int fd)
+{
+    struct ucred cred;
+    socklen_t    len;
+
+    len = sizeof(cred);
+
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0 && cred.uid == geteuid();
+}
+
+// Neither side waits forever on a peer that stopped halfway
+static int set_timeout(int fd, int *err)
+{
+    struct timeval tv;
+
+    tv.tv_sec  = HANDOFF_TIMEOUT;
+    tv.tv_usec = 0;
+
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 || setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Every descriptor is recorded before the message is checked, so one that turns out malformed still has them all closed
+static int receive_batch(struct handoff *handoff, int peer_fd, bool *done, int *err)
+{
+    union handoff_control control;
+    uint8_t               kinds[HANDOFF_BATCH];
+    struct iovec          iov;
+    struct msghdr         msg;
+    struct cmsghdr       *cmsg;
+    ssize_t               nread;
+    size_t                nfds;
+    unsigned int          first;
+    bool                  overflow;
+
+    iov.iov_base = kinds;
+    iov.iov_len  = sizeof(kinds);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    do
+    {
+        nread = recvmsg(peer_fd, &msg, MSG_CMSG_CLOEXEC);
+    } while(nread == -1 && errno == EINTR);
+
+    if(nread == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    nfds     = 0;
+    first    = handoff->count;
+    overflow = false;
+    cmsg     = CMSG_FIRSTHDR(&msg);
+
+    if(cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    }
+
+    for(size_t i = 0; i < nfds; i++)
+    {
+        int fd;
+
+        memcpy(&fd, CMSG_DATA(cmsg) + (i * sizeof(int)), sizeof(fd));
+
+        if(handoff->count == HANDOFF_MAX_SOCKETS)
+        {
+            close(fd);
+            overflow = true;
+            continue;
+        }
+
+        handoff->sockets[handoff->count].fd      = fd;
+        handoff->sockets[handoff->count].kind    = i < (size_t)nread ? (enum handoff_kind)kinds[i] : HANDOFF_KINDS;
+        handoff->sockets[handoff->count].serving = false;
+        handoff->count++;
+    }
+
+    if(nread == 0)
+    {
+        *err = ECONNRESET;
+        return -1;
+    }
+
+    if(nfds == 0 && nread == 1 && kinds[0] == HANDOFF_END)
+    {
+        *done = true;
+        return 0;
+    }
+
+    // One kind byte per descriptor, every one of them known, and nothing cut off
+    if(overflow || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) != 0 || nfds == 0 || (size_t)nread != nfds)
+    {
+        *err = EPROTO;
+        return -1;
+    }
+
+    for(unsigned int i = first; i < handoff->count; i++)
+    {
+        if(handoff->sockets[i].kind >= HANDOFF_KINDS)
+        {
+            *err = EPROTO;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int send_sockets(const struct handoff *handoff, int peer_fd, int *err)
+{
+    struct iovec  iov;
+    struct msghdr msg;
+    uint8_t       kinds[HANDOFF_BATCH];
+
+    for(unsigned int first = 0; first < handoff->count; first += HANDOFF_BATCH)
+    {
+        union handoff_control control;
+        struct cmsghdr       *cmsg;
+        unsigned int          n;
+
+        n = handoff->count - first < HANDOFF_BATCH ? handoff->count - first : HANDOFF_BATCH;
+        memset(&control, 0, sizeof(control));
+        memset(&msg, 0, sizeof(msg));
+        iov.iov_base       = kinds;
+        iov.iov_len        = n;
+        msg.msg_iov        = &iov;
+        msg.msg_iovlen     = 1;
+        msg.msg_control    = control.buf;
+        msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+        cmsg               = CMSG_FIRSTHDR(&msg);
+
+        if(cmsg == NULL)
+        {
+            *err = EINVAL;
+            return -1;
+        }
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type  = SCM_RIGHTS;
+        cmsg->cmsg_len   = CMSG_LEN(n * sizeof(int));
+
+        for(unsigned int i = 0; i < n; i++)
+        {
+            kinds[i] = (uint8_t)handoff->sockets[first + i].kind;
+            memcpy(CMSG_DATA(cmsg) + (i * sizeof(int)), &handoff->sockets[first + i].fd, sizeof(int));
+        }
+
+        if(send_message(peer_fd, &msg, err) == -1)
+        {
+            return -1;
+        }
+    }
+
+    kinds[0]     = HANDOFF_END;
+    iov.iov_base = kinds;
+    iov.iov_len  = 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = &iov;
+    msg.msg_iovlen = 1;
+
+    return send_message(peer_fd, &msg, err);
+}
+
+static int send_message(int peer_fd, const struct msghdr *msg, int *err)
+{
+    while(sendmsg(peer_fd, msg, MSG_NOSIGNAL) == -1)
+    {
+        if(errno != EINTR)
+        {
+            *err = errno;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Hands the sockets to whichever server connects, until one of them answers ready; then this server drains
+static void *handoff_main(void *arg)
+{
+    struct handoff *handoff;
+
+    handoff = (struct handoff *)arg;
+
+    while(true)
+    {
+        ssize_t nread;
+        char    ready;
+        int     peer_fd;
+        int     err;
+
+        peer_fd = accept4(handoff->listen_fd, NULL, 0, SOCK_CLOEXEC);
+
+        if(peer_fd == -1)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            perror("Failed to accept handoff");
+            break;
+        }
+
+        if(!peer_trusted(peer_fd))
+        {
+            fprintf(stderr, "Refused to hand sockets over to another user\n");
+            close(peer_fd);
+            continue;
+        }
+
+        if(set_timeout(peer_fd, &err) == -1 || send_sockets(handoff, peer_fd, &err) == -1)
+        {
+            fprintf(stderr, "Failed to hand sockets over: %s\n", strerror(err));
+            close(peer_fd);
+            continue;
+        }
+
+        // Both servers accept until the new one answers; one that died on the way leaves this one serving alone
+        do
+        {
+            nread = recv(peer_fd, &ready, sizeof(ready), 0);
+        } while(nread == -1 && errno == EINTR);
+
+        close(peer_fd);
+
+        if(nread == 1 && ready == HANDOFF_READY)
+        {
+            printf("Sockets handed over, draining\n");
+            fflush(stdout);
+            close(handoff->listen_fd);
+            admission_drain(handoff->admission);
+            break;
+        }
+
+        fprintf(stderr, "New server did not get ready, still serving\n");
+    }
+
+    return NULL;
+}
@@ -0,0 +1,124 @@
+#include "../include/histogram.h"
+#include <string.h>
+
+static unsigned int bucket_shift(uint64_t value);
+static size_t       bucket_index(uint64_t value);
+static uint64_t     bucket_highest(size_t index);
+
+void histogram_init(struct histogram *histogram)
+{
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->min = UINT64_MAX;
+}
+
+void histogram_record(struct histogram *histogram, uint64_t value)
+{
+    histogram->counts[bucket_index(value)]++;
+    histogram->total++;
+    histogram->sum += (double)value;
+
+    if(value < histogram->min)
+    {
+        histogram->min = value;
+    }
+
+    if(value > histogram->max)
+    {
+        histogram->max = value;
+    }
+}
+
+void histogram_merge(struct histogram *into, const struct histogram *from)
+{
+    for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+
+    if(from->min < into->min)
+    {
+        into->min = from->min;
+    }
+
+    if(from->max > into->max)
+    {
+        into->max = from->max;
+    }
+}
+
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile)
+{
+    uint64_t target;
+    uint64_t seen;
+
+    if(histogram->total == 0)
+    {
+        return 0;
+    }
+
+    // The smallest recorded value at or above the requested share of all samples
+    target = (uint64_t)((percentile / 100.0) * (double)histogram->total + 0.5);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+    if(target == 0)
+    {
+        target = 1;
+    }
+
+    seen = 0;
+    for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+
+        if(seen >= target)
+        {
+            uint64_t highest;
+
+            // Report the top of the bucket, never beyond what was actually recorded
+            highest = bucket_highest(i);
+            return highest < histogram->max ? highest : histogram->max;
+        }
+    }
+
+    return histogram->max;
+}
+
+double histogram_mean(const struct histogram *histogram)
+{
+    return histogram->total == 0 ? 0.0 : histogram->sum / (double)histogram->total;
+}
+
+// Values below 2 * HISTOGRAM_SUB are exact, every doubling above that halves the resolution
+static unsigned int bucket_shift(uint64_t value)
+{
+    unsigned int magnitude;
+
+    if(value < 2 * HISTOGRAM_SUB)
+    {
+        return 0;
+    }
+    magnitude = 63 - (unsigned int)__builtin_clzll(value);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+    return magnitude - HISTOGRAM_SUB_BITS;
+}
+
+static size_t bucket_index(uint64_t value)
+{
+    unsigned int shift;
+
+    shift = bucket_shift(value);
+
+    return (size_t)shift * HISTOGRAM_SUB + (size_t)(value >> shift);
+}
+
+static uint64_t bucket_highest(size_t index)
+{
+    unsigned int shift;
+    uint64_t     sub;
+
+    shift = index < 2 * HISTOGRAM_SUB ? 0 : (unsigned int)(index / HISTOGRAM_SUB) - 1;
+    sub   = index - (size_t)shift * HISTOGRAM_SUB;
+
+    return ((sub + 1) << shift) - 1;
+}
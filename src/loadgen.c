@@ -0,0 +1,1056 @@
+#include "../include/histogram.h"
+#include "../include/open.h"
+#include "../include/pool.h"
+#include "../include/server.h"
+#include "../include/transform.h"
+#include "../include/wire.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_USEC 1000.0
+#define DEFAULT_CONNECTIONS 16
+#define DEFAULT_DEPTH 1
+#define DEFAULT_DURATION 10.0
+#define DEFAULT_SIZE 64
+#define MAX_CONNECTIONS 65536
+#define MAX_DEPTH 65536
+#define MAX_SIZE (16 * 1024 * 1024)
+#define MAX_MIX 16
+#define MAX_WEIGHT 1000000
+#define LOADGEN_EVENTS 256
+#define LOADGEN_CHUNK 65536
+#define DRAIN_GRACE (2 * NSEC_PER_SEC)
+
+// What to send, how fast and for how long
+struct loadgen_options
+{
+    char        *address;
+    in_port_t    port;
+    unsigned int connections;
+    unsigned int depth;
+    double       rate;
+    double       duration;
+    double       warmup;
+    size_t       size_min;
+    size_t       size_max;
+    uint8_t      mix_opcodes[MAX_MIX];
+    unsigned int mix_weights[MAX_MIX];
+    unsigned int mix_count;
+    unsigned int mix_total;
+};
+
+// One connection with its pipelined requests; replies come back in order, so start times queue up in a ring
+struct load_conn
+{
+    int       fd;
+    uint32_t  events;
+    uint8_t  *out;
+    size_t    out_cap;
+    size_t    out_len;
+    size_t    out_off;
+    uint8_t  *in;
+    size_t    in_cap;
+    size_t    in_len;
+    uint64_t *started;
+    size_t    started_cap;
+    size_t    started_head;
+    size_t    in_flight;
+    uint32_t  next_id;
+    uint32_t  expect_id;
+};
+
+struct load_run
+{
+    const struct loadgen_options *opts;
+    struct load_conn             *conns;
+    unsigned int                  alive;
+    unsigned int                  next_conn;
+    int                           epoll_fd;
+    uint8_t                      *payload;
+    uint64_t                      rng;
+    uint64_t                      measure_start;
+    uint64_t                      measure_end;
+    uint64_t                      in_flight;
+    uint64_t                      completed;
+    uint64_t                      bytes;
+    uint64_t                      errors;
+    struct histogram              latency;
+    struct buffer_pool            pool;
+};
+
+// Functions dealing with arguments
+static void           parse_arguments(int argc, char *argv[], struct loadgen_options *opts);
+static void           check_arguments(const char *binary_name, const struct loadgen_options *opts);
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message);
+static in_port_t      convert_port(const char *str, int *err);
+static unsigned long  convert_count(const char *str, unsigned long min, unsigned long max, char **end, int *err);
+static double         convert_seconds(const char *str, int *err);
+static void           convert_size(const char *str, struct loadgen_options *opts, int *err);
+static void           convert_mix(const char *str, struct loadgen_options *opts, int *err);
+
+// Driving the load
+static uint64_t now_ns(void);
+static uint64_t next_random(struct load_run *run);
+static int      open_connections(struct load_run *run, int *err);
+static void     close_connections(struct load_run *run);
+static int      run_load(struct load_run *run, int *err);
+static int      queue_request(struct load_run *run, struct load_conn *conn, uint64_t started, int *err);
+static int      flush_conn(struct load_run *run, struct load_conn *conn, int *err);
+static int      read_conn(struct load_run *run, struct load_conn *conn, int *err);
+static void     drop_conn(struct load_run *run, struct load_conn *conn);
+static void     report(const struct load_run *run);
+static int      reserve(struct buffer_pool *pool, void **buf, size_t *cap, size_t len, size_t elem, int *err);
+
+int main(int argc, char *argv[])
+{
+    struct loadgen_options opts;
+    struct load_run        run;
+    int                    err;
+    int                    retval;
+
+    memset(&opts, 0, sizeof(opts));
+    opts.port           = PORT;
+    opts.connections    = DEFAULT_CONNECTIONS;
+    opts.depth          = DEFAULT_DEPTH;
+    opts.duration       = DEFAULT_DURATION;
+    opts.size_min       = DEFAULT_SIZE;
+    opts.size_max       = DEFAULT_SIZE;
+    opts.mix_opcodes[0] = (uint8_t)transform_opcode(transform_find("upper", strlen("upper")));
+    opts.mix_weights[0] = 1;
+    opts.mix_count      = 1;
+    opts.mix_total      = 1;
+
+    parse_arguments(argc, argv, &opts);
+    check_arguments(argv[0], &opts);
+
+    memset(&run, 0, sizeof(run));
+    run.opts     = &opts;
+    run.epoll_fd = -1;
+    run.rng      = (uint64_t)now_ns() | 1;
+    histogram_init(&run.latency);
+    retval = EXIT_FAILURE;
+    err    = 0;
+
+    // Payloads are slices of one block of random letters so the conversions have work to do
+    run.payload = (uint8_t *)malloc(opts.size_max + 1);
+
+    if(run.payload == NULL)
+    {
+        perror("Memory allocation error");
+        goto cleanup;
+    }
+
+    for(size_t i = 0; i < opts.size_max; i++)
+    {
+        run.payload[i] = (uint8_t)('a' + next_random(&run) % 26);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    }
+
+    if(open_connections(&run, &err) == -1)
+    {
+        fprintf(stderr, "Error opening connections: %s\n", strerror(err));
+        goto cleanup;
+    }
+
+    if(run_load(&run, &err) == -1)
+    {
+        fprintf(stderr, "Error driving load: %s\n", strerror(err));
+        goto cleanup;
+    }
+
+    report(&run);
+    retval = EXIT_SUCCESS;
+
+cleanup:
+    close_connections(&run);
+    free(run.payload);
+
+    return retval;
+}
+
+static void parse_arguments(int argc, char *argv[], struct loadgen_options *opts)
+{
+    /*
+    struct option saved all possible options of the load generator
+     */
+    static struct option long_options[] = {
+        {"address",     required_argument, NULL, 'a'},
+        {"port",        required_argument, NULL, 'p'},
+        {"connections", required_argument, NULL, 'c'},
+        {"depth",       required_argument, NULL, 'q'},
+        {"rate",        required_argument, NULL, 'r'},
+        {"duration",    required_argument, NULL, 'd'},
+        {"warmup",      required_argument, NULL, 'W'},
+        {"size",        required_argument, NULL, 's'},
+        {"mix",         required_argument, NULL, 'x'},
+        {"help",        no_argument,       NULL, 'h'},
+        {NULL,          0,                 NULL, 0  }
+    };
+    int   opt;
+    int   err;
+    char *end;
+
+    opterr = 0;
+
+    while((opt = getopt_long(argc, argv, "ha:p:c:q:r:d:W:s:x:", long_options, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'a':
+            {
+                opts->address = optarg;
+                break;
+            }
+            case 'p':
+            {
+                opts->port = convert_port(optarg, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "port must be between 0 and 65535");
+                }
+                break;
+            }
+            case 'c':
+            {
+                opts->connections = (unsigned int)convert_count(optarg, 1, MAX_CONNECTIONS, &end, &err);
+                if(err != ERR_NONE || *end != '\0')
+                {
+                    usage(argv[0], EXIT_FAILURE, "connections must be between 1 and 65536");
+                }
+                break;
+            }
+            case 'q':
+            {
+                opts->depth = (unsigned int)convert_count(optarg, 1, MAX_DEPTH, &end, &err);
+                if(err != ERR_NONE || *end != '\0')
+                {
+                    usage(argv[0], EXIT_FAILURE, "depth must be between 1 and 65536");
+                }
+                break;
+            }
+            case 'r':
+            {
+                opts->rate = convert_seconds(optarg, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "rate must be a positive number of requests per second");
+                }
+                break;
+            }
+            case 'd':
+            {
+                opts->duration = convert_seconds(optarg, &err);
+                if(err != ERR_NONE || opts->duration <= 0)
+                {
+                    usage(argv[0], EXIT_FAILURE, "duration must be a positive number of seconds");
+                }
+                break;
+            }
+            case 'W':
+            {
+                opts->warmup = convert_seconds(optarg, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "warmup must be a number of seconds");
+                }
+                break;
+            }
+            case 's':
+            {
+                convert_size(optarg, opts, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "size must be <bytes> or <min>-<max>, at most 16777216");
+                }
+                break;
+            }
+            case 'x':
+            {
+                convert_mix(optarg, opts, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "mix must be <conversion>[:<weight>][,...] with known conversions");
+                }
+                break;
+            }
+            case 'h':
+            {
+                usage(argv[0], EXIT_SUCCESS, NULL);
+            }
+            // If option is unknown
+            case '?':
+            {
+                if(strchr("apcqrdWsx", optopt) != NULL && optopt != '\0')
+                {
+                    char message[MISSING_OPTION_MESSAGE_LEN];
+
+                    snprintf(message, sizeof(message), "Option '-%c' requires a value.", optopt);
+                    usage(argv[0], EXIT_FAILURE, message);
+                }
+                else
+                {
+                    char message[UNKNOWN_OPTION_MESSAGE_LEN];
+
+                    snprintf(message, sizeof(message), "Unknown option '-%c'.", optopt);
+                    usage(argv[0], EXIT_FAILURE, message);
+                }
+            }
+            default:
+            {
+                usage(argv[0], EXIT_FAILURE, NULL);
+            }
+        }
+    }
+}
+
+static void check_arguments(const char *binary_name, const struct loadgen_options *opts)
+{
+    if(opts->address == NULL)
+    {
+        usage(binary_name, EXIT_FAILURE, "an network address is required");
+    }
+
+    // Requests must fit a frame the server can take whole
+    if(opts->size_max > UINT32_MAX - WIRE_HEADER_LEN)
+    {
+        usage(binary_name, EXIT_FAILURE, "size is too large for a frame");
+    }
+}
+
+_Noreturn static void usage(const char *program_name, int exit_code, const char *message)
+{
+    // Print Error message
+    if(message)
+    {
+        fprintf(stderr, "%s\n", message);
+    }
+
+    // Print the Usage message
+    fprintf(stderr, "Usage: %s -a <address> [-p <port>] [-c <connections>] [-q <depth> | -r <rate>] [-d <seconds>] [-W <seconds>] [-s <size>] [-x <mix>]\n", program_name);
+    fputs("Options:\n", stderr);
+    fputs("  -h, --help                           Display this help message\n", stderr);
+    fputs("  -a <address>, --address <address>   Server <address>, or unix:/path or unix:@name\n", stderr);
+    fputs("  -p <port>, --port <port>             Server <port>\n", stderr);
+    fputs("  -c, --connections <n>                Connections to open (default 16)\n", stderr);
+    fputs("  -q, --depth <n>                      Closed loop: requests each connection keeps in flight (default 1)\n", stderr);
+    fputs("  -r, --rate <n>                       Open loop: requests per second over all connections\n", stderr);
+    fputs("  -d, --duration <seconds>             How long to measure (default 10)\n", stderr);
+    fputs("  -W, --warmup <seconds>               Load to apply before measuring (default 0)\n", stderr);
+    fputs("  -s, --size <bytes>|<min>-<max>       Payload size, fixed or uniformly distributed (default 64)\n", stderr);
+    fputs("  -x, --mix <conv>[:<weight>][,...]    Weighted conversion mix (default upper)\n", stderr);
+    exit(exit_code);
+}
+
+static in_port_t convert_port(const char *str, int *err)
+{
+    char         *end;
+    unsigned long val;
+
+    val = convert_count(str, 0, UINT16_MAX, &end, err);
+
+    if(*err == ERR_NONE && *end != '\0')
+    {
+        *err = ERR_INVALID_CHARS;
+    }
+
+    return (in_port_t)val;
+}
+
+static unsigned long convert_count(const char *str, unsigned long min, unsigned long max, char **end, int *err)
+{
+    long val;
+
+    *err  = ERR_NONE;
+    errno = 0;
+    val   = strtol(str, end, 10);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+    if(*end == str)
+    {
+        *err = ERR_NO_DIGITS;
+        return 0;
+    }
+
+    if(errno == ERANGE || val < 0 || (unsigned long)val < min || (unsigned long)val > max)
+    {
+        *err = ERR_OUT_OF_RANGE;
+        return 0;
+    }
+
+    return (unsigned long)val;
+}
+
+static double convert_seconds(const char *str, int *err)
+{
+    char  *end;
+    double val;
+
+    *err  = ERR_NONE;
+    errno = 0;
+    val   = strtod(str, &end);
+
+    if(end == str)
+    {
+        *err = ERR_NO_DIGITS;
+        return 0;
+    }
+
+    if(errno == ERANGE || val < 0)
+    {
+        *err = ERR_OUT_OF_RANGE;
+        return 0;
+    }
+
+    if(*end != '\0')
+    {
+        *err = ERR_INVALID_CHARS;
+        return 0;
+    }
+
+    return val;
+}
+
+static void convert_size(const char *str, struct loadgen_options *opts, int *err)
+{
+    char *end;
+
+    opts->size_min = convert_count(str, 0, MAX_SIZE, &end, err);
+    opts->size_max = opts->size_min;
+
+    if(*err != ERR_NONE)
+    {
+        return;
+    }
+
+    if(*end == '-')
+    {
+        const char *max;
+
+        max            = end + 1;
+        opts->size_max = convert_count(max, opts->size_min, MAX_SIZE, &end, err);
+    }
+
+    if(*err == ERR_NONE && *end != '\0')
+    {
+        *err = ERR_INVALID_CHARS;
+    }
+}
+
+static void convert_mix(const char *str, struct loadgen_options *opts, int *err)
+{
+    const char *entry;
+
+    *err            = ERR_NONE;
+    opts->mix_count = 0;
+    opts->mix_total = 0;
+    entry           = str;
+
+    // Comma separated conversions, each optionally weighted: upper:3,hex:1
+    while(*entry != '\0')
+    {
+        const struct transform *transform;
+        const char             *colon;
+        const char             *next;
+        char                   *end;
+        size_t                  name_len;
+        unsigned long           weight;
+
+        if(opts->mix_count == MAX_MIX)
+        {
+            *err = ERR_OUT_OF_RANGE;
+            return;
+        }
+
+        name_len  = strcspn(entry, ":,");
+        colon     = entry + name_len;
+        transform = transform_find(entry, name_len);
+
+        if(transform == NULL)
+        {
+            *err = ERR_INVALID_CHARS;
+            return;
+        }
+
+        weight = 1;
+        next   = colon;
+
+        if(*colon == ':')
+        {
+            weight = convert_count(colon + 1, 1, MAX_WEIGHT, &end, err);
+
+            if(*err != ERR_NONE)
+            {
+                return;
+            }
+            next = end;
+        }
+
+        if(*next != ',' && *next != '\0')
+        {
+            *err = ERR_INVALID_CHARS;
+            return;
+        }
+
+        opts->mix_opcodes[opts->mix_count] = transform_opcode(transform);
+        opts->mix_weights[opts->mix_count] = (unsigned int)weight;
+        opts->mix_total += (unsigned int)weight;
+        opts->mix_count++;
+        entry = *next == ',' ? next + 1 : next;
+    }
+
+    if(opts->mix_count == 0)
+    {
+        *err = ERR_NO_DIGITS;
+    }
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+// xorshift64*: fast, and plenty for picking sizes and conversions
+static uint64_t next_random(struct load_run *run)
+{
+    run->rng ^= run->rng >> 12;    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    run->rng ^= run->rng << 25;    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    run->rng ^= run->rng >> 27;    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+    return run->rng * 0x2545F4914F6CDD1DULL;    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+}
+
+static int open_connections(struct load_run *run, int *err)
+{
+    struct epoll_event ev;
+
+    // Request and reply buffers come from a slab pool like the server's, so growing one pops a free list
+    if(pool_init(&run->pool, false, err) == -1)
+    {
+        return -1;
+    }
+
+    run->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if(run->epoll_fd == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    run->conns = (struct load_conn *)calloc(run->opts->connections, sizeof(*run->conns));
+
+    if(run->conns == NULL)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    for(unsigned int i = 0; i < run->opts->connections; i++)
+    {
+        run->conns[i].fd = -1;
+    }
+
+    for(unsigned int i = 0; i < run->opts->connections; i++)
+    {
+        struct load_conn *conn;
+        int               one;
+
+        conn     = &run->conns[i];
+        conn->fd = open_network_socket_client(run->opts->address, run->opts->port, err);
+
+        if(conn->fd == -1)
+        {
+            return -1;
+        }
+        run->alive++;
+
+        // Pipelined requests must not wait for the previous ones to be acknowledged
+        one = 1;
+        setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if(set_nonblocking(conn->fd, err) == -1)
+        {
+            return -1;
+        }
+
+        memset(&ev, 0, sizeof(ev));
+        conn->events = EPOLLIN;
+        ev.events    = conn->events;
+        ev.data.ptr  = conn;
+
+        if(epoll_ctl(run->epoll_fd, EPOLL_CTL_ADD, conn->fd, &ev) == -1)
+        {
+            *err = errno;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void close_connections(struct load_run *run)
+{
+    if(run->conns != NULL)
+    {
+        for(unsigned int i = 0; i < run->opts->connections; i++)
+        {
+            if(run->conns[i].fd != -1)
+            {
+                close(run->conns[i].fd);
+            }
+            pool_free(&run->pool, run->conns[i].out, run->conns[i].out_cap);
+            pool_free(&run->pool, run->conns[i].in, run->conns[i].in_cap);
+            pool_free(&run->pool, run->conns[i].started, run->conns[i].started_cap * sizeof(*run->conns[i].started));
+        }
+        free(run->conns);
+        run->conns = NULL;
+    }
+
+    if(run->epoll_fd != -1)
+    {
+        close(run->epoll_fd);
+        run->epoll_fd = -1;
+    }
+
+    pool_destroy(&run->pool);
+}
+
+static int run_load(struct load_run *run, int *err)
+{
+    const struct loadgen_options *opts;
+    struct epoll_event            events[LOADGEN_EVENTS];
+    uint64_t                      start;
+    uint64_t                      interval;
+    uint64_t                      next_send;
+    uint64_t                      deadline;
+
+    opts               = run->opts;
+    start              = now_ns();
+    run->measure_start = start + (uint64_t)(opts->warmup * (double)NSEC_PER_SEC);
+    run->measure_end   = run->measure_start + (uint64_t)(opts->duration * (double)NSEC_PER_SEC);
+    deadline           = run->measure_end + DRAIN_GRACE;
+    interval           = opts->rate > 0 ? (uint64_t)((double)NSEC_PER_SEC / opts->rate) : 0;
+    next_send          = start;
+
+    // Closed loop: every connection starts with its full depth, each reply then sends the next request
+    if(opts->rate <= 0)
+    {
+        for(unsigned int i = 0; i < opts->connections; i++)
+        {
+            for(unsigned int j = 0; j < opts->depth; j++)
+            {
+                if(queue_request(run, &run->conns[i], start, err) == -1)
+                {
+                    return -1;
+                }
+            }
+
+            if(flush_conn(run, &run->conns[i], err) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+
+    while(run->alive > 0)
+    {
+        uint64_t now;
+        int      timeout;
+        int      nready;
+
+        now = now_ns();
+
+        if(now >= run->measure_end && (run->in_flight == 0 || now >= deadline))
+        {
+            break;
+        }
+
+        // Open loop: requests leave on schedule whether or not earlier ones were answered,
+        // and latency counts from the scheduled time so a stalled server cannot hide its queueing
+        if(interval > 0)
+        {
+            while(next_send <= now && next_send < run->measure_end)
+            {
+                struct load_conn *conn;
+
+                do
+                {
+                    conn            = &run->conns[run->next_conn];
+                    run->next_conn = (run->next_conn + 1) % opts->connections;
+                } while(conn->fd == -1);
+
+                if(queue_request(run, conn, next_send, err) == -1 || flush_conn(run, conn, err) == -1)
+                {
+                    return -1;
+                }
+                next_send += interval;
+            }
+        }
+
+        // Sleep until the next scheduled send or the end of the run, whichever is first
+        if(interval > 0 && next_send < run->measure_end)
+        {
+            timeout = (int)((next_send > now ? next_send - now : 0) / NSEC_PER_MSEC);
+        }
+        else
+        {
+            uint64_t until;
+
+            until   = now < run->measure_end ? run->measure_end : deadline;
+            timeout = (int)((until - now) / NSEC_PER_MSEC) + 1;
+        }
+
+        nready = epoll_wait(run->epoll_fd, events, LOADGEN_EVENTS, timeout);
+
+        if(nready == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            *err = errno;
+            return -1;
+        }
+
+        for(int i = 0; i < nready; i++)
+        {
+            struct load_conn *conn;
+
+            conn = (struct load_conn *)events[i].data.ptr;
+
+            if(conn->fd != -1 && (events[i].events & EPOLLOUT) && flush_conn(run, conn, err) == -1)
+            {
+                return -1;
+            }
+
+            if(conn->fd != -1 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && read_conn(run, conn, err) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+
+    // Whatever is still unanswered after the grace period counts as failed
+    run->errors += run->in_flight;
+
+    return 0;
+}
+
+static int queue_request(struct load_run *run, struct load_conn *conn, uint64_t started, int *err)
+{
+    const struct loadgen_options *opts;
+    struct wire_header            header;
+    size_t                        len;
+    size_t                        offset;
+    unsigned int                  pick;
+    unsigned int                  mix;
+    void                         *buf;
+
+    opts = run->opts;
+
+    // Size and conversion come from the configured distributions
+    len = opts->size_min;
+    if(opts->size_max > opts->size_min)
+    {
+        len += (size_t)(next_random(run) % (opts->size_max - opts->size_min + 1));
+    }
+
+    pick = (unsigned int)(next_random(run) % opts->mix_total);
+    mix  = 0;
+    while(pick >= opts->mix_weights[mix])
+    {
+        pick -= opts->mix_weights[mix];
+        mix++;
+    }
+
+    buf = conn->out;
+    if(reserve(&run->pool, &buf, &conn->out_cap, conn->out_len + WIRE_HEADER_LEN + len, 1, err) == -1)
+    {
+        return -1;
+    }
+    conn->out = (uint8_t *)buf;
+
+    memset(&header, 0, sizeof(header));
+    header.magic      = WIRE_MAGIC;
+    header.version    = WIRE_VERSION;
+    header.opcode     = opts->mix_opcodes[mix];
+    header.length     = (uint32_t)len;
+    header.request_id = conn->next_id++;
+    wire_encode_header(conn->out + conn->out_len, &header);
+    memcpy(conn->out + conn->out_len + WIRE_HEADER_LEN, run->payload, len);
+    conn->out_len += WIRE_HEADER_LEN + len;
+
+    // Start times form a ring, grown (and unwrapped) when the connection has more in flight than it holds
+    if(conn->in_flight == conn->started_cap)
+    {
+        uint64_t *grown;
+        size_t    cap;
+
+        cap   = conn->started_cap > 0 ? conn->started_cap * 2 : opts->depth;
+        grown = (uint64_t *)pool_alloc(&run->pool, cap * sizeof(*grown));
+
+        if(grown == NULL)
+        {
+            *err = errno;
+            return -1;
+        }
+
+        for(size_t i = 0; i < conn->in_flight; i++)
+        {
+            grown[i] = conn->started[(conn->started_head + i) % conn->started_cap];
+        }
+        pool_free(&run->pool, conn->started, conn->started_cap * sizeof(*conn->started));
+        conn->started      = grown;
+        conn->started_cap  = cap;
+        conn->started_head = 0;
+    }
+
+    offset                = (conn->started_head + conn->in_flight) % conn->started_cap;
+    conn->started[offset] = started;
+    conn->in_flight++;
+    run->in_flight++;
+
+    return 0;
+}
+
+static int flush_conn(struct load_run *run, struct load_conn *conn, int *err)
+{
+    uint32_t desired;
+
+    while(conn->out_off < conn->out_len)
+    {
+        ssize_t nwrote;
+
+        nwrote = send(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off, MSG_NOSIGNAL);
+
+        if(nwrote < 0)
+        {
+            if(errno == EAGAIN || errno == EINTR)
+            {
+                break;
+            }
+            drop_conn(run, conn);
+            return 0;
+        }
+        conn->out_off += (size_t)nwrote;
+    }
+
+    if(conn->out_off == conn->out_len)
+    {
+        conn->out_off = 0;
+        conn->out_len = 0;
+    }
+
+    // Only ask to hear about writability while something is waiting to go out
+    desired = conn->out_len > 0 ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+
+    if(conn->events != desired)
+    {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        conn->events = desired;
+        ev.events    = conn->events;
+        ev.data.ptr  = conn;
+
+        if(epoll_ctl(run->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) == -1)
+        {
+            *err = errno;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int read_conn(struct load_run *run, struct load_conn *conn, int *err)
+{
+    ssize_t  nread;
+    size_t   consumed;
+    uint64_t now;
+    bool     more;
+    void    *buf;
+
+    buf = conn->in;
+    if(reserve(&run->pool, &buf, &conn->in_cap, conn->in_len + LOADGEN_CHUNK, 1, err) == -1)
+    {
+        return -1;
+    }
+    conn->in = (uint8_t *)buf;
+
+    nread = read(conn->fd, conn->in + conn->in_len, conn->in_cap - conn->in_len);
+
+    if(nread < 0)
+    {
+        if(errno == EAGAIN || errno == EINTR)
+        {
+            return 0;
+        }
+        drop_conn(run, conn);
+        return 0;
+    }
+
+    // The server only hangs up on a request it could not handle
+    if(nread == 0)
+    {
+        drop_conn(run, conn);
+        return 0;
+    }
+
+    conn->in_len += (size_t)nread;
+    consumed = 0;
+    more     = false;
+    now      = now_ns();
+
+    while(conn->in_len - consumed >= WIRE_HEADER_LEN)
+    {
+        struct wire_header header;
+        uint64_t           started;
+
+        wire_decode_header(conn->in + consumed, &header);
+
+        if(header.magic != WIRE_MAGIC || header.request_id != conn->expect_id || conn->in_flight == 0)
+        {
+            drop_conn(run, conn);
+            return 0;
+        }
+
+        if(conn->in_len - consumed - WIRE_HEADER_LEN < header.length)
+        {
+            break;
+        }
+
+        started            = conn->started[conn->started_head];
+        conn->started_head = (conn->started_head + 1) % conn->started_cap;
+        conn->in_flight--;
+        run->in_flight--;
+        conn->expect_id++;
+        consumed += WIRE_HEADER_LEN + header.length;
+
+        // Only requests issued inside the measurement window count
+        if(started >= run->measure_start && started < run->measure_end)
+        {
+            histogram_record(&run->latency, now - started);
+            run->completed++;
+            run->bytes += header.length;
+        }
+
+        // Closed loop: keep the depth up until the window ends
+        if(run->opts->rate <= 0 && now < run->measure_end)
+        {
+            if(queue_request(run, conn, now, err) == -1)
+            {
+                return -1;
+            }
+            more = true;
+        }
+    }
+
+    conn->in_len -= consumed;
+    memmove(conn->in, conn->in + consumed, conn->in_len);
+
+    return more ? flush_conn(run, conn, err) : 0;
+}
+
+static void drop_conn(struct load_run *run, struct load_conn *conn)
+{
+    epoll_ctl(run->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    conn->fd = -1;
+    run->errors += conn->in_flight;
+    run->in_flight -= conn->in_flight;
+    conn->in_flight = 0;
+    run->alive--;
+}
+
+static void report(const struct load_run *run)
+{
+    const struct loadgen_options *opts;
+    const struct histogram       *latency;
+    uint64_t                      p50;
+    uint64_t                      p90;
+    uint64_t                      p99;
+    uint64_t                      p999;
+
+    opts    = run->opts;
+    latency = &run->latency;
+    p50     = histogram_percentile(latency, 50.0);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    p90     = histogram_percentile(latency, 90.0);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    p99     = histogram_percentile(latency, 99.0);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    p999    = histogram_percentile(latency, 99.9);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+    if(opts->rate > 0)
+    {
+        printf("Open loop:    %u connections, %.0f req/s target\n", opts->connections, opts->rate);
+    }
+    else
+    {
+        printf("Closed loop:  %u connections, depth %u\n", opts->connections, opts->depth);
+    }
+
+    printf("Requests:     %llu in %.2f s, %.1f req/s, %.2f MB/s\n",
+           (unsigned long long)run->completed,
+           opts->duration,
+           (double)run->completed / opts->duration,
+           (double)run->bytes / opts->duration / 1e6);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    printf("Latency (us): min %.1f  mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           latency->total > 0 ? (double)latency->min / NSEC_PER_USEC : 0.0,
+           histogram_mean(latency) / NSEC_PER_USEC,
+           (double)p50 / NSEC_PER_USEC,
+           (double)p90 / NSEC_PER_USEC,
+           (double)p99 / NSEC_PER_USEC,
+           (double)p999 / NSEC_PER_USEC,
+           (double)latency->max / NSEC_PER_USEC);
+    printf("Errors:       %llu\n", (unsigned long long)run->errors);
+}
+
+static int reserve(struct buffer_pool *pool, void **buf, size_t *cap, size_t len, size_t elem, int *err)
+{
+    void  *grown;
+    size_t new_cap;
+
+    if(len <= *cap)
+    {
+        return 0;
+    }
+
+    new_cap = *cap > 0 ? *cap : LOADGEN_CHUNK;
+    while(new_cap < len)
+    {
+        new_cap *= 2;
+    }
+
+    grown = pool_alloc(pool, new_cap * elem);
+
+    if(grown == NULL)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    if(*buf != NULL)
+    {
+        memcpy(grown, *buf, *cap * elem);
+    }
+    pool_free(pool, *buf, *cap * elem);
+    *buf = grown;
+    *cap = new_cap;
+
+    return 0;
+}
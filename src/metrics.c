@@ -0,0 +1,540 @@
+#include "../include/metrics.h"
+#include "../include/copy.h"
+#include "../include/open.h"
+#include "../include/transform.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+#define ADMIN_BACKLOG 16
+#define ADMIN_TIMEOUT_SEC 1
+#define ADMIN_REQUEST_MAX 4096
+
+// Appends to a buffer that is never overrun, and like snprintf() counts what the whole output needs even past its end
+struct render
+{
+    char  *buf;
+    size_t len;
+    size_t used;
+};
+
+static const char *const error_kinds[METRICS_ERRORS]     = {"alloc", "read", "parse", "write"};
+static const char *const timeout_kinds[METRICS_TIMEOUTS] = {"idle", "request", "reply"};
+
+static void  *admin_main(void *arg);
+static void   serve_scrape(const struct metrics *metrics, int client_fd);
+static void   render_append(struct render *out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void   render_header(struct render *out, const char *name, const char *type, const char *help);
+static size_t latency_bucket(uint64_t ns);
+static void   counter_add(_Atomic uint64_t *counter, uint64_t n);
+
+int metrics_init(struct metrics *metrics, unsigned int workers, int *err)
+{
+    memset(metrics, 0, sizeof(*metrics));
+    metrics->count    = workers;
+    metrics->len      = workers * sizeof(struct worker_metrics);
+    metrics->admin_fd = -1;
+
+    // Shared so prefork and fork children count into the same slots the admin thread reads
+    metrics->workers = (struct worker_metrics *)mmap(NULL, metrics->len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if(metrics->workers == MAP_FAILED)
+    {
+        *err             = errno;
+        metrics->workers = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+void metrics_destroy(struct metrics *metrics)
+{
+    if(metrics->admin_fd != -1)
+    {
+        shutdown(metrics->admin_fd, SHUT_RDWR);
+        pthread_join(metrics->admin_thread, NULL);
+        close(metrics->admin_fd);
+        metrics->admin_fd = -1;
+    }
+
+    if(metrics->workers != NULL)
+    {
+        munmap(metrics->workers, metrics->len);
+        metrics->workers = NULL;
+    }
+}
+
+struct worker_metrics *metrics_worker(const struct metrics *metrics, unsigned int worker)
+{
+    if(metrics == NULL || metrics->workers == NULL)
+    {
+        return NULL;
+    }
+
+    return &metrics->workers[worker % metrics->count];
+}
+
+int metrics_serve(struct metrics *metrics, const char *address, const char *endpoint, int *err)
+{
+    int result;
+
+    // An endpoint already set was taken over from the server being replaced and is served as it is. Otherwise a path
+    // is a Unix socket, anything else a TCP port on the server's own address (loopback when that is a Unix socket)
+    if(metrics->admin_fd == -1)
+    {
+        if(strchr(endpoint, '/') != NULL || is_unix_address(endpoint))
+        {
+            metrics->admin_fd = listen_unix_socket(endpoint, ADMIN_BACKLOG, err);
+        }
+        else
+        {
+            char         *end;
+            unsigned long port;
+
+            errno = 0;
+            port  = strtoul(endpoint, &end, 10);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+            if(end == endpoint || *end != '\0' || errno == ERANGE || port > UINT16_MAX)
+            {
+                *err = EINVAL;
+                return -1;
+            }
+            metrics->admin_fd = listen_network_socket_client(is_unix_address(address) ? "127.0.0.1" : address, (in_port_t)port, ADMIN_BACKLOG, false, false, err);
+        }
+    }
+
+    if(metrics->admin_fd == -1)
+    {
+        return -1;
+    }
+
+    result = start_background_thread(&metrics->admin_thread, admin_main, metrics);
+
+    if(result != 0)
+    {
+        *err = result;
+        close(metrics->admin_fd);
+        metrics->admin_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Every signal is blocked in the new thread: the prefork supervisor waits for SIGCHLD in ppoll(), so no signal may be
+// delivered to a thread of its own instead. Returns pthread_create()'s result
+int start_background_thread(pthread_t *thread, void *(*start)(void *), void *arg)
+{
+    sigset_t all;
+    sigset_t orig;
+    int      result;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &orig);
+    result = pthread_create(thread, NULL, start, arg);
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+
+    return result;
+}
+
+// Returns the length of the whole scrape; when that is len or more, buf holds only part of it
+size_t metrics_render(const struct metrics *metrics, char *buf, size_t len)
+{
+    struct render out;
+    uint64_t      sum;
+    int64_t       active;
+    uint64_t      cumulative;
+
+    out.buf  = buf;
+    out.len  = len;
+    out.used = 0;
+
+    // Workers are summed at scrape time, so the hot path never touches a shared line
+    sum = 0;
+    for(unsigned int w = 0; w < metrics->count; w++)
+    {
+        sum += atomic_load_explicit(&metrics->workers[w].accepts, memory_order_relaxed);
+    }
+    render_header(&out, "conv_accepts_total", "counter", "Connections accepted.");
+    render_append(&out, "conv_accepts_total %llu\n", (unsigned long long)sum);
+
+    active = 0;
+    for(unsigned int w = 0; w < metrics->count; w++)
+    {
+        active += atomic_load_explicit(&metrics->workers[w].active, memory_order_relaxed);
+    }
+    render_header(&out, "conv_connections_active", "gauge", "Connections being served.");
+    render_append(&out, "conv_connections_active %lld\n", (long long)active);
+
+    sum = 0;
+    for(unsigned int w = 0; w < metrics->count; w++)
+    {
+        sum += atomic_load_explicit(&metrics->workers[w].shed, memory_order_relaxed);
+    }
+    render_header(&out, "conv_shed_total", "counter", "Connections turned away with a busy reply.");
+    render_append(&out, "conv_shed_total %llu\n", (unsigned long long)sum);
+
+    active = 0;
+    for(unsigned int w = 0; w < metrics->count; w++)
+    {
+        active += atomic_load_explicit(&metrics->workers[w].accept_queue, memory_order_relaxed);
+    }
+    render_header(&out, "conv_accept_queue_depth", "gauge", "Connections waiting to be accepted, as last sampled.");
+    render_append(&out, "conv_accept_queue_depth %lld\n", (long long)active);
+
+    render_header(&out, "conv_requests_total", "counter", "Requests converted, by conversion.");
+    for(unsigned int opcode = 0; opcode < transform_count() && opcode < METRICS_TRANSFORMS; opcode++)
+    {
+        sum = 0;
+        for(unsigned int w = 0; w < metrics->count; w++)
+        {
+            sum += atomic_load_explicit(&metrics->workers[w].requests[opcode], memory_order_relaxed);
+        }
+        render_append(&out, "conv_requests_total{conversion=\"%s\"} %llu\n", transform_get(opcode)->name, (unsigned long long)sum);
+    }
+
+    sum = 0;
+    for(unsigned int w = 0; w < metrics->count; w++)
+    {
+        sum += atomic_load_explicit(&metrics->workers[w].bytes_in, memory_order_relaxed);
+    }
+    render_header(&out, "conv_received_bytes_total", "counter", "Bytes read from clients.");
+    render_append(&out, "conv_received_bytes_total %llu\n", (unsigned long long)sum);
+
+    sum = 0;
+    for(unsigned int w = 0; w < metrics->count; w++)
+    {
+        sum += atomic_load_explicit(&metrics->workers[w].bytes_out, memory_order_relaxed);
+    }
+    render_header(&out, "conv_sent_bytes_total", "counter", "Bytes written to clients.");
+    render_append(&out, "conv_sent_bytes_total %llu\n", (unsigned long long)sum);
+
+    render_header(&out, "conv_errors_total", "counter", "Failed connections, by what failed.");
+    for(size_t kind = 0; kind < METRICS_ERRORS; kind++)
+    {
+        sum = 0;
+        for(unsigned int w = 0; w < metrics->count; w++)
+        {
+            sum += atomic_load_explicit(&metrics->workers[w].errors[kind], memory_order_relaxed);
+        }
+        render_append(&out, "conv_errors_total{kind=\"%s\"} %llu\n", error_kinds[kind], (unsigned long long)sum);
+    }
+
+    render_header(&out, "conv_timeouts_total", "counter", "Connections closed for missing a deadline, by what they were waiting for.");
+    for(size_t kind = 0; kind < METRICS_TIMEOUTS; kind++)
+    {
+        sum = 0;
+        for(unsigned int w = 0; w < metrics->count; w++)
+        {
+            sum += atomic_load_explicit(&metrics->workers[w].timeouts[kind], memory_order_relaxed);
+        }
+        render_append(&out, "conv_timeouts_total{kind=\"%s\"} %llu\n", timeout_kinds[kind], (unsigned long long)sum);
+    }
+
+    // Prometheus buckets are cumulative, each counts everything at or below its bound
+    render_header(&out, "conv_request_duration_seconds", "histogram", "Time from a request's first byte to the end of its reply.");
+    cumulative = 0;
+    for(size_t bucket = 0; bucket <= METRICS_LATENCY_BUCKETS; bucket++)
+    {
+        for(unsigned int w = 0; w < metrics->count; w++)
+        {
+            cumulative += atomic_load_explicit(&metrics->workers[w].latency[bucket], memory_order_relaxed);
+        }
+
+        if(bucket < METRICS_LATENCY_BUCKETS)
+        {
+            render_append(&out, "conv_request_duration_seconds_bucket{le=\"%.9g\"} %llu\n", (double)(1ULL << (METRICS_LATENCY_FIRST_SHIFT + bucket)) / NSEC_PER_SEC, (unsigned long long)cumulative);
+        }
+        else
+        {
+            render_append(&out, "conv_request_duration_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+        }
+    }
+
+    sum = 0;
+    for(unsigned int w = 0; w < metrics->count; w++)
+    {
+        sum += atomic_load_explicit(&metrics->workers[w].latency_sum_ns, memory_order_relaxed);
+    }
+    render_append(&out, "conv_request_duration_seconds_sum %.9f\n", (double)sum / NSEC_PER_SEC);
+
+    sum = 0;
+    for(unsigned int w = 0; w < metrics->count; w++)
+    {
+        sum += atomic_load_explicit(&metrics->workers[w].latency_count, memory_order_relaxed);
+    }
+    render_append(&out, "conv_request_duration_seconds_count %llu\n", (unsigned long long)sum);
+
+    // Pools belong to one worker each, so their gauges stay per worker
+    render_header(&out, "conv_pool_bytes_in_use", "gauge", "Buffer pool bytes handed out, by worker.");
+    for(unsigned int w = 0; w < metrics->count; w++)
+    {
+        render_append(&out, "conv_pool_bytes_in_use{worker=\"%u\"} %llu\n", w, (unsigned long long)atomic_load_explicit(&metrics->workers[w].pool_bytes_in_use, memory_order_relaxed));
+    }
+
+    render_header(&out, "conv_pool_bytes_high_water", "gauge", "Most buffer pool bytes ever handed out at once, by worker.");
+    for(unsigned int w = 0; w < metrics->count; w++)
+    {
+        render_append(&out, "conv_pool_bytes_high_water{worker=\"%u\"} %llu\n", w, (unsigned long long)atomic_load_explicit(&metrics->workers[w].pool_bytes_high_water, memory_order_relaxed));
+    }
+
+    return out.used;
+}
+
+uint64_t metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+void metrics_accept(struct worker_metrics *worker)
+{
+    if(worker != NULL)
+    {
+        counter_add(&worker->accepts, 1);
+        atomic_fetch_add_explicit(&worker->active, 1, memory_order_relaxed);
+    }
+}
+
+void metrics_close(struct worker_metrics *worker)
+{
+    if(worker != NULL)
+    {
+        atomic_fetch_sub_explicit(&worker->active, 1, memory_order_relaxed);
+    }
+}
+
+void metrics_shed(struct worker_metrics *worker)
+{
+    if(worker != NULL)
+    {
+        counter_add(&worker->shed, 1);
+    }
+}
+
+void metrics_accept_queue(struct worker_metrics *worker, uint32_t depth)
+{
+    if(worker != NULL)
+    {
+        atomic_store_explicit(&worker->accept_queue, depth, memory_order_relaxed);
+    }
+}
+
+void metrics_request(struct worker_metrics *worker, unsigned int opcode)
+{
+    if(worker != NULL && opcode < METRICS_TRANSFORMS)
+    {
+        counter_add(&worker->requests[opcode], 1);
+    }
+}
+
+void metrics_bytes(struct worker_metrics *worker, size_t in, size_t out)
+{
+    if(worker == NULL)
+    {
+        return;
+    }
+
+    if(in > 0)
+    {
+        counter_add(&worker->bytes_in, in);
+    }
+
+    if(out > 0)
+    {
+        counter_add(&worker->bytes_out, out);
+    }
+}
+
+void metrics_error(struct worker_metrics *worker, ssize_t result)
+{
+    // convert_copy() returns -1 to -4 for allocation, read, parse and write failures
+    if(worker != NULL && result <= -1 && result >= -METRICS_ERRORS)
+    {
+        counter_add(&worker->errors[-result - 1], 1);
+    }
+}
+
+void metrics_timeout(struct worker_metrics *worker, enum metrics_timeout kind)
+{
+    if(worker != NULL && kind < METRICS_TIMEOUTS)
+    {
+        counter_add(&worker->timeouts[kind], 1);
+    }
+}
+
+void metrics_latency(struct worker_metrics *worker, uint64_t ns)
+{
+    if(worker != NULL)
+    {
+        counter_add(&worker->latency[latency_bucket(ns)], 1);
+        counter_add(&worker->latency_sum_ns, ns);
+        counter_add(&worker->latency_count, 1);
+    }
+}
+
+void metrics_pool(struct worker_metrics *worker, const struct buffer_pool *pool)
+{
+    if(worker != NULL && pool != NULL)
+    {
+        atomic_store_explicit(&worker->pool_bytes_in_use, pool->bytes_in_use, memory_order_relaxed);
+        atomic_store_explicit(&worker->pool_bytes_high_water, pool->bytes_high_water, memory_order_relaxed);
+    }
+}
+
+static void *admin_main(void *arg)
+{
+    const struct metrics *metrics;
+
+    metrics = (const struct metrics *)arg;
+
+    // Scrapes are rare and small, one at a time is plenty; shutdown() on the socket ends the loop
+    while(true)
+    {
+        int client_fd;
+
+        client_fd = accept4(metrics->admin_fd, NULL, 0, SOCK_CLOEXEC);
+
+        if(client_fd == -1)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            break;
+        }
+
+        serve_scrape(metrics, client_fd);
+        close(client_fd);
+    }
+
+    return NULL;
+}
+
+static void serve_scrape(const struct metrics *metrics, int client_fd)
+{
+    char          *body;
+    size_t         body_cap;
+    char           request[ADMIN_REQUEST_MAX];
+    char           header[128];    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    struct timeval timeout;
+    size_t         nread;
+    size_t         body_len;
+    int            header_len;
+    int            err;
+
+    // A scraper that stalls must not hold the endpoint for long
+    timeout.tv_sec  = ADMIN_TIMEOUT_SEC;
+    timeout.tv_usec = 0;
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Whatever was asked for, the answer is the metrics; just wait for the end of the request headers
+    nread = 0;
+    while(nread < sizeof(request) - 1)
+    {
+        ssize_t n;
+
+        n = read(client_fd, request + nread, sizeof(request) - 1 - nread);
+
+        if(n <= 0)
+        {
+            return;
+        }
+        nread += (size_t)n;
+        request[nread] = '\0';
+
+        if(strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+        {
+            break;
+        }
+    }
+
+    // The size depends on the worker count and on the counters themselves, which may grow between two renders
+    body     = NULL;
+    body_cap = METRICS_RESPONSE_INITIAL;
+    for(;;)
+    {
+        char *grown;
+
+        grown = (char *)realloc(body, body_cap);
+
+        if(grown == NULL)
+        {
+            free(body);
+            return;
+        }
+        body     = grown;
+        body_len = metrics_render(metrics, body, body_cap);
+
+        if(body_len < body_cap)
+        {
+            break;
+        }
+        body_cap = body_len + 1;
+    }
+
+    header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", body_len);
+
+    if(nwrite(header, client_fd, (size_t)header_len, &err) != -1)
+    {
+        nwrite(body, client_fd, body_len, &err);
+    }
+    free(body);
+}
+
+static void render_append(struct render *out, const char *format, ...)
+{
+    va_list args;
+    size_t  room;
+    int     n;
+
+    room = out->used < out->len ? out->len - out->used : 0;
+
+    va_start(args, format);
+    n = vsnprintf(room > 0 ? out->buf + out->used : NULL, room, format, args);
+    va_end(args);
+
+    if(n > 0)
+    {
+        out->used += (size_t)n;
+    }
+}
+
+static void render_header(struct render *out, const char *name, const char *type, const char *help)
+{
+    render_append(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+// The smallest bucket whose bound is at or above ns
+static size_t latency_bucket(uint64_t ns)
+{
+    unsigned int bits;
+
+    if(ns <= (1ULL << METRICS_LATENCY_FIRST_SHIFT))
+    {
+        return 0;
+    }
+    bits = 64 - (unsigned int)__builtin_clzll(ns - 1);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+    return bits - METRICS_LATENCY_FIRST_SHIFT < METRICS_LATENCY_BUCKETS ? bits - METRICS_LATENCY_FIRST_SHIFT : METRICS_LATENCY_BUCKETS;
+}
+
+static void counter_add(_Atomic uint64_t *counter, uint64_t n)
+{
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
@@ -1,6 +1,8 @@
 #include "../include/open.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
@@ -9,9 +11,16 @@
 #include <unistd.h>
 
 static void setup_network_address(struct sockaddr_storage *addr, socklen_t *addr_len, const char *address, in_port_t port, int *err);
-static int  connect_to_server(struct sockaddr_storage *addr, socklen_t addr_len, int *err);
+static void setup_unix_address(struct sockaddr_storage *addr, socklen_t *addr_len, const char *path, int *err);
+static int  connect_to_server(struct sockaddr_storage *addr, socklen_t addr_len, int type, int *err);
 static int  accept_connection(const struct sockaddr_storage *addr, socklen_t addr_len, int backlog, int *err);
-static int  listen_connection(const struct sockaddr_storage *addr, socklen_t addr_len, int backlog, int *err);
+static int  listen_connection(const struct sockaddr_storage *addr, socklen_t addr_len, int type, int backlog, bool reuse_port, bool v6_only, int *err);
+static int  remove_stale_socket(const struct sockaddr_storage *addr, socklen_t addr_len, int type, int *err);
+
+bool is_unix_address(const char *address)
+{
+    return strncmp(address, UNIX_ADDRESS_PREFIX, strlen(UNIX_ADDRESS_PREFIX)) == 0;
+}
 
 int open_keyboard(void)
 {
@@ -37,13 +46,54 @@ int open_network_socket_client(const char *address, in_port_t port, int *err)
         goto done;
     }
 
-    fd = connect_to_server(&addr, addr_len, err);
+    fd = connect_to_server(&addr, addr_len, SOCK_STREAM, err);
 
 done:
     return fd;
 }
 
-int listen_network_socket_client(const char *address, in_port_t port, int backlog, int *err)
+int open_datagram_socket_client(const char *address, in_port_t port, int *err)
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    int                     fd;
+
+    setup_network_address(&addr, &addr_len, address, port, err);
+
+    if(*err != 0)
+    {
+        fd = -1;
+        goto done;
+    }
+
+    // Connected, so plain send() and recv() talk to the server and datagrams from anyone else are filtered out
+    fd = connect_to_server(&addr, addr_len, SOCK_DGRAM, err);
+
+done:
+    return fd;
+}
+
+int listen_network_socket_client(const char *address, in_port_t port, int backlog, bool reuse_port, bool v6_only, int *err)
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    int                     server_fd;
+
+    setup_network_address(&addr, &addr_len, address, port, err);
+
+    if(*err != 0)
+    {
+        server_fd = -1;
+        goto done;
+    }
+
+    server_fd = listen_connection(&addr, addr_len, SOCK_STREAM, backlog, reuse_port, v6_only, err);
+
+done:
+    return server_fd;
+}
+
+int listen_datagram_socket(const char *address, in_port_t port, bool reuse_port, int *err)
 {
     struct sockaddr_storage addr;
     socklen_t               addr_len;
@@ -57,12 +107,79 @@ int listen_network_socket_client(const char *address, in_port_t port, int backlo
         goto done;
     }
 
-    server_fd = listen_connection(&addr, addr_len, backlog, err);
+    server_fd = listen_connection(&addr, addr_len, SOCK_DGRAM, 0, reuse_port, false, err);
 
 done:
     return server_fd;
 }
 
+int listen_unix_socket(const char *path, int backlog, int *err)
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    int                     server_fd;
+
+    // The prefix is optional here, the caller already knows this is a Unix socket
+    if(is_unix_address(path))
+    {
+        path += strlen(UNIX_ADDRESS_PREFIX);
+    }
+
+    setup_unix_address(&addr, &addr_len, path, err);
+
+    if(*err != 0)
+    {
+        server_fd = -1;
+        goto done;
+    }
+
+    server_fd = listen_connection(&addr, addr_len, SOCK_STREAM, backlog, false, false, err);
+
+done:
+    return server_fd;
+}
+
+// Sequenced packets keep every message, and the descriptors passed with it, apart from the next
+int listen_unix_seqpacket(const char *path, int backlog, int *err)
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    int                     server_fd;
+
+    setup_unix_address(&addr, &addr_len, path, err);
+
+    if(*err != 0)
+    {
+        server_fd = -1;
+        goto done;
+    }
+
+    server_fd = listen_connection(&addr, addr_len, SOCK_SEQPACKET, backlog, false, false, err);
+
+done:
+    return server_fd;
+}
+
+int open_unix_seqpacket_client(const char *path, int *err)
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    int                     fd;
+
+    setup_unix_address(&addr, &addr_len, path, err);
+
+    if(*err != 0)
+    {
+        fd = -1;
+        goto done;
+    }
+
+    fd = connect_to_server(&addr, addr_len, SOCK_SEQPACKET, err);
+
+done:
+    return fd;
+}
+
 int open_network_socket_server(const char *address, in_port_t port, int backlog, int *err)
 {
     struct sockaddr_storage addr;
@@ -83,6 +200,77 @@ done:
     return server_fd;
 }
 
+int set_nonblocking(int fd, int *err)
+{
+    int flags;
+
+    flags = fcntl(fd, F_GETFL);
+
+    if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Whether more listeners can bind next to this one; a socket inherited from another server may have been opened without
+bool reuses_port(int fd)
+{
+    int       value;
+    socklen_t len;
+
+    value = 0;
+    len   = sizeof(value);
+
+    return getsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &value, &len) == 0 && value != 0;
+}
+
+// Whether a socket is bound to the address, on any port when port is 0
+bool bound_to(int fd, const char *address, in_port_t port)
+{
+    struct sockaddr_storage want;
+    struct sockaddr_storage have;
+    socklen_t               want_len;
+    socklen_t               have_len;
+    int                     err;
+
+    err = 0;
+    setup_network_address(&want, &want_len, address, port, &err);
+    have_len = sizeof(have);
+
+    if(err != 0 || want_len == 0 || getsockname(fd, (struct sockaddr *)&have, &have_len) == -1 || have.ss_family != want.ss_family)
+    {
+        return false;
+    }
+
+    if(want.ss_family == AF_INET)
+    {
+        const struct sockaddr_in *want_in;
+        const struct sockaddr_in *have_in;
+
+        want_in = (const struct sockaddr_in *)&want;
+        have_in = (const struct sockaddr_in *)&have;
+
+        return want_in->sin_addr.s_addr == have_in->sin_addr.s_addr && (port == 0 || want_in->sin_port == have_in->sin_port);
+    }
+
+    if(want.ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *want_in6;
+        const struct sockaddr_in6 *have_in6;
+
+        want_in6 = (const struct sockaddr_in6 *)&want;
+        have_in6 = (const struct sockaddr_in6 *)&have;
+
+        return memcmp(&want_in6->sin6_addr, &have_in6->sin6_addr, sizeof(want_in6->sin6_addr)) == 0 && (port == 0 || want_in6->sin6_port == have_in6->sin6_port);
+    }
+
+    // A path or an abstract name, which the kernel reports back with the length it was bound with
+    return have_len == want_len && memcmp(&have, &want, want_len) == 0;
+}
+
 static void setup_network_address(struct sockaddr_storage *addr, socklen_t *addr_len, const char *address, in_port_t port, int *err)
 {
     in_port_t net_port;
@@ -91,7 +279,11 @@ static void setup_network_address(struct sockaddr_storage *addr, socklen_t *addr
     net_port  = htons(port);
     memset(addr, 0, sizeof(*addr));
 
-    if(inet_pton(AF_INET, address, &(((struct sockaddr_in *)addr)->sin_addr)) == 1)
+    if(is_unix_address(address))
+    {
+        setup_unix_address(addr, addr_len, address + strlen(UNIX_ADDRESS_PREFIX), err);
+    }
+    else if(inet_pton(AF_INET, address, &(((struct sockaddr_in *)addr)->sin_addr)) == 1)
     {
         struct sockaddr_in *ipv4_addr;
 
@@ -111,17 +303,90 @@ static void setup_network_address(struct sockaddr_storage *addr, socklen_t *addr
     }
     else
     {
-        fprintf(stderr, "%s is not an IPv4 or an IPv6 address\n", address);
+        fprintf(stderr, "%s is not an IPv4, an IPv6 or a unix: address\n", address);
+        *err = errno;
+    }
+}
+
+static void setup_unix_address(struct sockaddr_storage *addr, socklen_t *addr_len, const char *path, int *err)
+{
+    struct sockaddr_un *unix_addr;
+    size_t              len;
+
+    unix_addr = (struct sockaddr_un *)addr;
+    len       = strlen(path);
+    memset(addr, 0, sizeof(*addr));
+
+    // Leave room for the terminator of a path, or for the leading NUL that replaces the @ of an abstract name
+    if(len == 0 || len >= sizeof(unix_addr->sun_path))
+    {
+        fprintf(stderr, "Unix socket path \"%s\" is empty or too long\n", path);
+        *err = len == 0 ? EINVAL : ENAMETOOLONG;
+        return;
+    }
+
+    unix_addr->sun_family = AF_UNIX;
+    memcpy(unix_addr->sun_path, path, len);
+
+    // Abstract names are not NUL terminated, their length is all the kernel goes by
+    if(path[0] == '@')
+    {
+        unix_addr->sun_path[0] = '\0';
+        *addr_len              = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
+    }
+    else
+    {
+        *addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len + 1);
+    }
+}
+
+// A socket file left by an earlier run would make bind() fail, so it goes once a connect() to it is refused. One a
+// server still answers on is in use; anything else at the path is left alone for bind() to fail on
+static int remove_stale_socket(const struct sockaddr_storage *addr, socklen_t addr_len, int type, int *err)
+{
+    const struct sockaddr_un *unix_addr;
+    struct stat               st;
+    int                       probe_fd;
+    int                       result;
+
+    unix_addr = (const struct sockaddr_un *)addr;
+
+    if(addr->ss_family != AF_UNIX || unix_addr->sun_path[0] == '\0' || lstat(unix_addr->sun_path, &st) == -1 || !S_ISSOCK(st.st_mode))
+    {
+        return 0;
+    }
+
+    // Non-blocking, so a live server with a full accept queue answers EAGAIN instead of keeping the probe waiting
+    probe_fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if(probe_fd == -1)
+    {
         *err = errno;
+        return -1;
     }
+
+    result = connect(probe_fd, (const struct sockaddr *)addr, addr_len);
+
+    if(result == -1 && errno == ECONNREFUSED)
+    {
+        close(probe_fd);
+        unlink(unix_addr->sun_path);
+        return 0;
+    }
+
+    close(probe_fd);
+    fprintf(stderr, "Another server is listening on %s\n", unix_addr->sun_path);
+    *err = EADDRINUSE;
+
+    return -1;
 }
 
-static int listen_connection(const struct sockaddr_storage *addr, socklen_t addr_len, int backlog, int *err)
+static int listen_connection(const struct sockaddr_storage *addr, socklen_t addr_len, int type, int backlog, bool reuse_port, bool v6_only, int *err)
 {
     int server_fd;
     int result;
 
-    server_fd = socket(addr->ss_family, SOCK_STREAM, 0);    // NOLINT(android-cloexec-socket)
+    server_fd = socket(addr->ss_family, type, 0);    // NOLINT(android-cloexec-socket)
 
     if(server_fd == -1)
     {
@@ -129,11 +394,52 @@ static int listen_connection(const struct sockaddr_storage *addr, socklen_t addr
         goto done;
     }
 
+    // Let several sockets bind the same address so the kernel spreads connections across them; Unix sockets cannot
+    if(reuse_port && addr->ss_family != AF_UNIX)
+    {
+        int enable;
+
+        enable = 1;
+        result = setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable));
+
+        if(result == -1)
+        {
+            *err = errno;
+            goto fail;
+        }
+    }
+
+    // Left to the kernel's dual-stack default unless IPv4 has a listener of its own on the port, which [::] would clash with
+    if(v6_only && addr->ss_family == AF_INET6)
+    {
+        int enable;
+
+        enable = 1;
+        result = setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &enable, sizeof(enable));
+
+        if(result == -1)
+        {
+            *err = errno;
+            goto fail;
+        }
+    }
+
+    if(remove_stale_socket(addr, addr_len, type, err) == -1)
+    {
+        goto fail;
+    }
+
     result = bind(server_fd, (const struct sockaddr *)addr, addr_len);
 
     if(result == -1)
     {
         *err = errno;
+        goto fail;
+    }
+
+    // A datagram socket is ready once bound
+    if(type == SOCK_DGRAM)
+    {
         goto done;
     }
 
@@ -142,9 +448,15 @@ static int listen_connection(const struct sockaddr_storage *addr, socklen_t addr
     if(result == -1)
     {
         *err = errno;
-        goto done;
+        goto fail;
     }
 
+    goto done;
+
+fail:
+    close(server_fd);
+    server_fd = -1;
+
 done:
     return server_fd;
 }
@@ -195,12 +507,12 @@ done:
     return client_fd;
 }
 
-static int connect_to_server(struct sockaddr_storage *addr, socklen_t addr_len, int *err)
+static int connect_to_server(struct sockaddr_storage *addr, socklen_t addr_len, int type, int *err)
 {
     int fd;
     int result;
 
-    fd = socket(addr->ss_family, SOCK_STREAM, 0);    // NOLINT(android-cloexec-socket)
+    fd = socket(addr->ss_family, type, 0);    // NOLINT(android-cloexec-socket)
 
     if(fd == -1)
     {
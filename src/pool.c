@@ -0,0 +1,199 @@
+#include "../include/pool.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Keeps the slabs after a region's header on a cache line boundary
+#define POOL_REGION_HEADER 64
+
+static size_t pool_class_index(size_t len);
+static int    pool_map_region(struct buffer_pool *pool, int *err);
+
+int pool_init(struct buffer_pool *pool, bool huge_pages, int *err)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->huge_pages = huge_pages;
+
+    // The first region is faulted in now, so the first requests do not pay for it
+    return pool_map_region(pool, err);
+}
+
+void pool_destroy(struct buffer_pool *pool)
+{
+    while(pool->regions != NULL)
+    {
+        void *next;
+
+        memcpy(&next, pool->regions, sizeof(next));
+        munmap(pool->regions, POOL_REGION);
+        pool->regions = next;
+    }
+    pool->bump      = NULL;
+    pool->bump_left = 0;
+}
+
+void *pool_alloc(struct buffer_pool *pool, size_t len)
+{
+    struct pool_class *slab_class;
+    size_t             slab;
+    void              *ptr;
+
+    if(pool == NULL)
+    {
+        return malloc(len);
+    }
+
+    // Too big for any class, only session lines that keep expanding get here
+    if(len > POOL_MAX_SLAB)
+    {
+        ptr = malloc(len);
+
+        if(ptr != NULL)
+        {
+            pool->oversize_allocs++;
+            pool->oversize_in_use++;
+        }
+        return ptr;
+    }
+
+    slab_class = &pool->classes[pool_class_index(len)];
+    slab       = POOL_MIN_SLAB << pool_class_index(len);
+
+    if(slab_class->free_list != NULL)
+    {
+        ptr = slab_class->free_list;
+        memcpy(&slab_class->free_list, ptr, sizeof(void *));
+    }
+    else
+    {
+        int err;
+
+        // The rest of a region too small for this slab is left unused
+        if(pool->bump_left < slab && pool_map_region(pool, &err) == -1)
+        {
+            errno = err;
+            return NULL;
+        }
+        ptr = pool->bump;
+        pool->bump += slab;
+        pool->bump_left -= slab;
+        slab_class->carved++;
+    }
+
+    slab_class->in_use++;
+    if(slab_class->in_use > slab_class->high_water)
+    {
+        slab_class->high_water = slab_class->in_use;
+    }
+
+    pool->bytes_in_use += slab;
+    if(pool->bytes_in_use > pool->bytes_high_water)
+    {
+        pool->bytes_high_water = pool->bytes_in_use;
+    }
+
+    return ptr;
+}
+
+void pool_free(struct buffer_pool *pool, void *ptr, size_t len)
+{
+    struct pool_class *slab_class;
+
+    if(pool == NULL || len > POOL_MAX_SLAB)
+    {
+        if(pool != NULL && ptr != NULL)
+        {
+            pool->oversize_in_use--;
+        }
+        free(ptr);
+        return;
+    }
+
+    if(ptr == NULL)
+    {
+        return;
+    }
+
+    slab_class = &pool->classes[pool_class_index(len)];
+    memcpy(ptr, &slab_class->free_list, sizeof(void *));
+    slab_class->free_list = ptr;
+    slab_class->in_use--;
+    pool->bytes_in_use -= POOL_MIN_SLAB << pool_class_index(len);
+}
+
+void pool_report(const struct buffer_pool *pool, const char *name)
+{
+    printf("%s pool: %zu KiB in use, high water %zu KiB, %zu region(s)%s, %zu oversize allocation(s)\n",
+           name,
+           pool->bytes_in_use / 1024,        // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+           pool->bytes_high_water / 1024,    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+           pool->regions_mapped,
+           pool->huge_backed ? " on huge pages" : "",
+           pool->oversize_allocs);
+
+    for(size_t i = 0; i < POOL_CLASSES; i++)
+    {
+        const struct pool_class *slab_class;
+
+        slab_class = &pool->classes[i];
+
+        if(slab_class->carved > 0)
+        {
+            printf("  %7zu B slabs: %zu in use, high water %zu, %zu carved\n", POOL_MIN_SLAB << i, slab_class->in_use, slab_class->high_water, slab_class->carved);
+        }
+    }
+}
+
+static size_t pool_class_index(size_t len)
+{
+    size_t index;
+
+    index = 0;
+    while((POOL_MIN_SLAB << index) < len)
+    {
+        index++;
+    }
+
+    return index;
+}
+
+static int pool_map_region(struct buffer_pool *pool, int *err)
+{
+    uint8_t *region;
+
+    region = (uint8_t *)MAP_FAILED;
+
+    // Explicit huge pages need a reserved hugetlb pool; without one, ask for transparent huge pages instead
+    if(pool->huge_pages)
+    {
+        region = (uint8_t *)mmap(NULL, POOL_REGION, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        pool->huge_backed = region != MAP_FAILED;
+    }
+
+    if(region == MAP_FAILED)
+    {
+        region = (uint8_t *)mmap(NULL, POOL_REGION, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+
+        if(region == MAP_FAILED)
+        {
+            *err = errno;
+            return -1;
+        }
+
+        if(pool->huge_pages)
+        {
+            madvise(region, POOL_REGION, MADV_HUGEPAGE);
+        }
+    }
+
+    // Regions chain through their headers so pool_destroy() can find them all
+    memcpy(region, &pool->regions, sizeof(void *));
+    pool->regions   = region;
+    pool->bump      = region + POOL_REGION_HEADER;
+    pool->bump_left = POOL_REGION - POOL_REGION_HEADER;
+    pool->regions_mapped++;
+
+    return 0;
+}
@@ -1,10 +1,21 @@
 #include "../include/server.h"
+#include "../include/admission.h"
+#include "../include/ascii.h"
 #include "../include/copy.h"
+#include "../include/datagram.h"
+#include "../include/event.h"
+#include "../include/handoff.h"
+#include "../include/metrics.h"
 #include "../include/open.h"
+#include "../include/pool.h"
+#include "../include/uring.h"
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,30 +24,106 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#define NSEC_PER_SEC 1000000000ULL
+
+struct child;
+
 // Functions dealing with arguments
 static void           parse_arguments(int argc, char *argv[], struct options *opts);
 static void           check_arguments(const char *binary_name, const struct options *opts);
 _Noreturn static void usage(const char *program_name, int exit_code, const char *message);
 
 // Help functions for get client and server
-static int       get_server(const struct options *opts, int *err);
-static in_port_t convert_port(const char *str, int *err);
+static int                get_servers(const struct options *opts, struct handoff *handoff, int *server_fds, int *err);
+static int                get_server(const struct options *opts, unsigned int endpoint, struct handoff *handoff, int *err);
+static in_port_t          convert_port(const char *str, int *err);
+static int                convert_endpoint(char *str, struct endpoint *endpoint, int *err);
+static bool               shares_ipv4_wildcard(const struct options *opts, unsigned int endpoint);
+static enum server_engine convert_engine(const char *str, int *err);
+static unsigned int       convert_workers(const char *str, int *err);
+static unsigned int       convert_limit(const char *str, long min, long max, int *err);
+
+// Connection dispatch engines
+static void  serve_fork(const int *server_fds, unsigned int nservers, struct admission *admission, const struct copy_timeouts *timeouts, struct worker_metrics *metrics);
+static int   await_client(const int *server_fds, unsigned int nservers, int drain_fd, unsigned int *next);
+static int   serve_workers(const int *server_fds, const struct options *opts, struct handoff *handoff, struct admission *admission, const struct copy_timeouts *timeouts, const struct metrics *metrics, int *err);
+static void *worker_main(void *arg);
+static int   serve_prefork(const int *server_fds, const struct options *opts, const struct admission *admission, const struct copy_timeouts *timeouts, const struct metrics *metrics, int *err);
+static void  drain_children(struct child *children, unsigned int count, const sigset_t *orig);
+static pid_t spawn_child(const int *server_fds, unsigned int nservers, bool huge_pages, const struct copy_timeouts *timeouts, int drain_fd, struct worker_metrics *metrics);
+_Noreturn static void child_main(const int *server_fds, unsigned int nservers, bool huge_pages, const struct copy_timeouts *timeouts, int drain_fd, struct worker_metrics *metrics);
+static void  handle_supervisor_signal(int sig);
+static void  handle_child_signal(int sig);
+static int   serve_datagrams(const struct options *opts, struct handoff *handoff, const struct metrics *metrics, int *err);
+static void *datagram_main(void *arg);
+
+// One event loop thread with its own listening socket per endpoint, buffer pool and counters
+struct worker
+{
+    pthread_t                   thread;
+    int                         server_fds[MAX_LISTENERS];
+    unsigned int                nservers;
+    int                         err;
+    enum server_engine          engine;
+    bool                        huge_pages;
+    struct buffer_pool          pool;
+    struct admission           *admission;
+    const struct copy_timeouts *timeouts;
+    struct worker_metrics      *metrics;
+};
+
+// One thread answering datagrams on its own SO_REUSEPORT socket
+struct datagram_worker
+{
+    int                    fd;
+    int                    err;
+    struct worker_metrics *metrics;
+};
+
+// One pre-forked child process sharing the listening socket
+struct child
+{
+    pid_t  pid;
+    time_t started;
+};
+
+// Set from signal handlers, consumed by the supervisor loop
+static volatile sig_atomic_t child_exited;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile sig_atomic_t shutdown_requested;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+static volatile sig_atomic_t drain_requested;       // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+// The UDP threads are detached and serve until the process exits, so their slots are owned here rather than by a caller
+static struct datagram_worker *datagram_workers;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
 
 int main(int argc, char *argv[])
 {
     // Initialize variables
-    struct options opts;
-    int            server_fd;
-    int            err;
-    ssize_t        result;
+    struct options       opts;
+    struct metrics       metrics;
+    struct metrics      *watched;
+    struct admission     admission;
+    struct copy_timeouts timeouts;
+    struct handoff       handoff;
+    int                  server_fds[MAX_LISTENERS];
+    unsigned int         nservers;
+    int                  inherited;
+    int                  err;
 
     // Assign values to these variables
     memset(&opts, 0, sizeof(opts));
     opts.inport          = PORT;
     opts.outport         = PORT;
     opts.conversion_type = NULL;
+    opts.engine          = ENGINE_FORK;
+    opts.workers         = 1;
+    opts.backlog         = BACKLOG;
+    opts.idle_timeout    = IDLE_TIMEOUT;
+    opts.read_timeout    = READ_TIMEOUT;
+    opts.write_timeout   = WRITE_TIMEOUT;
 
     // Get address and coversion type from argv
     parse_arguments(argc, argv, &opts);
@@ -44,12 +131,36 @@ int main(int argc, char *argv[])
     // Check arguments
     check_arguments(argv[0], &opts);
 
-    // get input file descriptor
-    err       = 0;
-    server_fd = get_server(&opts, &err);
+    // Pick the fastest conversion kernel this CPU supports
+    ascii_init();
+
+    // A client that hangs up mid-reply must be a write error, not the end of the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // A server already running at the handoff path gives its sockets to this one, which then takes over without a gap
+    handoff_init(&handoff, opts.handoff);
+    inherited = handoff_receive(&handoff, &err);
+
+    if(inherited == -1)
+    {
+        const char *msg;
+
+        msg = strerror(err);
+        printf("Error taking over from the running server: %s\n", msg);
+        return EXIT_FAILURE;
+    }
+
+    if(inherited > 0)
+    {
+        printf("Took over %d sockets from the running server\n", inherited);
+    }
+
+    // get input file descriptors, one per endpoint
+    err      = 0;
+    nservers = 0;
 
     // check if input descriptor has error
-    if(server_fd < 0)
+    if(get_servers(&opts, &handoff, server_fds, &err) == -1)
     {
         const char *msg;
 
@@ -57,63 +168,835 @@ int main(int argc, char *argv[])
         printf("Error initializing server: %s\n", msg);
         goto err_in;
     }
-    printf("Server listening on %s | PORT: %d\n", opts.inaddress, opts.inport);
+    nservers = opts.nendpoints;
 
-    while(true)
+    for(unsigned int i = 0; i < nservers; i++)
+    {
+        if(is_unix_address(opts.endpoints[i].address))
+        {
+            printf("Server listening on %s\n", opts.endpoints[i].address);
+        }
+        else
+        {
+            printf("Server listening on %s | PORT: %d\n", opts.endpoints[i].address, opts.endpoints[i].port);
+        }
+    }
+    printf("Conversion kernel: %s\n", ascii_kernel_name());
+
+    // Without an admin endpoint nobody reads the counters, so none are kept
+    watched = NULL;
+
+    if(opts.metrics != NULL)
+    {
+        int admin_fd;
+
+        if(metrics_init(&metrics, opts.engine == ENGINE_FORK ? 1 : opts.workers, &err) == -1)
+        {
+            const char *msg;
+
+            msg = strerror(err);
+            printf("Error serving metrics: %s\n", msg);
+            goto err_in;
+        }
+
+        // An inherited admin endpoint is served as it is
+        admin_fd         = handoff_take(&handoff, HANDOFF_METRICS);
+        metrics.admin_fd = admin_fd;
+
+        if(metrics_serve(&metrics, opts.inaddress, opts.metrics, &err) == -1)
+        {
+            const char *msg;
+
+            msg = strerror(err);
+            printf("Error serving metrics: %s\n", msg);
+            metrics_destroy(&metrics);
+            goto err_in;
+        }
+
+        if(admin_fd == -1)
+        {
+            handoff_keep(&handoff, metrics.admin_fd, HANDOFF_METRICS);
+        }
+        watched = &metrics;
+        printf("Metrics served on %s\n", opts.metrics);
+    }
+
+    // One count for all workers, so the limit holds for the server as a whole
+    admission_init(&admission, opts.max_connections, opts.max_requests);
+
+    // A server that can be replaced watches for the moment its successor is ready, and then drains
+    if(opts.handoff != NULL && admission_watch_drain(&admission, &err) == -1)
+    {
+        const char *msg;
+
+        msg = strerror(err);
+        printf("Error watching for a handoff: %s\n", msg);
+        goto err_serve;
+    }
+
+    // Every engine holds its connections to the same deadlines
+    timeouts.idle    = (uint64_t)opts.idle_timeout * NSEC_PER_SEC;
+    timeouts.request = (uint64_t)opts.read_timeout * NSEC_PER_SEC;
+    timeouts.reply   = (uint64_t)opts.write_timeout * NSEC_PER_SEC;
+
+    // Datagrams are answered on threads of their own, next to whichever engine serves the connections
+    if(opts.udp && serve_datagrams(&opts, &handoff, watched, &err) == -1)
+    {
+        const char *msg;
+
+        msg = strerror(err);
+        printf("Error starting UDP workers: %s\n", msg);
+        goto err_serve;
+    }
+
+    // io_uring can be compiled in yet refused at runtime (old kernel, seccomp), so probe before committing to it
+    if(opts.engine == ENGINE_URING && !uring_supported(BUFSIZE))
+    {
+        printf("io_uring unavailable, falling back to epoll\n");
+        opts.engine = ENGINE_EPOLL;
+    }
+
+    if(opts.engine == ENGINE_EPOLL || opts.engine == ENGINE_URING)
+    {
+        if(serve_workers(server_fds, &opts, &handoff, &admission, &timeouts, watched, &err) == -1)
+        {
+            const char *msg;
+
+            msg = strerror(err);
+            printf("Error starting workers: %s\n", msg);
+        }
+    }
+    else if(handoff_ready(&handoff, &admission, &err) == -1)
+    {
+        const char *msg;
+
+        msg = strerror(err);
+        printf("Error listening for a handoff: %s\n", msg);
+    }
+    else if(opts.engine == ENGINE_PREFORK)
+    {
+        if(serve_prefork(server_fds, &opts, &admission, &timeouts, watched, &err) == -1)
+        {
+            const char *msg;
+
+            msg = strerror(err);
+            printf("Error supervising workers: %s\n", msg);
+        }
+    }
+    else
+    {
+        serve_fork(server_fds, nservers, &admission, &timeouts, metrics_worker(watched, 0));
+    }
+
+err_serve:
+    // A drained server shares its admin listener with its successor, where shutdown() would stop it too
+    if(watched != NULL && !admission_draining(&admission))
+    {
+        metrics_destroy(watched);
+    }
+
+err_in:
+    for(unsigned int i = 0; i < nservers; i++)
+    {
+        close(server_fds[i]);
+    }
+    return EXIT_SUCCESS;
+}
+
+static void serve_fork(const int *server_fds, unsigned int nservers, struct admission *admission, const struct copy_timeouts *timeouts, struct worker_metrics *metrics)
+{
+    struct sigaction sa;
+    unsigned int     next;
+    int              server_fd;
+
+    // Without a limit nobody counts the children, so let the kernel reap them and they never linger as zombies
+    if(admission->max == 0)
+    {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = SIG_IGN;
+        sa.sa_flags   = SA_NOCLDWAIT;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGCHLD, &sa, NULL);
+    }
+
+    // Non-blocking, so a client the successor or another listener's poll took first cannot leave accept() waiting
+    if(admission->drain_fd != -1 || nservers > 1)
+    {
+        for(unsigned int i = 0; i < nservers; i++)
+        {
+            int err;
+
+            if(set_nonblocking(server_fds[i], &err) == -1)
+            {
+                fprintf(stderr, "Failed to make the listener non-blocking: %s\n", strerror(err));
+            }
+        }
+    }
+
+    next = 0;
+
+    while((server_fd = await_client(server_fds, nservers, admission->drain_fd, &next)) != -1)
     {
         int   client_fd;
         pid_t pid;
 
         // Accept server to get client descriptor
+        admission_sample_queue(server_fd, metrics);
         client_fd = accept(server_fd, NULL, 0);
 
         if(client_fd == -1)
         {
-            perror("Failed to accept client connection");
+            // A successor sharing the listener may have made it non-blocking, and taken the client first
+            if(errno != EAGAIN)
+            {
+                perror("Failed to accept client connection");
+            }
             continue;
         }
 
+        // Children reaped here give their slots back, then a client over the limit is turned away instead of forked for
+        if(admission->max != 0)
+        {
+            while(waitpid(-1, NULL, WNOHANG) > 0)
+            {
+                admission_leave(admission);
+            }
+
+            if(!admission_enter(admission))
+            {
+                admission_shed(client_fd, metrics);
+                continue;
+            }
+        }
+
         // Fork a new process to handle the client
+        metrics_accept(metrics);
         pid = fork();
         if(pid < 0)
         {
             perror("Fork failed");
+            metrics_close(metrics);
+
+            if(admission->max != 0)
+            {
+                admission_leave(admission);
+            }
             close(client_fd);
             continue;
         }
 
-        if(pid == 0)
+        if(pid == 0)
+        {
+            ssize_t result;
+            int     err;
+
+            // In child process
+
+            // Close the listeners in child process (not affect parent process's listeners)
+            for(unsigned int i = 0; i < nservers; i++)
+            {
+                close(server_fds[i]);
+            }
+
+            // A child serves one client and exits, so a pool would only be set up to be thrown away
+            result = convert_copy(client_fd, BUFSIZE, NULL, timeouts, admission->drain_fd, metrics, &err);
+
+            if(result < 0)
+            {
+                copy_report_error(metrics, result, err);
+            }
+            metrics_close(metrics);
+            close(client_fd);    // Close client socket
+            exit(0);             // Terminate child process
+        }
+        // In the parent process
+        close(client_fd);
+    }
+
+    // Drained: every child finishes its client, reaped here or by the kernel, and the server exits after the last
+    while(waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+    {
+        continue;
+    }
+}
+
+// The listener with a client waiting, -1 once the server drains or a prefork child is told to; a single listener that
+// cannot be drained has nothing to wait for, accept() blocks on it. Listeners take turns, starting from *next
+static int await_client(const int *server_fds, unsigned int nservers, int drain_fd, unsigned int *next)
+{
+    struct pollfd pfds[MAX_LISTENERS + 1];
+
+    if(nservers == 1 && drain_fd == -1)
+    {
+        return server_fds[0];
+    }
+
+    // poll() skips the drain eventfd when there is none
+    memset(pfds, 0, sizeof(pfds));
+
+    for(unsigned int i = 0; i < nservers; i++)
+    {
+        pfds[i].fd     = server_fds[i];
+        pfds[i].events = POLLIN;
+    }
+    pfds[nservers].fd     = drain_fd;
+    pfds[nservers].events = POLLIN;
+
+    while(true)
+    {
+        if(poll(pfds, nservers + 1, -1) == -1)
+        {
+            if(errno != EINTR)
+            {
+                perror("Failed to wait for a client");
+            }
+            else if(drain_requested)
+            {
+                return -1;
+            }
+            continue;
+        }
+
+        if(pfds[nservers].revents & POLLIN)
+        {
+            return -1;
+        }
+
+        for(unsigned int i = 0; i < nservers; i++)
+        {
+            unsigned int listener;
+
+            listener = (*next + i) % nservers;
+
+            if(pfds[listener].revents != 0)
+            {
+                *next = (listener + 1) % nservers;
+                return server_fds[listener];
+            }
+        }
+    }
+}
+
+static int serve_workers(const int *server_fds, const struct options *opts, struct handoff *handoff, struct admission *admission, const struct copy_timeouts *timeouts, const struct metrics *metrics, int *err)
+{
+    struct worker *workers;
+    unsigned int   nopened;
+    unsigned int   nstarted;
+    bool           shared[MAX_LISTENERS];
+    int            retval;
+
+    retval   = -1;
+    nopened  = 1;
+    nstarted = 1;
+    workers  = (struct worker *)calloc(opts->workers, sizeof(*workers));
+
+    if(workers == NULL)
+    {
+        *err = errno;
+        goto done;
+    }
+
+    // Every worker gets its own SO_REUSEPORT listener per endpoint, so there is no shared accept queue to contend on.
+    // Unix sockets have no SO_REUSEPORT, nor has a listener inherited from a server that opened it without, so there
+    // the workers share one accept queue through duplicates
+    memcpy(workers[0].server_fds, server_fds, opts->nendpoints * sizeof(*server_fds));
+    workers[0].nservers = opts->nendpoints;
+
+    for(unsigned int i = 0; i < opts->nendpoints; i++)
+    {
+        shared[i] = is_unix_address(opts->endpoints[i].address) || !reuses_port(server_fds[i]);
+    }
+
+    for(unsigned int i = 0; i < opts->workers; i++)
+    {
+        workers[i].engine     = opts->engine;
+        workers[i].huge_pages = opts->huge_pages;
+        workers[i].admission  = admission;
+        workers[i].timeouts   = timeouts;
+        workers[i].metrics    = metrics_worker(metrics, i);
+    }
+
+    for(; nopened < opts->workers; nopened++)
+    {
+        struct worker *worker;
+
+        worker = &workers[nopened];
+
+        for(; worker->nservers < opts->nendpoints; worker->nservers++)
+        {
+            unsigned int i;
+
+            i                     = worker->nservers;
+            worker->server_fds[i] = shared[i] ? dup(server_fds[i]) : get_server(opts, i, handoff, err);
+
+            if(worker->server_fds[i] < 0)
+            {
+                if(shared[i])
+                {
+                    *err = errno;
+                }
+                goto cleanup;
+            }
+        }
+    }
+
+    // Every listener is open, so the server being replaced can stop accepting
+    if(handoff_ready(handoff, admission, err) == -1)
+    {
+        goto cleanup;
+    }
+
+    for(; nstarted < opts->workers; nstarted++)
+    {
+        int result;
+
+        result = pthread_create(&workers[nstarted].thread, NULL, worker_main, &workers[nstarted]);
+
+        if(result != 0)
+        {
+            *err = result;
+            break;
+        }
+    }
+
+    // The main thread serves the first listeners itself
+    if(nstarted == opts->workers)
+    {
+        retval = 0;
+        worker_main(&workers[0]);
+    }
+
+    for(unsigned int i = 1; i < nstarted; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+cleanup:
+    for(unsigned int i = 1; i < opts->workers; i++)
+    {
+        for(unsigned int j = 0; j < workers[i].nservers; j++)
+        {
+            close(workers[i].server_fds[j]);
+        }
+    }
+    free(workers);
+
+done:
+    return retval;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *worker;
+    int            result;
+
+    worker = (struct worker *)arg;
+
+    // Set up on the worker's own thread, so the pages are local to the core that uses them
+    if(pool_init(&worker->pool, worker->huge_pages, &worker->err) == -1)
+    {
+        const char *msg;
+
+        msg = strerror(worker->err);
+        printf("Error reserving buffer pool: %s\n", msg);
+        return NULL;
+    }
+
+    if(worker->engine == ENGINE_URING)
+    {
+        result = run_uring_loop(worker->server_fds, worker->nservers, BUFSIZE, &worker->pool, worker->admission, worker->timeouts, worker->metrics, &worker->err);
+    }
+    else
+    {
+        result = run_event_loop(worker->server_fds, worker->nservers, BUFSIZE, &worker->pool, worker->admission, worker->timeouts, worker->metrics, &worker->err);
+    }
+
+    if(result == -1)
+    {
+        const char *msg;
+
+        msg = strerror(worker->err);
+        printf("Error running event loop: %s\n", msg);
+    }
+    pool_report(&worker->pool, "Worker");
+    pool_destroy(&worker->pool);
+
+    return NULL;
+}
+
+static int serve_prefork(const int *server_fds, const struct options *opts, const struct admission *admission, const struct copy_timeouts *timeouts, const struct metrics *metrics, int *err)
+{
+    struct sigaction sa;
+    struct child    *children;
+    struct pollfd    drain;
+    sigset_t         block;
+    sigset_t         orig;
+    int              retval;
+
+    retval   = -1;
+    children = (struct child *)calloc(opts->workers, sizeof(*children));
+
+    if(children == NULL)
+    {
+        *err = errno;
+        goto done;
+    }
+
+    // Hold SIGCHLD until ppoll so an exit between the check and the wait is never missed
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_supervisor_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    sigprocmask(SIG_BLOCK, &block, &orig);
+
+    // Children wait on every listener at once, and the one that loses the race for a client must not block in accept()
+    if(opts->nendpoints > 1)
+    {
+        for(unsigned int i = 0; i < opts->nendpoints; i++)
+        {
+            if(set_nonblocking(server_fds[i], err) == -1)
+            {
+                goto cleanup;
+            }
+        }
+    }
+
+    for(unsigned int i = 0; i < opts->workers; i++)
+    {
+        children[i].pid     = spawn_child(server_fds, opts->nendpoints, opts->huge_pages, timeouts, admission->drain_fd, metrics_worker(metrics, i));
+        children[i].started = time(NULL);
+
+        if(children[i].pid == -1)
+        {
+            *err = errno;
+            goto cleanup;
+        }
+    }
+
+    retval = 0;
+
+    // Waits like sigsuspend(), and on the drain eventfd as well; poll() skips it when it is -1
+    memset(&drain, 0, sizeof(drain));
+    drain.fd     = admission->drain_fd;
+    drain.events = POLLIN;
+
+    while(!shutdown_requested)
+    {
+        pid_t pid;
+        int   status;
+
+        while(!child_exited && !shutdown_requested && (drain.revents & POLLIN) == 0)
+        {
+            if(ppoll(&drain, 1, NULL, &orig) == -1)
+            {
+                drain.revents = 0;
+            }
+        }
+
+        if(drain.revents & POLLIN)
+        {
+            drain_children(children, opts->workers, &orig);
+            break;
+        }
+        child_exited = 0;
+
+        // Reap every child that exited since the last wakeup and put a fresh one in its slot
+        while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            for(unsigned int i = 0; i < opts->workers; i++)
+            {
+                if(children[i].pid != pid)
+                {
+                    continue;
+                }
+
+                printf("Worker %d exited with status %d, respawning\n", (int)pid, status);
+
+                // Back off on a child that dies right away instead of spinning on fork()
+                if(time(NULL) - children[i].started < 1)
+                {
+                    sleep(1);
+                }
+
+                children[i].pid     = shutdown_requested ? -1 : spawn_child(server_fds, opts->nendpoints, opts->huge_pages, timeouts, admission->drain_fd, metrics_worker(metrics, i));
+                children[i].started = time(NULL);
+
+                if(children[i].pid == -1 && !shutdown_requested)
+                {
+                    perror("Fork failed");
+                }
+                break;
+            }
+        }
+    }
+
+cleanup:
+    for(unsigned int i = 0; i < opts->workers; i++)
+    {
+        if(children[i].pid > 0)
+        {
+            kill(children[i].pid, SIGTERM);
+            waitpid(children[i].pid, NULL, 0);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &orig, NULL);
+    free(children);
+
+done:
+    return retval;
+}
+
+// Tells every child to stop accepting once it is done with its client, and waits for the last one to exit. A child
+// signalled just before it blocks in accept() would miss it, so the signal is repeated until the child is gone
+static void drain_children(struct child *children, unsigned int count, const sigset_t *orig)
+{
+    struct timespec interval;
+    unsigned int    alive;
+
+    interval.tv_sec  = 1;
+    interval.tv_nsec = 0;
+
+    do
+    {
+        pid_t pid;
+
+        alive = 0;
+
+        while((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+        {
+            for(unsigned int i = 0; i < count; i++)
+            {
+                if(children[i].pid == pid)
+                {
+                    children[i].pid = -1;
+                }
+            }
+        }
+
+        for(unsigned int i = 0; i < count; i++)
+        {
+            if(children[i].pid > 0)
+            {
+                kill(children[i].pid, SIGUSR1);
+                alive++;
+            }
+        }
+
+        // Woken early by SIGCHLD; a SIGINT or SIGTERM instead leaves whoever is left to the caller's cleanup
+        if(alive > 0)
+        {
+            ppoll(NULL, 0, &interval, orig);
+        }
+    } while(alive > 0 && !shutdown_requested);
+}
+
+static pid_t spawn_child(const int *server_fds, unsigned int nservers, bool huge_pages, const struct copy_timeouts *timeouts, int drain_fd, struct worker_metrics *metrics)
+{
+    pid_t pid;
+
+    pid = fork();
+
+    if(pid == 0)
+    {
+        child_main(server_fds, nservers, huge_pages, timeouts, drain_fd, metrics);
+    }
+
+    return pid;
+}
+
+_Noreturn static void child_main(const int *server_fds, unsigned int nservers, bool huge_pages, const struct copy_timeouts *timeouts, int drain_fd, struct worker_metrics *metrics)
+{
+    struct sigaction   sa;
+    struct buffer_pool pool;
+    sigset_t           unblock;
+    unsigned int       next;
+    int                pool_err;
+
+    // Children are terminated by the supervisor, so restore the default dispositions
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_DFL;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    // A drain interrupts accept() or poll(): without SA_RESTART it fails with EINTR and the loop sees the flag
+    sa.sa_handler = handle_child_signal;
+    sigaction(SIGUSR1, &sa, NULL);
+    sigemptyset(&unblock);
+    sigprocmask(SIG_SETMASK, &unblock, NULL);
+
+    // Each child reuses one pool for all its clients; a child that cannot get one exits and is respawned
+    if(pool_init(&pool, huge_pages, &pool_err) == -1)
+    {
+        fprintf(stderr, "Error reserving buffer pool: %s\n", strerror(pool_err));
+        exit(EXIT_FAILURE);
+    }
+
+    // Every child blocks in accept() on the shared socket, or in poll() on all of them, and serves clients one after
+    // another until the server drains; the supervisor tells it to, so the child does not watch the drain eventfd itself
+    next = 0;
+
+    while(!drain_requested)
+    {
+        ssize_t result;
+        int     server_fd;
+        int     client_fd;
+        int     err;
+
+        server_fd = await_client(server_fds, nservers, -1, &next);
+
+        if(server_fd == -1)
+        {
+            continue;
+        }
+
+        admission_sample_queue(server_fd, metrics);
+        client_fd = accept(server_fd, NULL, 0);
+
+        if(client_fd == -1)
+        {
+            // A successor sharing the listener may have made it non-blocking, so wait for a client the way accept() would;
+            // with several listeners another child simply got there first, and the next poll() waits
+            if(errno == EAGAIN && nservers == 1)
+            {
+                struct pollfd pfd;
+
+                pfd.fd      = server_fd;
+                pfd.events  = POLLIN;
+                pfd.revents = 0;
+                poll(&pfd, 1, -1);
+            }
+            else if(errno != EINTR && errno != EAGAIN)
+            {
+                perror("Failed to accept client connection");
+            }
+            continue;
+        }
+
+        metrics_accept(metrics);
+        result = convert_copy(client_fd, BUFSIZE, &pool, timeouts, drain_fd, metrics, &err);
+
+        if(result < 0)
+        {
+            copy_report_error(metrics, result, err);
+        }
+        metrics_close(metrics);
+        metrics_pool(metrics, &pool);
+        close(client_fd);
+    }
+
+    pool_destroy(&pool);
+    exit(EXIT_SUCCESS);
+}
+
+static int serve_datagrams(const struct options *opts, struct handoff *handoff, const struct metrics *metrics, int *err)
+{
+    struct datagram_worker *workers;
+    sigset_t                block;
+    sigset_t                orig;
+    unsigned int            nstarted;
+
+    workers = (struct datagram_worker *)calloc(opts->workers, sizeof(*workers));
+
+    if(workers == NULL)
+    {
+        *err = errno;
+        return -1;
+    }
+    datagram_workers = workers;
+
+    // Signals are for the threads that serve connections: the prefork supervisor waits on SIGCHLD, which must not land here
+    sigfillset(&block);
+    pthread_sigmask(SIG_BLOCK, &block, &orig);
+
+    // Each thread gets its own socket on the port, so the kernel spreads the datagrams across them
+    for(nstarted = 0; nstarted < opts->workers; nstarted++)
+    {
+        pthread_t thread;
+        int       result;
+
+        workers[nstarted].metrics = metrics_worker(metrics, nstarted);
+        workers[nstarted].fd      = handoff_take(handoff, HANDOFF_DATAGRAM);
+
+        if(workers[nstarted].fd == -1)
+        {
+            workers[nstarted].fd = listen_datagram_socket(opts->inaddress, opts->inport, opts->workers > 1, err);
+
+            if(workers[nstarted].fd == -1)
+            {
+                break;
+            }
+            handoff_keep(handoff, workers[nstarted].fd, HANDOFF_DATAGRAM);
+        }
+
+        result = pthread_create(&thread, NULL, datagram_main, &workers[nstarted]);
+
+        if(result != 0)
+        {
+            close(workers[nstarted].fd);
+            *err = result;
+            break;
+        }
+        pthread_detach(thread);
+    }
+    pthread_sigmask(SIG_SETMASK, &orig, NULL);
+
+    // The threads that did start serve until the process exits, and keep their slots
+    if(nstarted < opts->workers)
+    {
+        if(nstarted == 0)
         {
-            // In child process
+            free(datagram_workers);
+            datagram_workers = NULL;
+        }
+        return -1;
+    }
+    printf("UDP listening on %s | PORT: %d\n", opts->inaddress, opts->inport);
 
-            // Close server_fd in child process (not affect parent process's server_fd)
-            close(server_fd);
+    return 0;
+}
 
-            // Set up network socket and get output file descriptor
-            result = convert_copy(client_fd, BUFSIZE, &err);
+static void *datagram_main(void *arg)
+{
+    struct datagram_worker *worker;
 
-            if(result == -1)
-            {
-                perror("Memory allocation error");
-            }
-            else if(result == -2)
-            {
-                perror("Read error");
-            }
-            else if(result == -3)
-            {
-                perror("Write error");
-            }
-            close(client_fd);    // Close client socket
-            exit(0);             // Terminate child process
-        }
-        // In the parent process
-        close(client_fd);
+    worker = (struct datagram_worker *)arg;
+
+    if(run_datagram_loop(worker->fd, worker->metrics, &worker->err) == -1)
+    {
+        const char *msg;
+
+        msg = strerror(worker->err);
+        printf("Error running UDP loop: %s\n", msg);
     }
+    close(worker->fd);
 
-err_in:
-    close(server_fd);
-    return EXIT_SUCCESS;
+    return NULL;
+}
+
+static void handle_supervisor_signal(int sig)
+{
+    if(sig == SIGCHLD)
+    {
+        child_exited = 1;
+    }
+    else
+    {
+        shutdown_requested = 1;
+    }
+}
+
+static void handle_child_signal(int sig)
+{
+    (void)sig;
+    drain_requested = 1;
 }
 
 static void parse_arguments(int argc, char *argv[], struct options *opts)
@@ -122,17 +1005,31 @@ static void parse_arguments(int argc, char *argv[], struct options *opts)
     struct option saved all possible options of the server program
      */
     static struct option long_options[] = {
-        {"address", required_argument, NULL, 'a'},
-        {"port",    required_argument, NULL, 'p'},
-        {"help",    no_argument,       NULL, 'h'},
-        {NULL,      0,                 NULL, 0  }
+        {"address",         required_argument, NULL, 'a'},
+        {"port",            required_argument, NULL, 'p'},
+        {"listen",          required_argument, NULL, 'l'},
+        {"engine",          required_argument, NULL, 'e'},
+        {"workers",         required_argument, NULL, 'w'},
+        {"prefork",         required_argument, NULL, 'P'},
+        {"huge-pages",      no_argument,       NULL, 'H'},
+        {"udp",             no_argument,       NULL, 'U'},
+        {"backlog",         required_argument, NULL, 'b'},
+        {"max-connections", required_argument, NULL, 'c'},
+        {"max-requests",    required_argument, NULL, 'r'},
+        {"idle-timeout",    required_argument, NULL, 'i'},
+        {"read-timeout",    required_argument, NULL, 'R'},
+        {"write-timeout",   required_argument, NULL, 'W'},
+        {"metrics",         required_argument, NULL, 'M'},
+        {"handoff",         required_argument, NULL, 'x'},
+        {"help",            no_argument,       NULL, 'h'},
+        {NULL,              0,                 NULL, 0  }
     };
     int opt;
     int err;
 
     opterr = 0;
 
-    while((opt = getopt_long(argc, argv, "ha:p:", long_options, NULL)) != -1)
+    while((opt = getopt_long(argc, argv, "hHUa:p:l:e:w:P:M:b:c:r:i:R:W:x:", long_options, NULL)) != -1)
     {
         switch(opt)
         {
@@ -152,6 +1049,120 @@ static void parse_arguments(int argc, char *argv[], struct options *opts)
                 }
                 break;
             }
+            case 'l':
+            {
+                if(opts->nendpoints == MAX_LISTENERS)
+                {
+                    usage(argv[0], EXIT_FAILURE, "at most 8 endpoints can be listened on");
+                }
+                if(convert_endpoint(optarg, &opts->endpoints[opts->nendpoints++], &err) == -1)
+                {
+                    usage(argv[0], EXIT_FAILURE, "listen takes unix:<path>, <address>[:<port>] or [<IPv6 address>][:<port>]");
+                }
+                break;
+            }
+            case 'e':
+            {
+                opts->engine = convert_engine(optarg, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "engine can only be fork, epoll, prefork or uring");
+                }
+                break;
+            }
+            case 'w':
+            {
+                opts->workers = convert_workers(optarg, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "workers must be between 1 and 1024");
+                }
+                break;
+            }
+            case 'P':
+            {
+                opts->engine  = ENGINE_PREFORK;
+                opts->workers = convert_workers(optarg, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "workers must be between 1 and 1024");
+                }
+                break;
+            }
+            case 'H':
+            {
+                opts->huge_pages = true;
+                break;
+            }
+            case 'U':
+            {
+                opts->udp = true;
+                break;
+            }
+            case 'b':
+            {
+                opts->backlog = convert_limit(optarg, 1, MAX_BACKLOG, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "backlog must be between 1 and 65535");
+                }
+                break;
+            }
+            case 'c':
+            {
+                opts->max_connections = convert_limit(optarg, 1, MAX_CONNECTION_LIMIT, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "max connections must be between 1 and 1048576");
+                }
+                break;
+            }
+            case 'r':
+            {
+                opts->max_requests = convert_limit(optarg, 1, MAX_CONNECTION_LIMIT, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "max requests must be between 1 and 1048576");
+                }
+                break;
+            }
+            case 'i':
+            {
+                opts->idle_timeout = convert_limit(optarg, 0, MAX_TIMEOUT, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "idle timeout must be between 0 and 86400 seconds");
+                }
+                break;
+            }
+            case 'R':
+            {
+                opts->read_timeout = convert_limit(optarg, 0, MAX_TIMEOUT, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "read timeout must be between 0 and 86400 seconds");
+                }
+                break;
+            }
+            case 'W':
+            {
+                opts->write_timeout = convert_limit(optarg, 0, MAX_TIMEOUT, &err);
+                if(err != ERR_NONE)
+                {
+                    usage(argv[0], EXIT_FAILURE, "write timeout must be between 0 and 86400 seconds");
+                }
+                break;
+            }
+            case 'M':
+            {
+                opts->metrics = optarg;
+                break;
+            }
+            case 'x':
+            {
+                opts->handoff = optarg;
+                break;
+            }
             case 'h':
             {
                 usage(argv[0], EXIT_SUCCESS, NULL);
@@ -159,7 +1170,7 @@ static void parse_arguments(int argc, char *argv[], struct options *opts)
             // If option is unknown
             case '?':
             {
-                if(optopt == 'a' || optopt == 'p')
+                if(optopt == 'a' || optopt == 'p' || optopt == 'l' || optopt == 'e' || optopt == 'w' || optopt == 'P' || optopt == 'M' || optopt == 'b' || optopt == 'c' || optopt == 'r' || optopt == 'i' || optopt == 'R' || optopt == 'W' || optopt == 'x')
                 {
                     char message[MISSING_OPTION_MESSAGE_LEN];
 
@@ -180,13 +1191,67 @@ static void parse_arguments(int argc, char *argv[], struct options *opts)
             }
         }
     }
+
+    // -a and -p name the first endpoint, ahead of every -l
+    if(opts->inaddress != NULL)
+    {
+        if(opts->nendpoints == MAX_LISTENERS)
+        {
+            usage(argv[0], EXIT_FAILURE, "at most 8 endpoints can be listened on");
+        }
+        memmove(&opts->endpoints[1], &opts->endpoints[0], opts->nendpoints * sizeof(opts->endpoints[0]));
+        opts->endpoints[0].address  = opts->inaddress;
+        opts->endpoints[0].port     = opts->inport;
+        opts->endpoints[0].has_port = true;
+        opts->nendpoints++;
+    }
+
+    // An endpoint given without a port listens on the -p one, wherever -p came on the command line
+    for(unsigned int i = 0; i < opts->nendpoints; i++)
+    {
+        if(!opts->endpoints[i].has_port)
+        {
+            opts->endpoints[i].port = opts->inport;
+        }
+    }
+
+    // Without -a the first endpoint is the server's address, which the admin endpoint and UDP go by
+    if(opts->inaddress == NULL && opts->nendpoints > 0)
+    {
+        opts->inaddress  = opts->endpoints[0].address;
+        opts->outaddress = opts->endpoints[0].address;
+        opts->inport     = opts->endpoints[0].port;
+        opts->outport    = opts->endpoints[0].port;
+    }
 }
 
 static void check_arguments(const char *binary_name, const struct options *opts)
 {
     if(!opts->inaddress || !opts->outaddress)
     {
-        usage(binary_name, EXIT_FAILURE, "An address is required");
+        usage(binary_name, EXIT_FAILURE, "An address or an endpoint to listen on is required");
+    }
+
+    if(opts->workers > 1 && opts->engine == ENGINE_FORK)
+    {
+        usage(binary_name, EXIT_FAILURE, "Multiple workers require the epoll or prefork engine");
+    }
+
+    if(opts->udp && is_unix_address(opts->inaddress))
+    {
+        usage(binary_name, EXIT_FAILURE, "UDP needs a network address");
+    }
+
+    // A prefork child serves one connection at a time and never turns one away, the worker count is its limit
+    if(opts->max_connections > 0 && opts->engine == ENGINE_PREFORK)
+    {
+        usage(binary_name, EXIT_FAILURE, "A connection limit requires the fork, epoll or uring engine");
+    }
+
+    // A process serving one connection only ever has its one request in flight, the connection count is its limit
+    if(opts->max_requests > 0 && (opts->engine == ENGINE_FORK || opts->engine == ENGINE_PREFORK))
+    {
+        usage(binary_name, EXIT_FAILURE, "A request limit requires the epoll or uring engine");
     }
 }
 
@@ -199,25 +1264,76 @@ _Noreturn static void usage(const char *program_name, int exit_code, const char
     }
 
     // Print the Usage message
-    fprintf(stderr, "Usage: %s [-h] [-a <address>] [-p <port>] \n", program_name);
+    fprintf(stderr, "Usage: %s [-h] [-a <address>] [-p <port>] [-l <endpoint>]... [-e <engine>] [-w <workers>] [-P <workers>] [-H] [-U] [-M <port|path>] [-b <backlog>] [-c <connections>] [-r <requests>] [-i <seconds>] [-R <seconds>] [-W <seconds>] [-x <path>]\n", program_name);
     fputs("Options:\n", stderr);
     fputs("  -h, --help                           Display this help message\n", stderr);
-    fputs("  -a <address>, --address <address>    Network socket <address>\n", stderr);
+    fputs("  -a <address>, --address <address>    Network socket <address>, or unix:/path or unix:@name\n", stderr);
     fputs("  -p <port>, --address <address>       Network socket (PORT) <address>\n", stderr);
+    fputs("  -l, --listen <endpoint>              Also listen on unix:<path>, <address>[:<port>] or [<IPv6 address>][:<port>],\n", stderr);
+    fputs("                                       up to 8 in all with -a; the same workers serve every one. An IPv6 address\n", stderr);
+    fputs("                                       takes IPv6 clients only when 0.0.0.0 is listened on with the same port\n", stderr);
+    fputs("  -e <engine>, --engine <engine>       Connection engine (fork, epoll, prefork or uring, default fork)\n", stderr);
+    fputs("  -w <workers>, --workers <workers>    Number of event loop threads or prefork processes (default 1)\n", stderr);
+    fputs("  -P <workers>, --prefork <workers>    Same as -e prefork -w <workers>\n", stderr);
+    fputs("  -H, --huge-pages                     Back the per-worker buffer pools with huge pages\n", stderr);
+    fputs("  -U, --udp                            Also answer one request per UDP datagram on the same port, one thread per worker;\n", stderr);
+    fputs("                                       a reply may be no longer than its request, others are dropped\n", stderr);
+    fputs("  -M, --metrics <port|path>            Serve Prometheus metrics on this TCP port or Unix socket\n", stderr);
+    fputs("  -b, --backlog <backlog>              Connections the kernel queues for accept (default 5)\n", stderr);
+    fputs("  -c, --max-connections <connections>  Connections served at once; more are answered BUSY and closed (default no limit;\n", stderr);
+    fputs("                                       prefork serves as many as it has workers and takes no -c)\n", stderr);
+    fputs("  -r, --max-requests <requests>        Requests in flight at once, from their first byte until their reply is out; a\n", stderr);
+    fputs("                                       connection starting one more is answered BUSY and closed (epoll and uring only,\n", stderr);
+    fputs("                                       default no limit)\n", stderr);
+    fputs("  -i, --idle-timeout <seconds>         Close a connection that sends no request for this long, 0 never (default 60)\n", stderr);
+    fputs("  -R, --read-timeout <seconds>         Close a connection whose request takes longer to arrive, 0 never (default 10)\n", stderr);
+    fputs("  -W, --write-timeout <seconds>        Close a connection that takes none of its reply for this long, 0 never (default 30)\n", stderr);
+    fputs("  -x, --handoff <path>                 Take the sockets over from a server running with the same path, and hand them on\n", stderr);
+    fputs("                                       to the next one started with it; the old server then drains and exits\n", stderr);
     exit(exit_code);
 }
 
-static int get_server(const struct options *opts, int *err)
+// A listener for every endpoint, or none: those already open are closed again when one fails
+static int get_servers(const struct options *opts, struct handoff *handoff, int *server_fds, int *err)
 {
-    int server_fd;
+    for(unsigned int i = 0; i < opts->nendpoints; i++)
+    {
+        server_fds[i] = get_server(opts, i, handoff, err);
 
-    if(opts->inaddress != NULL)
+        if(server_fds[i] < 0)
+        {
+            fprintf(stderr, "Cannot listen on %s\n", opts->endpoints[i].address);
+
+            while(i-- > 0)
+            {
+                close(server_fds[i]);
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// An inherited listener bound to the endpoint is served as it is, it is the one clients already connect to
+static int get_server(const struct options *opts, unsigned int endpoint, struct handoff *handoff, int *err)
+{
+    const struct endpoint *where;
+    int                    server_fd;
+
+    where     = &opts->endpoints[endpoint];
+    server_fd = handoff_take_bound(handoff, HANDOFF_LISTENER, where->address, where->port);
+
+    if(server_fd != -1)
     {
-        server_fd = listen_network_socket_client(opts->inaddress, opts->inport, BACKLOG, err);
+        return server_fd;
     }
-    else
+
+    server_fd = listen_network_socket_client(where->address, where->port, (int)opts->backlog, (opts->engine == ENGINE_EPOLL || opts->engine == ENGINE_URING) && opts->workers > 1, shares_ipv4_wildcard(opts, endpoint), err);
+
+    if(server_fd != -1)
     {
-        server_fd = -1;
+        handoff_keep(handoff, server_fd, HANDOFF_LISTENER);
     }
 
     return server_fd;
@@ -260,3 +1376,169 @@ static in_port_t convert_port(const char *str, int *err)
 done:
     return port;
 }
+
+// Splits <address>:<port> or [<IPv6 address>]:<port> in place; a Unix path is taken whole, colons and all, and an
+// address with more than one colon and no brackets is a bare IPv6 one
+static int convert_endpoint(char *str, struct endpoint *endpoint, int *err)
+{
+    char *colon;
+
+    *err               = ERR_NONE;
+    endpoint->address  = str;
+    endpoint->port     = 0;
+    endpoint->has_port = false;
+
+    if(is_unix_address(str))
+    {
+        return 0;
+    }
+
+    if(str[0] == '[')
+    {
+        char *end;
+
+        end = strchr(str, ']');
+
+        if(end == NULL || end == str + 1 || (end[1] != ':' && end[1] != '\0'))
+        {
+            *err = ERR_INVALID_CHARS;
+            return -1;
+        }
+        *end              = '\0';
+        endpoint->address = str + 1;
+        colon             = end[1] == ':' ? end + 1 : NULL;
+    }
+    else
+    {
+        colon = strchr(str, ':');
+
+        if(colon != NULL && strchr(colon + 1, ':') != NULL)
+        {
+            colon = NULL;
+        }
+    }
+
+    if(colon != NULL)
+    {
+        *colon             = '\0';
+        endpoint->port     = convert_port(colon + 1, err);
+        endpoint->has_port = true;
+    }
+
+    if(endpoint->address[0] == '\0')
+    {
+        *err = ERR_NO_DIGITS;
+    }
+
+    return *err == ERR_NONE ? 0 : -1;
+}
+
+// Whether an IPv6 endpoint has to leave IPv4 to a 0.0.0.0 endpoint on the same port, which its dual-stack bind would take
+static bool shares_ipv4_wildcard(const struct options *opts, unsigned int endpoint)
+{
+    struct in6_addr ipv6_addr;
+
+    if(inet_pton(AF_INET6, opts->endpoints[endpoint].address, &ipv6_addr) != 1)
+    {
+        return false;
+    }
+
+    for(unsigned int i = 0; i < opts->nendpoints; i++)
+    {
+        struct in_addr ipv4_addr;
+
+        if(opts->endpoints[i].port == opts->endpoints[endpoint].port && inet_pton(AF_INET, opts->endpoints[i].address, &ipv4_addr) == 1 && ipv4_addr.s_addr == htonl(INADDR_ANY))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static enum server_engine convert_engine(const char *str, int *err)
+{
+    *err = ERR_NONE;
+
+    if(strcmp(str, "epoll") == 0)
+    {
+        return ENGINE_EPOLL;
+    }
+
+    if(strcmp(str, "uring") == 0)
+    {
+        return ENGINE_URING;
+    }
+
+    if(strcmp(str, "prefork") == 0)
+    {
+        return ENGINE_PREFORK;
+    }
+
+    if(strcmp(str, "fork") != 0)
+    {
+        *err = ERR_INVALID_CHARS;
+    }
+
+    return ENGINE_FORK;
+}
+
+static unsigned int convert_workers(const char *str, int *err)
+{
+    char *endptr;
+    long  val;
+
+    *err  = ERR_NONE;
+    errno = 0;
+    val   = strtol(str, &endptr, 10);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+    if(endptr == str)
+    {
+        *err = ERR_NO_DIGITS;
+        return 0;
+    }
+
+    if(val < 1 || val > MAX_WORKERS)
+    {
+        *err = ERR_OUT_OF_RANGE;
+        return 0;
+    }
+
+    if(*endptr != '\0')
+    {
+        *err = ERR_INVALID_CHARS;
+        return 0;
+    }
+
+    return (unsigned int)val;
+}
+
+static unsigned int convert_limit(const char *str, long min, long max, int *err)
+{
+    char *endptr;
+    long  val;
+
+    *err  = ERR_NONE;
+    errno = 0;
+    val   = strtol(str, &endptr, 10);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+    if(endptr == str)
+    {
+        *err = ERR_NO_DIGITS;
+        return 0;
+    }
+
+    if(val < min || val > max)
+    {
+        *err = ERR_OUT_OF_RANGE;
+        return 0;
+    }
+
+    if(*endptr != '\0')
+    {
+        *err = ERR_INVALID_CHARS;
+        return 0;
+    }
+
+    return (unsigned int)val;
+}
@@ -0,0 +1,218 @@
+#include "../include/timer.h"
+
+#define TIMER_SLOT_MASK (TIMER_SLOTS - 1)
+
+// Ticks the wheel can tell apart; anything farther out waits in the last level until it comes within reach
+#define TIMER_RANGE ((uint64_t)1 << (TIMER_LEVEL_SHIFT * TIMER_LEVELS))
+
+static void timer_link(struct timer_wheel *wheel, struct timer *timer);
+static void timer_unlink(struct timer *timer);
+static void timer_cascade(struct timer_wheel *wheel, unsigned int level, unsigned int index);
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t now)
+{
+    for(unsigned int level = 0; level < TIMER_LEVELS; level++)
+    {
+        for(unsigned int index = 0; index < TIMER_SLOTS; index++)
+        {
+            wheel->slots[level][index].next    = &wheel->slots[level][index];
+            wheel->slots[level][index].prev    = &wheel->slots[level][index];
+            wheel->slots[level][index].expires = 0;
+        }
+    }
+
+    wheel->next    = now >> TIMER_TICK_SHIFT;
+    wheel->pending = 0;
+}
+
+void timer_init(struct timer *timer)
+{
+    timer->next    = NULL;
+    timer->prev    = NULL;
+    timer->expires = 0;
+}
+
+bool timer_pending(const struct timer *timer)
+{
+    return timer->prev != NULL;
+}
+
+void timer_schedule(struct timer_wheel *wheel, struct timer *timer, uint64_t deadline)
+{
+    uint64_t expires;
+
+    expires = (deadline + ((uint64_t)1 << TIMER_TICK_SHIFT) - 1) >> TIMER_TICK_SHIFT;
+
+    // Connections push their deadline on every event, most often to a tick they are already filed under
+    if(timer_pending(timer))
+    {
+        if(timer->expires == expires)
+        {
+            return;
+        }
+        timer_unlink(timer);
+        wheel->pending--;
+    }
+
+    timer->expires = expires;
+    timer_link(wheel, timer);
+    wheel->pending++;
+}
+
+void timer_cancel(struct timer_wheel *wheel, struct timer *timer)
+{
+    if(timer_pending(timer))
+    {
+        timer_unlink(timer);
+        wheel->pending--;
+    }
+}
+
+// Returns the timers due by now, linked through next; none of them is pending any more
+struct timer *timer_expire(struct timer_wheel *wheel, uint64_t now)
+{
+    struct timer  *expired;
+    struct timer **tail;
+    uint64_t       target;
+
+    expired = NULL;
+    tail    = &expired;
+    target  = now >> TIMER_TICK_SHIFT;
+
+    while(wheel->next <= target)
+    {
+        struct timer *slot;
+        unsigned int  index;
+
+        // An empty wheel has nothing to catch up on, however long the loop slept
+        if(wheel->pending == 0)
+        {
+            wheel->next = target + 1;
+            break;
+        }
+
+        // Each time a level comes round, the next slot of the level above is spread over it
+        index = (unsigned int)(wheel->next & TIMER_SLOT_MASK);
+
+        for(unsigned int level = 1; index == 0 && level < TIMER_LEVELS; level++)
+        {
+            index = (unsigned int)((wheel->next >> (TIMER_LEVEL_SHIFT * level)) & TIMER_SLOT_MASK);
+            timer_cascade(wheel, level, index);
+        }
+
+        slot = &wheel->slots[0][wheel->next & TIMER_SLOT_MASK];
+
+        while(slot->next != slot)
+        {
+            struct timer *timer;
+
+            timer = slot->next;
+            timer_unlink(timer);
+            wheel->pending--;
+            *tail = timer;
+            tail  = &timer->next;
+        }
+        wheel->next++;
+    }
+
+    *tail = NULL;
+
+    return expired;
+}
+
+// Nanoseconds until timer_expire() has something to do, -1 while nothing is pending. Only the current round of the
+// first level is searched: the start of the next round is as far as it looks, a slot from above comes down there
+int64_t timer_wait(const struct timer_wheel *wheel, uint64_t now)
+{
+    uint64_t tick;
+    uint64_t at;
+
+    if(wheel->pending == 0)
+    {
+        return -1;
+    }
+
+    for(tick = wheel->next;; tick++)
+    {
+        const struct timer *slot;
+
+        slot = &wheel->slots[0][tick & TIMER_SLOT_MASK];
+
+        if((tick & TIMER_SLOT_MASK) == 0 || slot->next != slot)
+        {
+            break;
+        }
+    }
+
+    at = tick << TIMER_TICK_SHIFT;
+
+    return at > now ? (int64_t)(at - now) : 0;
+}
+
+static void timer_link(struct timer_wheel *wheel, struct timer *timer)
+{
+    struct timer *slot;
+    uint64_t      expires;
+    uint64_t      delta;
+    unsigned int  level;
+
+    // A deadline already past fires on the next tick processed
+    expires = timer->expires < wheel->next ? wheel->next : timer->expires;
+    delta   = expires - wheel->next;
+
+    if(delta >= TIMER_RANGE)
+    {
+        expires = wheel->next + TIMER_RANGE - 1;
+        delta   = TIMER_RANGE - 1;
+    }
+
+    // The lowest level whose whole span still reaches the deadline
+    level = 0;
+    while(level < TIMER_LEVELS - 1 && delta >= ((uint64_t)1 << (TIMER_LEVEL_SHIFT * (level + 1))))
+    {
+        level++;
+    }
+
+    slot             = &wheel->slots[level][(expires >> (TIMER_LEVEL_SHIFT * level)) & TIMER_SLOT_MASK];
+    timer->next      = slot;
+    timer->prev      = slot->prev;
+    slot->prev->next = timer;
+    slot->prev       = timer;
+}
+
+static void timer_unlink(struct timer *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next       = NULL;
+    timer->prev       = NULL;
+}
+
+// Files every timer of one slot again, which puts each on a level closer to firing
+static void timer_cascade(struct timer_wheel *wheel, unsigned int level, unsigned int index)
+{
+    struct timer *slot;
+    struct timer *timer;
+
+    slot = &wheel->slots[level][index];
+
+    if(slot->next == slot)
+    {
+        return;
+    }
+
+    // Take the whole list first, so a timer filed back into this slot is not visited twice
+    timer            = slot->next;
+    slot->prev->next = NULL;
+    slot->next       = slot;
+    slot->prev       = slot;
+
+    while(timer != NULL)
+    {
+        struct timer *next;
+
+        next = timer->next;
+        timer_link(wheel, timer);
+        timer = next;
+    }
+}
@@ -0,0 +1,472 @@
+#include "../include/transform.h"
+#include "../include/ascii.h"
+#include "../include/utf8.h"
+#include <string.h>
+
+#define ASCII_LETTERS 26
+#define ASCII_CASE_BIT 0x20
+#define ASCII_HIGH 0x80
+#define ROT13_SHIFT 13
+#define HEX_DIGITS 10
+#define HEX_LETTERS 6
+#define HEX_BITS 4
+#define HEX_MASK 0x0F
+#define BASE64_BITS 6
+#define BASE64_MASK 0x3F
+#define BASE64_PAD '='
+#define BASE64_PLUS 62
+#define BASE64_SLASH 63
+
+static size_t   apply_none(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev);
+static size_t   apply_upper(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev);
+static size_t   apply_lower(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev);
+static size_t   apply_title(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev);
+static size_t   apply_swap(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev);
+static size_t   apply_rot13(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev);
+static size_t   apply_reverse(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev);
+static size_t   apply_hex_encode(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev);
+static size_t   apply_hex_decode(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev);
+static size_t   apply_base64_encode(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev);
+static size_t   apply_base64_decode(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev);
+static void     map_multibyte(uint8_t *data, size_t len, uint32_t (*map)(uint32_t cp));
+static uint32_t swap_case(uint32_t cp);
+static bool     is_letter(uint8_t c);
+static bool     is_word(uint8_t c);
+static int      hex_value(uint8_t c);
+static int      base64_value(uint8_t c);
+
+// Opcodes are positions in this table, so new transforms go at the end to keep existing clients working
+static const struct transform transforms[] = {
+    {"none",     apply_none,          1, 1, false},
+    {"upper",    apply_upper,         1, 1, true },
+    {"lower",    apply_lower,         1, 1, true },
+    {"title",    apply_title,         1, 1, true },
+    {"swap",     apply_swap,          1, 1, true },
+    {"rot13",    apply_rot13,         1, 1, false},
+    {"reverse",  apply_reverse,       0, 0, false},
+    {"hex",      apply_hex_encode,    1, 2, false},
+    {"unhex",    apply_hex_decode,    2, 1, false},
+    {"base64",   apply_base64_encode, 3, 4, false},
+    {"unbase64", apply_base64_decode, 4, 3, false},
+};
+
+static const char hex_digits[]    = "0123456789abcdef";
+static const char base64_digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+const struct transform *transform_find(const char *name, size_t len)
+{
+    for(size_t i = 0; i < sizeof(transforms) / sizeof(transforms[0]); i++)
+    {
+        if(strlen(transforms[i].name) == len && memcmp(transforms[i].name, name, len) == 0)
+        {
+            return &transforms[i];
+        }
+    }
+
+    return NULL;
+}
+
+const struct transform *transform_get(unsigned int opcode)
+{
+    if(opcode >= transform_count())
+    {
+        return NULL;
+    }
+
+    return &transforms[opcode];
+}
+
+unsigned int transform_count(void)
+{
+    return (unsigned int)(sizeof(transforms) / sizeof(transforms[0]));
+}
+
+uint8_t transform_opcode(const struct transform *transform)
+{
+    return (uint8_t)(transform - transforms);
+}
+
+size_t transform_max_output(const struct transform *transform, size_t len)
+{
+    if(transform->in_block == 0)
+    {
+        return len;
+    }
+
+    return (len + transform->in_block - 1) / transform->in_block * transform->out_block;
+}
+
+bool transform_resizes(const struct transform *transform)
+{
+    return transform->in_block != transform->out_block;
+}
+
+static size_t apply_none(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev)
+{
+    (void)prev;
+
+    if(dst != src)
+    {
+        memcpy(dst, src, len);
+    }
+
+    return len;
+}
+
+// The vector kernels convert every ASCII letter in one pass, only text that also holds other bytes goes through the Unicode tables
+static size_t apply_upper(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev)
+{
+    apply_none(dst, src, len, prev);
+
+    if(ascii_upper(dst, len))
+    {
+        map_multibyte(dst, len, utf8_upper);
+    }
+
+    return len;
+}
+
+static size_t apply_lower(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev)
+{
+    apply_none(dst, src, len, prev);
+
+    if(ascii_lower(dst, len))
+    {
+        map_multibyte(dst, len, utf8_lower);
+    }
+
+    return len;
+}
+
+static size_t apply_swap(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev)
+{
+    apply_none(dst, src, len, prev);
+
+    if(ascii_swap(dst, len))
+    {
+        map_multibyte(dst, len, swap_case);
+    }
+
+    return len;
+}
+
+static size_t apply_title(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev)
+{
+    bool in_word;
+
+    // A letter starts a word unless it follows another letter, digit or apostrophe, which may be in the previous chunk.
+    // Chunks never split a character, so a non-ASCII prev ends one; taking it for a letter is right far more often than not
+    in_word = prev >= ASCII_HIGH || is_word(prev);
+
+    for(size_t i = 0; i < len;)
+    {
+        uint32_t cp;
+        uint8_t  c;
+        size_t   n;
+
+        c = src[i];
+
+        if(c < ASCII_HIGH)
+        {
+            if(is_letter(c))
+            {
+                c = in_word ? (uint8_t)(c | ASCII_CASE_BIT) : (uint8_t)(c & ~ASCII_CASE_BIT);
+            }
+            in_word = is_word(c);
+            dst[i]  = c;
+            i++;
+            continue;
+        }
+
+        n = utf8_decode(src + i, len - i, &cp);
+
+        // Malformed bytes pass through as they are
+        if(n == 0)
+        {
+            dst[i] = c;
+            i++;
+            continue;
+        }
+
+        utf8_encode(dst + i, n, in_word ? utf8_lower(cp) : utf8_upper(cp));
+        in_word = utf8_is_word(cp);
+        i += n;
+    }
+
+    return len;
+}
+
+static size_t apply_rot13(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev)
+{
+    (void)prev;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        uint8_t c;
+        uint8_t lower;
+
+        c     = src[i];
+        lower = (uint8_t)(c | ASCII_CASE_BIT);
+
+        if(is_letter(c))
+        {
+            c = lower < 'a' + ROT13_SHIFT ? (uint8_t)(c + ROT13_SHIFT) : (uint8_t)(c - ROT13_SHIFT);
+        }
+        dst[i] = c;
+    }
+
+    return len;
+}
+
+static size_t apply_reverse(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev)
+{
+    (void)prev;
+
+    if(dst == src)
+    {
+        for(size_t i = 0; i < len / 2; i++)
+        {
+            uint8_t c;
+
+            c                = dst[i];
+            dst[i]           = dst[len - 1 - i];
+            dst[len - 1 - i] = c;
+        }
+    }
+    else
+    {
+        for(size_t i = 0; i < len; i++)
+        {
+            dst[i] = src[len - 1 - i];
+        }
+    }
+
+    return len;
+}
+
+static size_t apply_hex_encode(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev)
+{
+    (void)prev;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        dst[i * 2]     = (uint8_t)hex_digits[src[i] >> HEX_BITS];
+        dst[i * 2 + 1] = (uint8_t)hex_digits[src[i] & HEX_MASK];
+    }
+
+    return len * 2;
+}
+
+// Writes never overtake reads, so this also works in place
+static size_t apply_hex_decode(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev)
+{
+    (void)prev;
+
+    if(len % 2 != 0)
+    {
+        return TRANSFORM_INVALID;
+    }
+
+    for(size_t i = 0; i < len / 2; i++)
+    {
+        int high;
+        int low;
+
+        high = hex_value(src[i * 2]);
+        low  = hex_value(src[i * 2 + 1]);
+
+        if(high < 0 || low < 0)
+        {
+            return TRANSFORM_INVALID;
+        }
+        dst[i] = (uint8_t)(high << HEX_BITS | low);
+    }
+
+    return len / 2;
+}
+
+static size_t apply_base64_encode(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev)
+{
+    size_t i;
+    size_t n;
+
+    (void)prev;
+    n = 0;
+
+    // Three input bytes make 24 bits, four output digits of six bits each
+    for(i = 0; i + 3 <= len; i += 3)
+    {
+        uint32_t bits;
+
+        bits     = (uint32_t)src[i] << 16 | (uint32_t)src[i + 1] << 8 | src[i + 2];    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+        dst[n++] = (uint8_t)base64_digits[bits >> 18];                                  // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+        dst[n++] = (uint8_t)base64_digits[bits >> 12 & BASE64_MASK];                    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+        dst[n++] = (uint8_t)base64_digits[bits >> BASE64_BITS & BASE64_MASK];
+        dst[n++] = (uint8_t)base64_digits[bits & BASE64_MASK];
+    }
+
+    if(i < len)
+    {
+        uint32_t bits;
+
+        bits     = (uint32_t)src[i] << 16 | (i + 1 < len ? (uint32_t)src[i + 1] << 8 : 0);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+        dst[n++] = (uint8_t)base64_digits[bits >> 18];                                           // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+        dst[n++] = (uint8_t)base64_digits[bits >> 12 & BASE64_MASK];                             // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+        dst[n++] = i + 1 < len ? (uint8_t)base64_digits[bits >> BASE64_BITS & BASE64_MASK] : BASE64_PAD;
+        dst[n++] = BASE64_PAD;
+    }
+
+    return n;
+}
+
+// Each block is read whole before its three bytes are written, so this also works in place
+static size_t apply_base64_decode(uint8_t *dst, const uint8_t *src, size_t len, uint8_t prev)
+{
+    size_t n;
+
+    (void)prev;
+    n = 0;
+
+    if(len % 4 != 0)
+    {
+        return TRANSFORM_INVALID;
+    }
+
+    for(size_t i = 0; i < len; i += 4)
+    {
+        int      digits[4];
+        size_t   pad;
+        uint32_t bits;
+
+        // Padding is only allowed at the very end: "xx==" or "xxx="
+        pad = 0;
+        if(i + 4 == len && src[i + 3] == BASE64_PAD)
+        {
+            pad = src[i + 2] == BASE64_PAD ? 2 : 1;
+        }
+
+        bits = 0;
+        for(size_t j = 0; j < 4 - pad; j++)
+        {
+            digits[j] = base64_value(src[i + j]);
+
+            if(digits[j] < 0)
+            {
+                return TRANSFORM_INVALID;
+            }
+            bits |= (uint32_t)digits[j] << (BASE64_BITS * (3 - j));
+        }
+
+        dst[n++] = (uint8_t)(bits >> 16);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+        if(pad < 2)
+        {
+            dst[n++] = (uint8_t)(bits >> 8);    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+        }
+        if(pad < 1)
+        {
+            dst[n++] = (uint8_t)bits;
+        }
+    }
+
+    return n;
+}
+
+// Maps every well-formed multibyte character in place, skipping the runs of ASCII between them a vector at a time
+static void map_multibyte(uint8_t *data, size_t len, uint32_t (*map)(uint32_t cp))
+{
+    for(size_t i = 0; i < len;)
+    {
+        uint32_t cp;
+        uint32_t mapped;
+        size_t   n;
+
+        i += ascii_span(data + i, len - i);
+
+        if(i == len)
+        {
+            break;
+        }
+
+        n = utf8_decode(data + i, len - i, &cp);
+
+        // Malformed bytes pass through as they are
+        if(n == 0)
+        {
+            i++;
+            continue;
+        }
+
+        mapped = map(cp);
+
+        if(mapped != cp)
+        {
+            utf8_encode(data + i, n, mapped);
+        }
+        i += n;
+    }
+}
+
+static uint32_t swap_case(uint32_t cp)
+{
+    uint32_t upper;
+
+    upper = utf8_upper(cp);
+
+    return upper != cp ? upper : utf8_lower(cp);
+}
+
+static bool is_letter(uint8_t c)
+{
+    return (uint8_t)((c | ASCII_CASE_BIT) - 'a') < ASCII_LETTERS;
+}
+
+static bool is_word(uint8_t c)
+{
+    return is_letter(c) || (uint8_t)(c - '0') < HEX_DIGITS || c == '\'';
+}
+
+static int hex_value(uint8_t c)
+{
+    if((uint8_t)(c - '0') < HEX_DIGITS)
+    {
+        return c - '0';
+    }
+
+    c |= ASCII_CASE_BIT;
+    if((uint8_t)(c - 'a') < HEX_LETTERS)
+    {
+        return c - 'a' + HEX_DIGITS;
+    }
+
+    return -1;
+}
+
+static int base64_value(uint8_t c)
+{
+    if((uint8_t)(c - 'A') < ASCII_LETTERS)
+    {
+        return c - 'A';
+    }
+
+    if((uint8_t)(c - 'a') < ASCII_LETTERS)
+    {
+        return c - 'a' + ASCII_LETTERS;
+    }
+
+    if((uint8_t)(c - '0') < HEX_DIGITS)
+    {
+        return c - '0' + 2 * ASCII_LETTERS;
+    }
+
+    if(c == '+')
+    {
+        return BASE64_PLUS;
+    }
+
+    if(c == '/')
+    {
+        return BASE64_SLASH;
+    }
+
+    return -1;
+}
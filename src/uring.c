@@ -0,0 +1,933 @@
+#include "../include/uring.h"
+#include "../include/copy.h"
+#include "../include/timer.h"
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_IO_URING
+    #include <fcntl.h>
+    #include <linux/io_uring.h>
+    #include <poll.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+    #include <sys/syscall.h>
+    #include <unistd.h>
+
+// Provided buffer group every receive selects from
+    #define URING_BUFFER_GROUP 0
+
+// user_data values that do not point at a connection
+    #define URING_TAG_CLOSE 1
+    #define URING_TAG_CANCEL 2
+    #define URING_TAG_DRAIN 3
+    #define URING_TAG_ACCEPT 4    // Plus the index of the listener the accept is on
+
+    #define NSEC_PER_SEC 1000000000LL
+
+// The single operation a connection has in flight
+enum uring_op
+{
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_SPLICE
+};
+
+struct uring_conn
+{
+    struct copy_state  copy;
+    struct msghdr      msg;          // Describes the pieces of a send, which the kernel may read after submission
+    struct timer       timer;        // Deadline of whatever the connection is waiting for
+    struct uring_conn *prev;
+    struct uring_conn *next;
+    enum uring_op      op;
+    bool               timed_out;     // Its operation is being cancelled, the connection closes when it comes back
+    bool               drained;       // Its idle receive is being cancelled because the server drains
+    bool               requesting;    // Holds one of the admission's request slots
+};
+
+// Mapped submission/completion rings plus the provided receive buffers
+struct uring
+{
+    int                         ring_fd;
+    int                        *server_fds;
+    unsigned int                nservers;
+    bool                        multishot_accept;
+    unsigned int                multishot_refused;    // Listeners whose multishot accept the kernel turned down
+    unsigned int                sq_entries;
+    unsigned int               *sq_head;
+    unsigned int               *sq_tail;
+    unsigned int               *sq_mask;
+    unsigned int                sq_local_tail;
+    unsigned int               *cq_head;
+    unsigned int               *cq_tail;
+    unsigned int               *cq_mask;
+    struct io_uring_sqe        *sqes;
+    struct io_uring_cqe        *cqes;
+    void                       *sq_ring;
+    size_t                      sq_ring_len;
+    void                       *cq_ring;
+    size_t                      cq_ring_len;
+    size_t                      sqes_len;
+    struct io_uring_buf_ring   *buf_ring;
+    size_t                      buf_ring_len;
+    uint8_t                    *bufs;
+    size_t                      buf_size;
+    struct buffer_pool         *pool;
+    struct admission           *admission;
+    const struct copy_timeouts *timeouts;
+    struct worker_metrics      *metrics;
+    struct uring_conn          *conns;    // Every open connection, walked only when the server drains
+    bool                        draining;
+    struct timer_wheel          wheel;
+    uint64_t                    now;    // When the completions being handled were reaped
+    uint16_t                    buf_tail;
+};
+
+static int                  ring_init(struct uring *ring, size_t bufsize, int *err);
+static void                 ring_destroy(struct uring *ring);
+static int                  ring_submit(struct uring *ring, unsigned int wait_nr, int64_t wait_ns, int *err);
+static struct io_uring_sqe *ring_get_sqe(struct uring *ring);
+static void                 ring_recycle_buffer(struct uring *ring, uint16_t bid);
+static void                 reap_completions(struct uring *ring);
+static void                 queue_accept(struct uring *ring, unsigned int listener);
+static void                 queue_drain(struct uring *ring);
+static bool                 queue_cancel(struct uring *ring, uint64_t user_data);
+static void                 queue_recv(struct uring *ring, struct uring_conn *conn);
+static void                 queue_send(struct uring *ring, struct uring_conn *conn);
+static void                 queue_splice(struct uring *ring, struct uring_conn *conn);
+static void                 handle_accept(struct uring *ring, unsigned int listener, int res, uint32_t flags);
+static void                 handle_conn(struct uring *ring, struct uring_conn *conn, int res, uint32_t flags);
+static void                 advance_conn(struct uring *ring, struct uring_conn *conn);
+static void                 expire_conns(struct uring *ring);
+static void                 start_drain(struct uring *ring);
+static void                 close_conn(struct uring *ring, struct uring_conn *conn);
+
+bool uring_supported(size_t bufsize)
+{
+    struct uring ring;
+    int          err;
+
+    if(ring_init(&ring, bufsize, &err) == -1)
+    {
+        return false;
+    }
+    ring_destroy(&ring);
+
+    return true;
+}
+
+int run_uring_loop(int *server_fds, unsigned int nservers, size_t bufsize, struct buffer_pool *pool, struct admission *admission, const struct copy_timeouts *timeouts, struct worker_metrics *metrics, int *err)
+{
+    struct uring ring;
+
+    if(ring_init(&ring, bufsize, err) == -1)
+    {
+        return -1;
+    }
+    ring.server_fds = server_fds;
+    ring.nservers   = nservers;
+    ring.pool       = pool;
+    ring.admission  = admission;
+    ring.timeouts   = timeouts;
+    ring.metrics    = metrics;
+    ring.now        = metrics_now();
+    timer_wheel_init(&ring.wheel, ring.now);
+
+    for(unsigned int i = 0; i < nservers; i++)
+    {
+        queue_accept(&ring, i);
+    }
+
+    if(admission->drain_fd != -1)
+    {
+        queue_drain(&ring);
+    }
+
+    // Once draining, the loop ends with its last connection
+    while(!ring.draining || ring.conns != NULL)
+    {
+        // One io_uring_enter both submits everything queued since the last pass and waits for completions, or the next deadline
+        if(ring_submit(&ring, 1, timer_wait(&ring.wheel, ring.now), err) == -1)
+        {
+            ring_destroy(&ring);
+            return -1;
+        }
+
+        ring.now = metrics_now();
+        reap_completions(&ring);
+        expire_conns(&ring);
+        metrics_pool(ring.metrics, ring.pool);
+    }
+
+    // The last connections were closed through the ring, those closes still have to reach the kernel
+    if(ring_submit(&ring, 0, -1, err) == -1)
+    {
+        ring_destroy(&ring);
+        return -1;
+    }
+    ring_destroy(&ring);
+
+    return 0;
+}
+
+static int ring_init(struct uring *ring, size_t bufsize, int *err)
+{
+    struct io_uring_params  params;
+    struct io_uring_buf_reg reg;
+    unsigned int           *sq_array;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->multishot_accept = true;
+    ring->buf_size         = bufsize;
+    ring->ring_fd          = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+
+    if(ring->ring_fd == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    // Waits are bounded by the next deadline through the extended enter argument (5.11), which a ring with provided
+    // buffer rings (5.19) always has; checked all the same so a kernel without it falls back to epoll
+    if(!(params.features & IORING_FEAT_EXT_ARG))
+    {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    ring->sq_entries  = params.sq_entries;
+    ring->sq_ring_len = params.sq_off.array + (params.sq_entries * sizeof(unsigned int));
+    ring->cq_ring_len = params.cq_off.cqes + (params.cq_entries * sizeof(struct io_uring_cqe));
+    ring->sqes_len    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->cq_ring_len > ring->sq_ring_len)
+        {
+            ring->sq_ring_len = ring->cq_ring_len;
+        }
+        ring->cq_ring_len = ring->sq_ring_len;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+
+    if(ring->sq_ring == MAP_FAILED)
+    {
+        ring->sq_ring = NULL;
+        goto fail;
+    }
+
+    if(params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ring = ring->sq_ring;
+    }
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+
+        if(ring->cq_ring == MAP_FAILED)
+        {
+            ring->cq_ring = NULL;
+            goto fail;
+        }
+    }
+
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+
+    if(ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        goto fail;
+    }
+
+    ring->sq_head = (unsigned int *)(void *)((uint8_t *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(void *)((uint8_t *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(void *)((uint8_t *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->cq_head = (unsigned int *)(void *)((uint8_t *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(void *)((uint8_t *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(void *)((uint8_t *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes    = (struct io_uring_cqe *)(void *)((uint8_t *)ring->cq_ring + params.cq_off.cqes);
+    sq_array      = (unsigned int *)(void *)((uint8_t *)ring->sq_ring + params.sq_off.array);
+
+    // SQEs are always used in ring order, so the indirection array is the identity
+    for(unsigned int i = 0; i < params.sq_entries; i++)
+    {
+        sq_array[i] = i;
+    }
+    ring->sq_local_tail = *ring->sq_tail;
+
+    // Receives pick a buffer from this ring only once data has arrived, so idle connections pin no memory
+    ring->buf_ring_len = URING_BUFFERS * sizeof(struct io_uring_buf);
+    ring->buf_ring     = (struct io_uring_buf_ring *)mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+
+    if(ring->buf_ring == MAP_FAILED)
+    {
+        ring->buf_ring = NULL;
+        goto fail;
+    }
+
+    ring->bufs = (uint8_t *)malloc(URING_BUFFERS * bufsize);
+
+    if(ring->bufs == NULL)
+    {
+        goto fail;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr    = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid         = URING_BUFFER_GROUP;
+
+    if(syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        goto fail;
+    }
+
+    for(unsigned int i = 0; i < URING_BUFFERS; i++)
+    {
+        ring_recycle_buffer(ring, (uint16_t)i);
+    }
+
+    return 0;
+
+fail:
+    *err = errno;
+    ring_destroy(ring);
+
+    return -1;
+}
+
+static void ring_destroy(struct uring *ring)
+{
+    if(ring->sqes != NULL)
+    {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+
+    if(ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+    {
+        munmap(ring->cq_ring, ring->cq_ring_len);
+    }
+
+    if(ring->sq_ring != NULL)
+    {
+        munmap(ring->sq_ring, ring->sq_ring_len);
+    }
+
+    if(ring->buf_ring != NULL)
+    {
+        munmap(ring->buf_ring, ring->buf_ring_len);
+    }
+
+    free(ring->bufs);
+    close(ring->ring_fd);
+}
+
+static int ring_submit(struct uring *ring, unsigned int wait_nr, int64_t wait_ns, int *err)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec      ts;
+    unsigned int                  to_submit;
+    unsigned int                  flags;
+    size_t                        arg_len;
+
+    // Publish the locally filled SQEs, then hand everything the kernel has not consumed yet to one enter call
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    flags     = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    arg_len   = 0;
+    memset(&arg, 0, sizeof(arg));
+
+    // A wait with a deadline ahead gives up in time for it, which the kernel reports as ETIME
+    if(wait_nr > 0 && wait_ns >= 0)
+    {
+        ts.tv_sec  = wait_ns / NSEC_PER_SEC;
+        ts.tv_nsec = wait_ns % NSEC_PER_SEC;
+        arg.ts     = (uint64_t)(uintptr_t)&ts;
+        arg_len    = sizeof(arg);
+        flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    if(syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, wait_nr, flags, arg_len > 0 ? &arg : NULL, arg_len) == -1)
+    {
+        if(errno == EINTR || errno == EAGAIN || errno == EBUSY || errno == ETIME)
+        {
+            return 0;
+        }
+        *err = errno;
+        return -1;
+    }
+
+    return 0;
+}
+
+static struct io_uring_sqe *ring_get_sqe(struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+    int                  err;
+
+    // Flush the queue early if it filled up while handling a large batch of completions
+    if(ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        if(ring_submit(ring, 0, -1, &err) == -1 || ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+        {
+            return NULL;
+        }
+    }
+
+    sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local_tail++;
+
+    return sqe;
+}
+
+static void ring_recycle_buffer(struct uring *ring, uint16_t bid)
+{
+    struct io_uring_buf *buf;
+
+    // Only touch addr/len/bid, the ring tail shares its slot with the first entry's reserved field
+    buf       = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->bufs + ((size_t)bid * ring->buf_size));
+    buf->len  = (uint32_t)ring->buf_size;
+    buf->bid  = bid;
+    ring->buf_tail++;
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void reap_completions(struct uring *ring)
+{
+    unsigned int head;
+    unsigned int tail;
+    int          accepted;
+
+    accepted = -1;
+    head     = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    for(; head != tail; head++)
+    {
+        const struct io_uring_cqe *cqe;
+        uint64_t                   user_data;
+        int                        res;
+        uint32_t                   flags;
+
+        cqe       = &ring->cqes[head & *ring->cq_mask];
+        user_data = cqe->user_data;
+        res       = cqe->res;
+        flags     = cqe->flags;
+
+        if(user_data >= URING_TAG_ACCEPT && user_data < URING_TAG_ACCEPT + ring->nservers)
+        {
+            handle_accept(ring, (unsigned int)(user_data - URING_TAG_ACCEPT), res, flags);
+            accepted = ring->server_fds[user_data - URING_TAG_ACCEPT];
+        }
+        else if(user_data == URING_TAG_DRAIN)
+        {
+            if(res > 0)
+            {
+                start_drain(ring);
+            }
+        }
+        else if(user_data != URING_TAG_CLOSE && user_data != URING_TAG_CANCEL)
+        {
+            handle_conn(ring, (struct uring_conn *)(uintptr_t)user_data, res, flags);
+        }
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+    // Once per pass rather than per accept, the multishot accept itself costs no system call
+    if(accepted != -1)
+    {
+        admission_sample_queue(accepted, ring->metrics);
+    }
+}
+
+static void queue_accept(struct uring *ring, unsigned int listener)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_get_sqe(ring);
+
+    if(sqe == NULL)
+    {
+        fprintf(stderr, "io_uring submission queue full, cannot accept\n");
+        return;
+    }
+
+    // A multishot accept stays armed and posts one completion per client
+    sqe->opcode       = IORING_OP_ACCEPT;
+    sqe->fd           = ring->server_fds[listener];
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->ioprio       = ring->multishot_accept ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->user_data    = URING_TAG_ACCEPT + listener;
+}
+
+// The drain eventfd is never read, so a single poll fires once the server that took over the listener is ready
+static void queue_drain(struct uring *ring)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_get_sqe(ring);
+
+    if(sqe == NULL)
+    {
+        fprintf(stderr, "io_uring submission queue full, cannot watch for a drain\n");
+        return;
+    }
+
+    sqe->opcode        = IORING_OP_POLL_ADD;
+    sqe->fd            = ring->admission->drain_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data     = URING_TAG_DRAIN;
+}
+
+// Cancels the operation submitted under user_data; false if there was no room to ask
+static bool queue_cancel(struct uring *ring, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = ring_get_sqe(ring);
+
+    if(sqe == NULL)
+    {
+        return false;
+    }
+
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->addr      = user_data;
+    sqe->user_data = URING_TAG_CANCEL;
+
+    return true;
+}
+
+static void queue_recv(struct uring *ring, struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+    uint8_t             *in;
+    size_t               room;
+
+    sqe = ring_get_sqe(ring);
+
+    if(sqe == NULL)
+    {
+        close_conn(ring, conn);
+        return;
+    }
+
+    room           = copy_input(&conn->copy, &in);
+    conn->op       = URING_OP_RECV;
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->fd        = conn->copy.fd;
+    sqe->user_data = (uint64_t)(uintptr_t)conn;
+
+    // A streaming connection already owns a large buffer, receive straight into it
+    if(room > ring->buf_size)
+    {
+        sqe->addr = (uint64_t)(uintptr_t)in;
+        sqe->len  = (uint32_t)room;
+    }
+    else
+    {
+        sqe->len       = (uint32_t)room;
+        sqe->flags     = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+    }
+}
+
+static void queue_send(struct uring *ring, struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+    const struct iovec  *iov;
+
+    sqe = ring_get_sqe(ring);
+
+    if(sqe == NULL)
+    {
+        close_conn(ring, conn);
+        return;
+    }
+
+    memset(&conn->msg, 0, sizeof(conn->msg));
+    conn->msg.msg_iovlen = copy_output(&conn->copy, &iov);
+    conn->msg.msg_iov    = (struct iovec *)(uintptr_t)iov;
+    conn->op             = URING_OP_SEND;
+    sqe->opcode          = IORING_OP_SENDMSG;
+    sqe->fd              = conn->copy.fd;
+    sqe->addr            = (uint64_t)(uintptr_t)&conn->msg;
+    sqe->len             = 1;
+    sqe->msg_flags       = MSG_NOSIGNAL;
+    sqe->user_data       = (uint64_t)(uintptr_t)conn;
+}
+
+static void queue_splice(struct uring *ring, struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+    int                  fd_in;
+    int                  fd_out;
+    size_t               len;
+
+    sqe = ring_get_sqe(ring);
+
+    if(sqe == NULL)
+    {
+        close_conn(ring, conn);
+        return;
+    }
+
+    len                = copy_splice(&conn->copy, &fd_in, &fd_out);
+    conn->op           = URING_OP_SPLICE;
+    sqe->opcode        = IORING_OP_SPLICE;
+    sqe->splice_fd_in  = fd_in;
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->fd            = fd_out;
+    sqe->off           = (uint64_t)-1;
+    sqe->len           = (uint32_t)len;
+    sqe->splice_flags  = SPLICE_F_MOVE;
+    sqe->user_data     = (uint64_t)(uintptr_t)conn;
+}
+
+static void handle_accept(struct uring *ring, unsigned int listener, int res, uint32_t flags)
+{
+    // Kernels without multishot accept reject it, on every listener, so each drops back to one accept per completion
+    if(res == -EINVAL && ring->multishot_refused < ring->nservers && !ring->draining)
+    {
+        ring->multishot_accept = false;
+        ring->multishot_refused++;
+        queue_accept(ring, listener);
+        return;
+    }
+
+    // The accept was cancelled on purpose, whoever still queues up is the new server's
+    if(res == -ECANCELED && ring->draining)
+    {
+        return;
+    }
+
+    if(res < 0)
+    {
+        fprintf(stderr, "Failed to accept client connection: %s\n", strerror(-res));
+    }
+    else if(!admission_enter(ring->admission))
+    {
+        admission_shed(res, ring->metrics);
+    }
+    else
+    {
+        struct uring_conn *conn;
+        int                err;
+
+        conn = (struct uring_conn *)pool_alloc(ring->pool, sizeof(*conn));
+
+        if(conn == NULL || copy_state_init(&conn->copy, res, ring->buf_size, ring->pool, &err) == -1)
+        {
+            perror("Memory allocation error");
+            pool_free(ring->pool, conn, sizeof(*conn));
+            admission_leave(ring->admission);
+            close(res);
+        }
+        else
+        {
+            conn->copy.metrics = ring->metrics;
+            conn->timed_out    = false;
+            conn->drained      = false;
+            conn->requesting   = false;
+            conn->prev         = NULL;
+            conn->next         = ring->conns;
+
+            if(ring->conns != NULL)
+            {
+                ring->conns->prev = conn;
+            }
+            ring->conns = conn;
+            timer_init(&conn->timer);
+            metrics_accept(ring->metrics);
+            advance_conn(ring, conn);
+        }
+    }
+
+    if(!(flags & IORING_CQE_F_MORE) && !ring->draining)
+    {
+        queue_accept(ring, listener);
+    }
+}
+
+static void handle_conn(struct uring *ring, struct uring_conn *conn, int res, uint32_t flags)
+{
+    ssize_t result;
+
+    // Whatever the cancelled operation brought back is dropped, only a selected buffer has to be handed back
+    if(conn->timed_out)
+    {
+        if(conn->op == URING_OP_RECV && res >= 0 && (flags & IORING_CQE_F_BUFFER))
+        {
+            ring_recycle_buffer(ring, (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT));
+        }
+        copy_report_timeout(&conn->copy);
+        close_conn(ring, conn);
+        return;
+    }
+
+    // A request that slipped in ahead of the cancel is still answered, otherwise the connection just goes
+    if(conn->drained)
+    {
+        conn->drained = false;
+
+        if(conn->op != URING_OP_RECV || res <= 0)
+        {
+            close_conn(ring, conn);
+            return;
+        }
+    }
+
+    if(conn->op == URING_OP_RECV)
+    {
+        uint8_t *in;
+        size_t   room;
+
+        // Every provided buffer is momentarily in use, just ask again
+        if(res == -ENOBUFS)
+        {
+            queue_recv(ring, conn);
+            return;
+        }
+
+        if(res < 0)
+        {
+            copy_report_error(ring->metrics, -2, -res);
+            close_conn(ring, conn);
+            return;
+        }
+
+        if(flags & IORING_CQE_F_BUFFER)
+        {
+            uint16_t bid;
+
+            bid  = (uint16_t)(flags >> IORING_CQE_BUFFER_SHIFT);
+            room = copy_input(&conn->copy, &in);
+            memcpy(in, ring->bufs + ((size_t)bid * ring->buf_size), (size_t)res < room ? (size_t)res : room);
+            ring_recycle_buffer(ring, bid);
+        }
+
+        // A request holds a slot from its first byte until its reply is out; one that finds none left is answered
+        // BUSY before it costs a conversion
+        if(res > 0 && !conn->requesting && copy_waiting(&conn->copy) == COPY_WAIT_IDLE)
+        {
+            if(!admission_request_enter(ring->admission))
+            {
+                admission_refuse(conn->copy.fd, ring->metrics);
+                close_conn(ring, conn);
+                return;
+            }
+            conn->requesting = true;
+        }
+
+        result = copy_received(&conn->copy, (size_t)res);
+    }
+    else if(conn->op == URING_OP_SEND)
+    {
+        if(res < 0)
+        {
+            copy_report_error(ring->metrics, -4, -res);
+            close_conn(ring, conn);
+            return;
+        }
+
+        result = copy_sent(&conn->copy, (size_t)res);
+    }
+    else
+    {
+        if(res < 0)
+        {
+            copy_report_error(ring->metrics, conn->copy.piped > 0 ? -4 : -2, -res);
+            close_conn(ring, conn);
+            return;
+        }
+
+        result = copy_spliced(&conn->copy, (size_t)res);
+    }
+
+    if(result < 0)
+    {
+        copy_report_error(ring->metrics, result, 0);
+        close_conn(ring, conn);
+        return;
+    }
+
+    advance_conn(ring, conn);
+}
+
+static void advance_conn(struct uring *ring, struct uring_conn *conn)
+{
+    uint64_t deadline;
+    int      fd_in;
+    int      fd_out;
+
+    if(conn->requesting && copy_waiting(&conn->copy) == COPY_WAIT_IDLE)
+    {
+        admission_request_leave(ring->admission);
+        conn->requesting = false;
+    }
+
+    // A draining server lets a connection go as soon as it has nothing left in hand
+    if(ring->draining && copy_between_requests(&conn->copy))
+    {
+        close_conn(ring, conn);
+        return;
+    }
+
+    // Whatever the connection waits for next is on its own clock from here
+    deadline = copy_deadline(&conn->copy, ring->timeouts, ring->now);
+
+    if(deadline != 0)
+    {
+        timer_schedule(&ring->wheel, &conn->timer, deadline);
+    }
+    else
+    {
+        timer_cancel(&ring->wheel, &conn->timer);
+    }
+
+    // Passthrough streams move through a pipe in the kernel instead
+    if(copy_splice(&conn->copy, &fd_in, &fd_out) > 0)
+    {
+        queue_splice(ring, conn);
+    }
+    else if(conn->copy.phase == COPY_PHASE_READ)
+    {
+        queue_recv(ring, conn);
+    }
+    else if(conn->copy.phase == COPY_PHASE_WRITE)
+    {
+        queue_send(ring, conn);
+    }
+    else
+    {
+        close_conn(ring, conn);
+    }
+}
+
+// A connection past its deadline always has an operation in flight; cancel it and close once it comes back
+static void expire_conns(struct uring *ring)
+{
+    struct timer *timer;
+
+    timer = timer_expire(&ring->wheel, ring->now);
+
+    while(timer != NULL)
+    {
+        struct uring_conn *conn;
+
+        conn            = (struct uring_conn *)(void *)((uint8_t *)timer - offsetof(struct uring_conn, timer));
+        timer           = timer->next;
+        conn->timed_out = true;
+
+        // Without room in the queue, shutting the socket down ends the operation just the same
+        if(!queue_cancel(ring, (uint64_t)(uintptr_t)conn))
+        {
+            shutdown(conn->copy.fd, SHUT_RDWR);
+        }
+    }
+}
+
+// Stops accepting, leaving the queues to the server that took over the listeners, and cancels the receive of whoever
+// is between requests; connections in the middle of one close in advance_conn() once their reply is out
+static void start_drain(struct uring *ring)
+{
+    ring->draining = true;
+
+    for(unsigned int i = 0; i < ring->nservers; i++)
+    {
+        queue_cancel(ring, URING_TAG_ACCEPT + i);
+    }
+
+    for(struct uring_conn *conn = ring->conns; conn != NULL; conn = conn->next)
+    {
+        if(conn->timed_out || !copy_between_requests(&conn->copy))
+        {
+            continue;
+        }
+
+        conn->drained = true;
+
+        if(!queue_cancel(ring, (uint64_t)(uintptr_t)conn))
+        {
+            shutdown(conn->copy.fd, SHUT_RDWR);
+        }
+    }
+}
+
+static void close_conn(struct uring *ring, struct uring_conn *conn)
+{
+    struct io_uring_sqe *sqe;
+
+    if(conn->prev != NULL)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        ring->conns = conn->next;
+    }
+
+    if(conn->next != NULL)
+    {
+        conn->next->prev = conn->prev;
+    }
+
+    timer_cancel(&ring->wheel, &conn->timer);
+    sqe = ring_get_sqe(ring);
+
+    // Closing through the ring saves the syscall; fall back to close() if the queue is full
+    if(sqe == NULL)
+    {
+        close(conn->copy.fd);
+    }
+    else
+    {
+        sqe->opcode    = IORING_OP_CLOSE;
+        sqe->fd        = conn->copy.fd;
+        sqe->user_data = URING_TAG_CLOSE;
+    }
+
+    metrics_close(ring->metrics);
+    admission_leave(ring->admission);
+
+    if(conn->requesting)
+    {
+        admission_request_leave(ring->admission);
+    }
+    copy_state_destroy(&conn->copy);
+    pool_free(ring->pool, conn, sizeof(*conn));
+}
+
+#else
+
+bool uring_supported(size_t bufsize)
+{
+    (void)bufsize;
+
+    return false;
+}
+
+int run_uring_loop(int *server_fds, unsigned int nservers, size_t bufsize, struct buffer_pool *pool, struct admission *admission, const struct copy_timeouts *timeouts, struct worker_metrics *metrics, int *err)
+{
+    (void)server_fds;
+    (void)nservers;
+    (void)bufsize;
+    (void)pool;
+    (void)admission;
+    (void)timeouts;
+    (void)metrics;
+    *err = ENOSYS;
+
+    return -1;
+}
+
+#endif
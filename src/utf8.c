@@ -0,0 +1,206 @@
+#include "../include/utf8.h"
+#include "../include/case_table.h"
+#include <limits.h>
+
+// Continuation bytes are 10xxxxxx and carry six bits each
+#define UTF8_CONT_MASK 0xC0
+#define UTF8_CONT 0x80
+#define UTF8_CONT_BITS 6
+#define UTF8_PAYLOAD 0x3F
+
+// Lead bytes, with the overlong two-byte forms C0 and C1 and everything past U+10FFFF (F5 and up) excluded
+#define UTF8_LEAD2_FIRST 0xC2
+#define UTF8_LEAD3_FIRST 0xE0
+#define UTF8_LEAD4_FIRST 0xF0
+#define UTF8_LEAD4_LAST 0xF4
+
+#define UTF8_MIN2 0x80
+#define UTF8_MIN3 0x800
+#define UTF8_MIN4 0x10000
+#define UNICODE_MAX 0x10FFFF
+#define SURROGATE_FIRST 0xD800
+#define SURROGATE_LAST 0xDFFF
+
+// Typographic apostrophe, as in don’t
+#define RIGHT_SINGLE_QUOTE 0x2019
+
+static uint32_t map_case(uint32_t cp, const struct case_range *ranges, size_t count);
+
+// Returns the length of the character at data and its code point, or 0 for a malformed or truncated one
+size_t utf8_decode(const uint8_t *data, size_t len, uint32_t *cp)
+{
+    static const uint8_t lead_bits[] = {0, 0, 0x1F, 0x0F, 0x07};    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    static const uint32_t min_cp[]   = {0, 0, UTF8_MIN2, UTF8_MIN3, UTF8_MIN4};
+    uint8_t               lead;
+    size_t                n;
+
+    lead = data[0];
+
+    if(lead < UTF8_LEAD2_FIRST || lead > UTF8_LEAD4_LAST)
+    {
+        return 0;
+    }
+
+    n = lead >= UTF8_LEAD4_FIRST ? 4 : lead >= UTF8_LEAD3_FIRST ? 3 : 2;    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+    if(n > len)
+    {
+        return 0;
+    }
+
+    *cp = lead & lead_bits[n];
+
+    for(size_t i = 1; i < n; i++)
+    {
+        if((data[i] & UTF8_CONT_MASK) != UTF8_CONT)
+        {
+            return 0;
+        }
+        *cp = *cp << UTF8_CONT_BITS | (data[i] & UTF8_PAYLOAD);
+    }
+
+    // Overlong forms, surrogates and values past the last code point do not encode characters
+    if(*cp < min_cp[n] || (*cp >= SURROGATE_FIRST && *cp <= SURROGATE_LAST) || *cp > UNICODE_MAX)
+    {
+        return 0;
+    }
+
+    return n;
+}
+
+// Writes cp back in exactly n bytes; the case tables only hold mappings that keep the length
+void utf8_encode(uint8_t *data, size_t n, uint32_t cp)
+{
+    static const uint8_t lead_marks[] = {0, 0, 0xC0, 0xE0, 0xF0};    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+    for(size_t i = n - 1; i > 0; i--)
+    {
+        data[i] = (uint8_t)(UTF8_CONT | (cp & UTF8_PAYLOAD));
+        cp >>= UTF8_CONT_BITS;
+    }
+    data[0] = (uint8_t)(lead_marks[n] | cp);
+}
+
+// Length of the longest prefix that does not end in the middle of a character
+size_t utf8_complete(const uint8_t *data, size_t len)
+{
+    for(size_t back = 1; back < UTF8_MAX_LEN && back <= len; back++)
+    {
+        uint8_t c;
+        size_t  n;
+
+        c = data[len - back];
+
+        if((c & UTF8_CONT_MASK) == UTF8_CONT)
+        {
+            continue;
+        }
+
+        if(c < UTF8_CONT)
+        {
+            return len;
+        }
+
+        n = c >= UTF8_LEAD4_FIRST ? 4 : c >= UTF8_LEAD3_FIRST ? 3 : 2;    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+        return n > back ? len - back : len;
+    }
+
+    return len;
+}
+
+// Mappings of code points past U+007F, ASCII is left to the vector kernels
+uint32_t utf8_upper(uint32_t cp)
+{
+    if(cp < CASE_TWO_BYTE_END)
+    {
+        return cp >= CASE_TWO_BYTE_FIRST ? (uint32_t)((int32_t)cp + upper_two_byte[cp - CASE_TWO_BYTE_FIRST]) : cp;
+    }
+
+    return map_case(cp, upper_ranges, sizeof(upper_ranges) / sizeof(upper_ranges[0]));
+}
+
+uint32_t utf8_lower(uint32_t cp)
+{
+    if(cp < CASE_TWO_BYTE_END)
+    {
+        return cp >= CASE_TWO_BYTE_FIRST ? (uint32_t)((int32_t)cp + lower_two_byte[cp - CASE_TWO_BYTE_FIRST]) : cp;
+    }
+
+    return map_case(cp, lower_ranges, sizeof(lower_ranges) / sizeof(lower_ranges[0]));
+}
+
+// Letters, marks, numbers and the typographic apostrophe keep a word going; ASCII is the caller's
+bool utf8_is_word(uint32_t cp)
+{
+    size_t low;
+    size_t high;
+
+    if(cp < CASE_TWO_BYTE_END)
+    {
+        return cp >= CASE_TWO_BYTE_FIRST && (word_two_byte[(cp - CASE_TWO_BYTE_FIRST) / CHAR_BIT] >> (cp % CHAR_BIT) & 1) != 0;
+    }
+
+    if(cp == RIGHT_SINGLE_QUOTE)
+    {
+        return true;
+    }
+
+    low  = 0;
+    high = sizeof(word_ranges) / sizeof(word_ranges[0]);
+
+    while(low < high)
+    {
+        size_t mid;
+
+        mid = low + (high - low) / 2;
+
+        if(cp < word_ranges[mid].first)
+        {
+            high = mid;
+        }
+        else if(cp > word_ranges[mid].last)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static uint32_t map_case(uint32_t cp, const struct case_range *ranges, size_t count)
+{
+    size_t low;
+    size_t high;
+
+    low  = 0;
+    high = count;
+
+    while(low < high)
+    {
+        const struct case_range *range;
+        size_t                   mid;
+
+        mid   = low + (high - low) / 2;
+        range = &ranges[mid];
+
+        if(cp < range->first)
+        {
+            high = mid;
+        }
+        else if(cp > range->last)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            return (cp - range->first) % range->stride == 0 ? (uint32_t)((int32_t)cp + range->delta) : cp;
+        }
+    }
+
+    return cp;
+}
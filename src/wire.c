@@ -0,0 +1,51 @@
+#include "../include/wire.h"
+#include <arpa/inet.h>
+#include <string.h>
+
+void wire_encode_header(uint8_t *dst, const struct wire_header *header)
+{
+    uint32_t length;
+    uint32_t request_id;
+
+    length     = htonl(header->length);
+    request_id = htonl(header->request_id);
+    dst[0]     = header->magic;
+    dst[1]     = header->version;
+    dst[2]     = header->opcode;
+    dst[3]     = header->flags;
+    memcpy(dst + 4, &length, sizeof(length));    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    memcpy(dst + 8, &request_id, sizeof(request_id));    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+}
+
+void wire_decode_header(const uint8_t *src, struct wire_header *header)
+{
+    uint32_t length;
+    uint32_t request_id;
+
+    memcpy(&length, src + 4, sizeof(length));    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    memcpy(&request_id, src + 8, sizeof(request_id));    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+    header->magic      = src[0];
+    header->version    = src[1];
+    header->opcode     = src[2];
+    header->flags      = src[3];
+    header->length     = ntohl(length);
+    header->request_id = ntohl(request_id);
+}
+
+void wire_encode_record(uint8_t *dst, const struct wire_record *record)
+{
+    uint32_t length;
+
+    length = htonl(record->length);
+    dst[0] = record->opcode;
+    memcpy(dst + 1, &length, sizeof(length));
+}
+
+void wire_decode_record(const uint8_t *src, struct wire_record *record)
+{
+    uint32_t length;
+
+    memcpy(&length, src + 1, sizeof(length));
+    record->opcode = src[0];
+    record->length = ntohl(length);
+}